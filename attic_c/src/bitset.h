@@ -84,6 +84,16 @@ static inline UNUSED int bitset_test_bit(const bitset_t bs, size_t n) {
     return 1 & (bs[n/bitsizeof(bitset_word_t)].w >> (n%bitsizeof(bitset_word_t)));
 }
 
+/** Return bits n..n+7 of the bitset as a byte, bit n being the lowest.  Bit n
+ * must be within the bitset's size; the bits past the end are garbage.
+ */
+static inline UNUSED uint8_t bitset_get_8_bits(const bitset_t bs, size_t n) {
+    const size_t width = bitsizeof(bitset_word_t);
+    bitset_word_t w = bs[n/width].w >> (n%width);
+    if (n%width > width-8) w |= bs[n/width+1].w << (width - n%width);
+    return (uint8_t)w;
+}
+
 /** Count how many bits are set in the first `n` bits of a bitset.  */
 static inline UNUSED size_t bitset_popcount(const bitset_t bs, size_t n) {
     size_t ret=0, i=0, width = 8*sizeof(bitset_word_t);
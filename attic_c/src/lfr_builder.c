@@ -9,11 +9,23 @@
 #include "util.h"
 #include <errno.h>
 #include <sys/random.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 static const float LFR_HASHTABLE_OVERPROVISION = 1.5;
 
+/* Unmap any files that the builder's keys point into */
+static void lfr_builder_unmap(lfr_builder_t builder) {
+    for (size_t i=0; i<builder->nmapped; i++) {
+        munmap(builder->mapped[i], builder->mapped_bytes[i]);
+    }
+    builder->nmapped = 0;
+}
+
 void API_VIS lfr_builder_destroy(lfr_builder_t builder) {
+    lfr_builder_unmap(builder);
+    free(builder->mapped);
+    free(builder->mapped_bytes);
     free(builder->relations);
     free(builder->data);
     free(builder->hashtable);
@@ -23,6 +35,7 @@ void API_VIS lfr_builder_destroy(lfr_builder_t builder) {
 void API_VIS lfr_builder_reset(lfr_builder_t builder) {
     builder->used = 0;
     builder->data_used = 0;
+    lfr_builder_unmap(builder);
 
     /* Clear the hash table */
     for (size_t i=0; i<builder->hash_capacity; i++) {
@@ -30,7 +43,6 @@ void API_VIS lfr_builder_reset(lfr_builder_t builder) {
     }
 }
 
-#define LFR_DEFAULT_TRIES 20
 int API_VIS lfr_builder_init (
     lfr_builder_t builder,
     size_t capacity,
@@ -44,10 +56,21 @@ int API_VIS lfr_builder_init (
     builder->data_capacity = 0;
     builder->salt_hint = 0;
     builder->max_tries = LFR_DEFAULT_TRIES;
+    builder->parallel_tries = 1;
+    builder->memory_limit = 0;
+    builder->max_stash = 0;
+    builder->blocksize = 0;
+    builder->overprovision = 0;
+    builder->shape = LFR_SHAPE_FRAYED;
+    builder->precondition = 0;
+    builder->engine = LFR_ENGINE_FRAYED;
     builder->flags = flags;
     builder->data = NULL;
     builder->relations = NULL;
     builder->hashtable = NULL;
+    builder->mapped = NULL;
+    builder->mapped_bytes = NULL;
+    builder->nmapped = 0;
 
     /* Choose random salt */
     int ret = getentropy(&builder->salt, sizeof(builder->salt));
@@ -89,6 +112,50 @@ int API_VIS lfr_builder_init (
     return 0;
 }
 
+/* Expand the relations and hash table to new_capacity, and rebuild the hash table */
+static int lfr_builder_grow(lfr_builder_t builder, size_t new_capacity) {
+    size_t hash_capacity = new_capacity * LFR_HASHTABLE_OVERPROVISION;
+
+    if (!(builder->flags & LFR_NO_HASHTABLE)) {
+        /* Expand the hash table.  Do this first: otherwise if realloc'ing the relations
+            * were to fail, but this step were to succeed, then we would still have to rebuild
+            * the hash table to adjust the pointers.
+            */
+        lfr_relation_t **newh = realloc(builder->hashtable, hash_capacity * sizeof(*builder->hashtable));
+        if (newh == NULL) return ENOMEM;
+        builder->hashtable = newh;
+    }
+
+    lfr_relation_t *new = realloc(builder->relations, new_capacity * sizeof(*new));
+    if (new == NULL) return ENOMEM;
+    builder->relations = new;
+    builder->capacity = new_capacity;
+
+    if (!(builder->flags & LFR_NO_HASHTABLE)) {
+        /* Rebuild the hash table */
+        for (size_t i=0; i<hash_capacity; i++) {
+            builder->hashtable[i] = NULL;
+        }
+        for (size_t i=0; i<builder->used; i++) {
+            uint64_t a_hash = lfr_hash(
+                builder->relations[i].key,
+                builder->relations[i].keybytes,
+                builder->salt
+            ).low64;
+            a_hash %= hash_capacity;
+            for (; builder->hashtable[a_hash] != NULL; a_hash = (a_hash+1) % hash_capacity) {}
+            builder->hashtable[a_hash] = &builder->relations[i];
+        }
+        builder->hash_capacity = hash_capacity;
+    }
+    return 0;
+}
+
+int API_VIS lfr_builder_reserve(lfr_builder_t builder, size_t capacity) {
+    if (capacity <= builder->capacity) return 0;
+    return lfr_builder_grow(builder, capacity);
+}
+
 static lfr_response_t *lfr_builder_really_insert (
     lfr_builder_t builder,
     const uint8_t *key,
@@ -100,46 +167,13 @@ static lfr_response_t *lfr_builder_really_insert (
 
     /* Make sure we have space */
     if (builder->used >= builder->capacity) {
-        size_t new_capacity = 2*builder->capacity + CAPACITY_STEP;
-        size_t hash_capacity = new_capacity * LFR_HASHTABLE_OVERPROVISION;
-
-        if (!(builder->flags & LFR_NO_HASHTABLE)) {
-            /* Expand the hash table.  Do this first: otherwise if realloc'ing the relations
-                * were to fail, but this step were to succeed, then we would still have to rebuild
-                * the hash table to adjust the pointers.
-                */
-            lfr_relation_t **newh = realloc(builder->hashtable, hash_capacity * sizeof(*builder->hashtable));
-            if (newh == NULL) return NULL;
-            builder->hashtable = newh;
-        }
-
-        lfr_relation_t *new = realloc(builder->relations, new_capacity * sizeof(*new));
-        if (new == NULL) return NULL;
-        builder->relations = new;
-        builder->capacity = new_capacity;
+        if (lfr_builder_grow(builder, 2*builder->capacity + CAPACITY_STEP)) return NULL;
 
         if (!(builder->flags & LFR_NO_HASHTABLE)) {
-            /* Rebuild the hash table */
-            for (size_t i=0; i<hash_capacity; i++) {
-                builder->hashtable[i] = NULL;
-            }
-            for (size_t i=0; i<builder->used; i++) {
-                uint64_t a_hash = lfr_hash(
-                    builder->relations[i].key,
-                    builder->relations[i].keybytes,
-                    builder->salt
-                ).low64;
-                a_hash %= hash_capacity;
-                for (; builder->hashtable[a_hash] != NULL; a_hash = (a_hash+1) % hash_capacity) {}
-                builder->hashtable[a_hash] = &builder->relations[i];
-            }
-
             /* Refind the insertion point */
             hash = lfr_hash(key,keybytes,builder->salt).low64;
-            hash %= hash_capacity;
-            for (; builder->hashtable[hash] != NULL; hash = (hash+1) % hash_capacity) {}
-
-            builder->hash_capacity = hash_capacity;
+            hash %= builder->hash_capacity;
+            for (; builder->hashtable[hash] != NULL; hash = (hash+1) % builder->hash_capacity) {}
         }
     }
 
@@ -180,32 +214,45 @@ static lfr_response_t *lfr_builder_really_insert (
     return &builder->relations[row].value;
 }
 
-static lfr_response_t *lfr_builder_lookup_core (
+static lfr_response_t *lfr_builder_lookup_hashed (
     const lfr_builder_t builder,
     const uint8_t *key,
     size_t keybytes,
+    uint64_t hash,
     uint64_t *hash_p /* Return to save time */
 ) {
-
     /* Look up in the hashtable */
     lfr_relation_t *ret = NULL;
-    uint64_t hash=0;
     if (!(builder->flags & LFR_NO_HASHTABLE)) {
         if (builder->hash_capacity == 0) {
-            *hash_p = 0;
+            if (hash_p) *hash_p = 0;
             return NULL;
         }
-        hash = lfr_hash(key,keybytes,builder->salt).low64;
         hash %= builder->hash_capacity;
         for (; (ret = builder->hashtable[hash]) != NULL; hash = (hash+1) % builder->hash_capacity) {
             if (ret->keybytes == keybytes && !bcmp(ret->key,key,keybytes)) break;
         }
+    } else {
+        hash = 0;
     }
 
     if (hash_p) *hash_p = hash;
     return (ret != NULL) ? &ret->value : NULL;
 }
 
+static lfr_response_t *lfr_builder_lookup_core (
+    const lfr_builder_t builder,
+    const uint8_t *key,
+    size_t keybytes,
+    uint64_t *hash_p /* Return to save time */
+) {
+    uint64_t hash = 0;
+    if (!(builder->flags & LFR_NO_HASHTABLE) && builder->hash_capacity) {
+        hash = lfr_hash(key,keybytes,builder->salt).low64;
+    }
+    return lfr_builder_lookup_hashed(builder,key,keybytes,hash,hash_p);
+}
+
 lfr_response_t *API_VIS lfr_builder_lookup (
     const lfr_builder_t builder,
     const uint8_t *key,
@@ -255,3 +302,35 @@ int API_VIS lfr_builder_insert (
     }
     return 0;
 }
+
+int API_VIS _lfr_builder_insert_hashed (
+    lfr_builder_t builder,
+    const uint8_t *key,
+    size_t keybytes,
+    lfr_response_t value,
+    uint64_t hash
+) {
+    lfr_response_t *found = lfr_builder_lookup_hashed(builder,key,keybytes,hash,&hash);
+    if (found == NULL) {
+        found = lfr_builder_really_insert(builder,key,keybytes,value,hash);
+        if (found == NULL) return ENOMEM;
+    } else if (*found != value) {
+        return EEXIST;
+    }
+    return 0;
+}
+
+int API_VIS _lfr_builder_hold_mapping(lfr_builder_t builder, void *base, size_t bytes) {
+    void **new = realloc(builder->mapped, (builder->nmapped+1) * sizeof(*new));
+    if (new == NULL) return ENOMEM;
+    builder->mapped = new;
+
+    size_t *new_bytes = realloc(builder->mapped_bytes, (builder->nmapped+1) * sizeof(*new_bytes));
+    if (new_bytes == NULL) return ENOMEM;
+    builder->mapped_bytes = new_bytes;
+
+    builder->mapped[builder->nmapped] = base;
+    builder->mapped_bytes[builder->nmapped] = bytes;
+    builder->nmapped++;
+    return 0;
+}
@@ -30,6 +30,17 @@ typedef struct {
 #define LFR_NO_COPY_DATA (1<<0) /** Don't copy the data; caller must hold it. */
 #define LFR_NO_HASHTABLE (1<<1) /** Don't hash to dedup; caller is responsible for dedup. */
 
+/** Default number of salts to try before giving up on a build. */
+#define LFR_DEFAULT_TRIES 20
+
+/** Row shapes of uniform maps, for lfr_builder_s::shape */
+#define LFR_SHAPE_FRAYED 0 /** Each row's two blocks are a short distance apart (the default). */
+#define LFR_SHAPE_XOR    1 /** Each row's two blocks are a short xor-distance apart.  Needs about 1/64 overprovision. */
+
+/** Solvers for uniform maps, for lfr_builder_s::engine */
+#define LFR_ENGINE_FRAYED 0 /** Frayed ribbon, solved hierarchically: about 0.1% extra space (the default). */
+#define LFR_ENGINE_FUSE   1 /** Binary fuse, solved by peeling: about 12.5% extra space, but builds faster. */
+
 /** A builder to store the state of a uniform map before compiling it. */
 typedef struct {
     size_t used, capacity;
@@ -39,9 +50,20 @@ typedef struct {
     lfr_relation_t *relations;
     lfr_relation_t **hashtable;
     uint8_t *data;
+    void **mapped;         // files mapped by lfr_builder_load_file, unmapped on reset
+    size_t *mapped_bytes;
+    size_t nmapped;
     uint8_t flags;
     uint8_t salt_hint;
     int max_tries;
+    int parallel_tries;    // number of salts to try at once in a threaded build
+    size_t memory_limit;   // cap on the estimated peak memory of a build, or 0 for none
+    size_t max_stash;      // relations a uniform map may stash instead of retrying, or 0
+    uint8_t blocksize;     // bytes per block of uniform maps (1, 2, 4 or 8), or 0 for LFR_BLOCKSIZE
+    uint16_t overprovision; // uniform maps get 1/overprovision extra columns, or 0 for LFR_OVERPROVISION
+    uint8_t shape;         // row shape of uniform maps: LFR_SHAPE_FRAYED or LFR_SHAPE_XOR
+    uint8_t precondition;  // if nonzero, uniform builds spend columns beyond the default overprovision's on random rows, to solve faster
+    uint8_t engine;        // solver for uniform maps: LFR_ENGINE_FRAYED or LFR_ENGINE_FUSE
 } lfr_builder_s, lfr_builder_t[1];
 
 /**
@@ -141,6 +163,35 @@ lfr_response_t *lfr_builder_lookup_insert (
     lfr_response_t value_if_not_found
 );
 
+/**
+ * Make sure that the builder has room for at least capacity relations,
+ * so that inserting up to that many won't need to resize it.
+ * @return 0 on success.
+ * @return ENOMEM if the space cannot be allocated.
+ */
+int lfr_builder_reserve(lfr_builder_t builder, size_t capacity);
+
+/**
+ * As lfr_builder_insert, but with hash = lfr_hash(key,keybytes,builder->salt).low64
+ * already computed by the caller, e.g. in parallel.  Ignored if the builder
+ * was created with LFR_NO_HASHTABLE.
+ */
+int _lfr_builder_insert_hashed (
+    lfr_builder_t builder,
+    const uint8_t *key,
+    size_t keybytes,
+    lfr_response_t value,
+    uint64_t hash
+);
+
+/**
+ * Make the builder responsible for unmapping a region of memory which its
+ * keys point into.  It will be unmapped on lfr_builder_reset or destroy.
+ * @return 0 on success.
+ * @return ENOMEM if the bookkeeping cannot be allocated.
+ */
+int _lfr_builder_hold_mapping(lfr_builder_t builder, void *base, size_t bytes);
+
 /** Clear any relations in the map. */
 void lfr_builder_reset(lfr_builder_t builder);
 
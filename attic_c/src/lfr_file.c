@@ -6,3 +6,242 @@
  */
 
 #include "lfr_file.h"
+#include "util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if LFR_THREADED
+#include <pthread.h>
+#endif
+
+/** A contiguous run of whole records, parsed by one thread */
+typedef struct {
+    const uint8_t *begin, *end;
+    const lfr_record_format_t *format;
+    lfr_salt_t salt;
+    lfr_relation_t *relations; // output, or NULL to only count the records
+    uint64_t *hashes;          // output hashes for the builder, or NULL
+    size_t count;
+    int ret;
+} lfr_load_chunk_t;
+
+/** Parse a decimal or 0x-prefixed hex value */
+static int parse_value(lfr_response_t *value, const uint8_t *begin, const uint8_t *end) {
+    lfr_response_t ret = 0;
+    unsigned base = 10;
+    if (end-begin > 2 && begin[0] == '0' && (begin[1] == 'x' || begin[1] == 'X')) {
+        base = 16;
+        begin += 2;
+    }
+    if (begin == end) return EINVAL;
+    for (; begin < end; begin++) {
+        unsigned digit;
+        uint8_t c = *begin;
+        if (c >= '0' && c <= '9') digit = c - '0';
+        else if (base == 16 && c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+        else if (base == 16 && c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+        else return EINVAL;
+        lfr_response_t next = ret * base + digit;
+        if ((next - digit) / base != ret) return EINVAL; // overflow
+        ret = next;
+    }
+    *value = ret;
+    return 0;
+}
+
+static void *lfr_load_chunk(void *chunk_void) {
+    lfr_load_chunk_t *chunk = (lfr_load_chunk_t *)chunk_void;
+    const lfr_record_format_t *format = chunk->format;
+    const uint8_t *cur = chunk->begin, *end = chunk->end;
+    size_t count = 0;
+
+    while (cur < end) {
+        const uint8_t *key = cur;
+        size_t keybytes;
+        lfr_response_t value = format->default_value;
+
+        if (format->keybytes) {
+            keybytes = format->keybytes;
+            if (format->valuebytes) value = le2ui(&cur[keybytes], format->valuebytes);
+            cur += keybytes + format->valuebytes;
+        } else {
+            const uint8_t *eol = memchr(cur, '\n', end-cur);
+            if (eol == NULL) eol = end;
+            cur = eol+1;
+            if (eol > key && eol[-1] == '\r') eol--;
+            if (eol == key) continue; // empty line
+
+            const uint8_t *sep = NULL;
+            if (format->separator) {
+                for (const uint8_t *p = eol; p > key; p--) {
+                    if (p[-1] == (uint8_t)format->separator) { sep = p-1; break; }
+                }
+            }
+            if (sep) {
+                chunk->ret = parse_value(&value, sep+1, eol);
+                if (chunk->ret) return NULL;
+                eol = sep;
+            }
+            keybytes = eol - key;
+        }
+
+        if (chunk->relations) {
+            chunk->relations[count].key = key;
+            chunk->relations[count].keybytes = keybytes;
+            chunk->relations[count].value = value;
+            if (chunk->hashes) chunk->hashes[count] = lfr_hash(key,keybytes,chunk->salt).low64;
+        }
+        count++;
+    }
+
+    chunk->count = count;
+    return NULL;
+}
+
+/** Run lfr_load_chunk on all the chunks, in parallel if possible */
+static int lfr_load_chunks(lfr_load_chunk_t *chunks, int nthreads) {
+    int ret = 0;
+#if LFR_THREADED
+    pthread_t threads[nthreads];
+    int i;
+    for (i=1; i<nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, lfr_load_chunk, &chunks[i])) break;
+    }
+    lfr_load_chunk(&chunks[0]);
+    for (int j=1; j<i; j++) pthread_join(threads[j], NULL);
+
+    // If we couldn't start some of the threads, parse those chunks here
+    for (int j=i; j<nthreads; j++) lfr_load_chunk(&chunks[j]);
+#else
+    for (int i=0; i<nthreads; i++) lfr_load_chunk(&chunks[i]);
+#endif
+    for (int i=0; i<nthreads && !ret; i++) ret = chunks[i].ret;
+    return ret;
+}
+
+int API_VIS lfr_builder_load_file (
+    lfr_builder_t builder,
+    const char *path,
+    const lfr_record_format_t *format
+) {
+    return lfr_builder_load_file_threaded(builder,path,format,0);
+}
+
+int API_VIS lfr_builder_load_file_threaded (
+    lfr_builder_t builder,
+    const char *path,
+    const lfr_record_format_t *format,
+    int nthreads
+) {
+    int ret = 0, held = 0;
+    uint8_t *data = NULL;
+    size_t size = 0;
+    uint64_t *hashes = NULL;
+    lfr_load_chunk_t *chunks = NULL;
+    if (format->valuebytes > sizeof(lfr_response_t)) return EINVAL;
+
+    /* Map the file */
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return errno;
+    struct stat st;
+    if (fstat(fd, &st)) {
+        ret = errno;
+        close(fd);
+        return ret;
+    }
+    size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return errno;
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    size_t record_bytes = format->keybytes + format->valuebytes;
+    if (format->keybytes && size % record_bytes) {
+        ret = EINVAL;
+        goto done;
+    }
+
+    nthreads = lfr_nthreads(nthreads);
+
+    /* Split the file into chunks of whole records */
+    chunks = calloc(nthreads, sizeof(*chunks));
+    if (chunks == NULL) {
+        ret = ENOMEM;
+        goto done;
+    }
+    const uint8_t *begin = data, *end = data+size;
+    for (int i=0; i<nthreads; i++) {
+        const uint8_t *cut;
+        if (format->keybytes) {
+            cut = data + (size / record_bytes) * (i+1) / nthreads * record_bytes;
+        } else {
+            cut = data + size * (i+1) / nthreads;
+            if (cut < begin) cut = begin;
+            while (cut < end && cut > data && cut[-1] != '\n') cut++;
+        }
+        chunks[i].begin = begin;
+        chunks[i].end = begin = cut;
+        chunks[i].format = format;
+        chunks[i].salt = builder->salt;
+    }
+
+    /* Count the records */
+    size_t total = 0;
+    if (format->keybytes) {
+        for (int i=0; i<nthreads; i++) {
+            total += chunks[i].count = (chunks[i].end - chunks[i].begin) / record_bytes;
+        }
+    } else {
+        if (( ret = lfr_load_chunks(chunks, nthreads) )) goto done;
+        for (int i=0; i<nthreads; i++) total += chunks[i].count;
+    }
+
+    /* Parse and hash the records into the builder's free space */
+    size_t used = builder->used;
+    if (( ret = lfr_builder_reserve(builder, used + total) )) goto done;
+    int hashing = !(builder->flags & LFR_NO_HASHTABLE);
+    if (hashing) {
+        hashes = malloc(total * sizeof(*hashes));
+        if (hashes == NULL) {
+            ret = ENOMEM;
+            goto done;
+        }
+    }
+    size_t offset = 0;
+    for (int i=0; i<nthreads; offset += chunks[i].count, i++) {
+        chunks[i].relations = &builder->relations[used + offset];
+        chunks[i].hashes = hashing ? &hashes[offset] : NULL;
+    }
+    if (( ret = lfr_load_chunks(chunks, nthreads) )) goto done;
+
+    if (builder->flags & LFR_NO_COPY_DATA) {
+        if (( ret = _lfr_builder_hold_mapping(builder, data, size) )) goto done;
+        held = 1;
+    }
+
+    if (!hashing && (builder->flags & LFR_NO_COPY_DATA)) {
+        /* Already in place */
+        builder->used += total;
+    } else {
+        /* Deduplicate and/or copy.  Inserting moves each relation to an index
+         * at or below its current one, so copy it out first. */
+        for (size_t i=0; i<total && !ret; i++) {
+            lfr_relation_t rel = builder->relations[used + i];
+            ret = _lfr_builder_insert_hashed(builder, rel.key, rel.keybytes, rel.value,
+                hashing ? hashes[i] : 0);
+        }
+    }
+
+done:
+    if (!held) munmap(data, size);
+    free(hashes);
+    free(chunks);
+    return ret;
+}
@@ -15,15 +15,71 @@
 extern "C" {
 #endif
 
+/**
+ * How the records in a key file are laid out.
+ *
+ * If keybytes is nonzero, then the file is a flat array of records, each
+ * of which is keybytes of key followed by valuebytes (at most 8) of
+ * little-endian value.  The file's length must be a multiple of the
+ * record length.
+ *
+ * If keybytes is zero, then the records are newline-delimited text lines,
+ * and empty lines are skipped.  If separator is nonzero, then the key is
+ * the part of the line before the last separator, and the value is the
+ * part after it, in decimal or 0x-prefixed hex.
+ *
+ * Records which don't carry a value get default_value.
+ */
+typedef struct {
+    size_t keybytes;
+    uint8_t valuebytes;
+    char separator;
+    lfr_response_t default_value;
+} lfr_record_format_t;
 
+/**
+ * Load all the records in a file into a builder.  The file is mapped into
+ * memory and parsed in parallel, and the keys are hashed for the builder's
+ * hashtable in the same pass, so only the final insertion is serial.
+ *
+ * If the builder was created with LFR_NO_COPY_DATA, then its keys point
+ * directly into the mapped file, and the builder keeps the file mapped
+ * until it is reset or destroyed.  Otherwise the keys are copied and the
+ * file is unmapped before returning.
+ *
+ * @param builder The builder to add the relations to.
+ * @param path The file to load.
+ * @param format How the records are laid out.
+ * @return 0 on success.
+ * @return EINVAL if the file isn't in the given format.
+ * @return ENOMEM if the builder cannot grow.
+ * @return EEXIST if a key appears twice with different values.
+ * @return errno from the filesystem if the file cannot be mapped.
+ */
+int lfr_builder_load_file (
+    lfr_builder_t builder,
+    const char *path,
+    const lfr_record_format_t *format
+);
 
-
-
+/** As lfr_builder_load_file, but with a given number of threads (0 for default). */
+int lfr_builder_load_file_threaded (
+    lfr_builder_t builder,
+    const char *path,
+    const lfr_record_format_t *format,
+    int nthreads
+);
 
 #ifdef __cplusplus
 } // extern "C"
 
 namespace LibFrayed {
+    /** Load a key file into a builder */
+    inline void load_file(Builder &builder, const char *path, const lfr_record_format_t &format, int nthreads=0) {
+        int ret = lfr_builder_load_file_threaded(builder.builder, path, &format, nthreads);
+        if (ret == ENOMEM) throw std::bad_alloc();
+        else if (ret) throw std::runtime_error("LibFrayed::load_file failed");
+    }
 }
 #endif /* __cplusplus */
 #endif /* __LFR_FILE_H__ */
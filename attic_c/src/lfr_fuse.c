@@ -0,0 +1,241 @@
+/**
+ * @file lfr_fuse.c
+ * @author Mike Hamburg
+ * @copyright 2020-2022 Rambus Inc.
+ * Binary fuse engine for uniform maps.
+ */
+
+#include "lfr_fuse.h"
+#include "util.h"
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+/** Each relation's value is the xor of this many cells */
+#define LFR_FUSE_ARITY 3
+
+/** The data is padded so that a query can load any cell with a whole word and a byte */
+#define LFR_FUSE_PADDING 8
+
+/** Building takes a count, a hash, a value and a queue entry per cell */
+#define LFR_FUSE_BUILD_BYTES_PER_CELL (1 + 8 + 8 + sizeof(size_t))
+
+/** ... and a hash, a value and a slot per relation */
+#define LFR_FUSE_BUILD_BYTES_PER_RELATION (8 + 8 + 1)
+
+/**
+ * Choose the array for n relations: the number of segments (including the
+ * two at the end, which only hold second and third cells) and the log2 of
+ * their length.  The formulas are Graf and Lemire's for arity 3, except that
+ * the capacity gets half a segment more: with only a few dozen segments,
+ * peeling often fails when rounding leaves the array right at their size.
+ */
+static void lfr_fuse_dimensions(size_t *segments, int *segment_bits, size_t n) {
+    int bits = (n > 0) ? (int)floor(log((double)n) / log(3.33) + 2.25) : 2;
+    if (bits > LFR_FUSE_MAX_SEGMENT_BITS) bits = LFR_FUSE_MAX_SEGMENT_BITS;
+    double factor = (n > 1) ? fmax(1.125, 0.875 + 0.25 * log(1e6) / log((double)n)) : 0;
+    size_t count = div_round_up((size_t)round(n * factor) + ((size_t)1 << bits)/2, (size_t)1 << bits);
+    *segments = (count < LFR_FUSE_ARITY) ? LFR_FUSE_ARITY : count;
+    *segment_bits = bits;
+}
+
+/**
+ * Find a relation's cells from its hash.  The first is anywhere but the last
+ * two segments, and the others are in the next two segments, at offsets
+ * xored with more bits of the hash.
+ */
+static inline __attribute__((always_inline))
+void lfr_fuse_positions(size_t pos[LFR_FUSE_ARITY], uint64_t hash, size_t segments, int segment_bits) {
+    size_t length = (size_t)1 << segment_bits, mask = length - 1;
+    size_t first = ((__uint128_t)hash * ((segments - LFR_FUSE_ARITY + 1) << segment_bits)) >> 64;
+    pos[0] = first;
+    pos[1] = (first + length) ^ ((hash >> 18) & mask);
+    pos[2] = (first + 2*length) ^ (hash & mask);
+}
+
+/** Load a cell, which is the low value_bits of the result */
+static inline __attribute__((always_inline))
+uint64_t lfr_fuse_load(const uint8_t *data, size_t cell, int value_bits) {
+    size_t bitpos = cell * value_bits;
+    const uint8_t *p = &data[bitpos/8];
+    int shift = bitpos % 8;
+    uint64_t ret = le2ui(p, 8) >> shift;
+    if (shift + value_bits > 64) ret |= (uint64_t)p[8] << (64 - shift);
+    return ret;
+}
+
+/** Store a cell into zeroized data */
+static void lfr_fuse_store(uint8_t *data, size_t cell, int value_bits, uint64_t value) {
+    size_t bitpos = cell * value_bits;
+    uint8_t *p = &data[bitpos/8];
+    int shift = bitpos % 8;
+    __uint128_t word = (__uint128_t)value << shift;
+    for (int i=0; i<(shift + value_bits + 7)/8; i++) {
+        p[i] |= (uint8_t)(word >> (8*i));
+    }
+}
+
+/** Working state of a build */
+typedef struct {
+    size_t segments, ncells;
+    int segment_bits;
+    uint8_t *count;           // per cell: 4 * the number of relations in it, xor the slots they're in
+    uint64_t *hash;           // per cell: the xor of their hashes
+    lfr_response_t *value;    // per cell: the xor of their values; then the solution
+    size_t *queue;            // cells with one relation in them
+    uint64_t *peeled_hash;    // per relation, in the order peeled
+    lfr_response_t *peeled_value;
+    uint8_t *peeled_slot;     // which of its cells it was peeled from
+} lfr_fuse_build_t;
+
+/**
+ * Hash the relations with a salt, and peel them.  That is, repeatedly find a
+ * cell that only one remaining relation uses, and remove that relation.
+ * @return 0 if every relation was peeled, or EAGAIN if not.
+ */
+static int lfr_fuse_peel(lfr_fuse_build_t *st, const lfr_builder_s *builder, lfr_salt_t salt, lfr_response_t mask) {
+    size_t pos[LFR_FUSE_ARITY];
+    memset(st->count, 0, st->ncells * sizeof(*st->count));
+    memset(st->hash, 0, st->ncells * sizeof(*st->hash));
+    memset(st->value, 0, st->ncells * sizeof(*st->value));
+
+    for (size_t i=0; i<builder->used; i++) {
+        const lfr_relation_t *relation = &builder->relations[i];
+        hash_result_t hash = lfr_hash(relation->key, relation->keybytes, salt);
+        lfr_response_t value = (relation->value ^ hash.low64) & mask;
+        lfr_fuse_positions(pos, hash.high64, st->segments, st->segment_bits);
+        for (int j=0; j<LFR_FUSE_ARITY; j++) {
+            st->count[pos[j]] = (st->count[pos[j]] + 4) ^ j;
+            st->hash[pos[j]] ^= hash.high64;
+            st->value[pos[j]] ^= value;
+        }
+    }
+
+    size_t queued = 0, npeeled = 0;
+    for (size_t cell=0; cell<st->ncells; cell++) {
+        if (st->count[cell] >> 2 == 1) st->queue[queued++] = cell;
+    }
+    while (queued) {
+        size_t cell = st->queue[--queued];
+        if (st->count[cell] >> 2 != 1) continue; // its relation was peeled from another cell
+        uint64_t hash = st->hash[cell];
+        lfr_response_t value = st->value[cell];
+        int slot = st->count[cell] & 3;
+
+        /* Only a relation whose hash is duplicated, or so many relations
+         * that the count overflowed, could make this fail.
+         */
+        lfr_fuse_positions(pos, hash, st->segments, st->segment_bits);
+        if (slot >= LFR_FUSE_ARITY || pos[slot] != cell) return EAGAIN;
+
+        st->peeled_hash[npeeled] = hash;
+        st->peeled_value[npeeled] = value;
+        st->peeled_slot[npeeled] = slot;
+        npeeled++;
+        for (int j=0; j<LFR_FUSE_ARITY; j++) {
+            st->count[pos[j]] = (st->count[pos[j]] - 4) ^ j;
+            st->hash[pos[j]] ^= hash;
+            st->value[pos[j]] ^= value;
+            if (st->count[pos[j]] >> 2 == 1) st->queue[queued++] = pos[j];
+        }
+    }
+    return (npeeled == builder->used) ? 0 : EAGAIN;
+}
+
+int _lfr_fuse_build(lfr_uniform_map_t map, const lfr_builder_t builder, int value_bits) {
+    size_t n = builder->used;
+    memset(map,0,sizeof(*map));
+    if (value_bits < 0) {
+        lfr_response_t union_ = 0;
+        for (size_t i=0; i<n; i++) union_ |= builder->relations[i].value;
+        value_bits = 1 + high_bit(union_);
+    }
+    if (value_bits > (int)(8*sizeof(lfr_response_t))) return EINVAL;
+    lfr_response_t mask = (value_bits == (int)(8*sizeof(mask))) ? -(lfr_response_t)1 : ((lfr_response_t)1 << value_bits) - 1;
+
+    lfr_fuse_build_t st;
+    memset(&st,0,sizeof(st));
+    lfr_fuse_dimensions(&st.segments, &st.segment_bits, n);
+    st.ncells = st.segments << st.segment_bits;
+    size_t vector_bytes = BYTES(st.ncells * value_bits) + LFR_FUSE_PADDING;
+    if (builder->memory_limit && st.ncells * LFR_FUSE_BUILD_BYTES_PER_CELL
+        + n * LFR_FUSE_BUILD_BYTES_PER_RELATION + vector_bytes > builder->memory_limit) {
+        return ENOMEM;
+    }
+
+    int ret = ENOMEM;
+    uint8_t *data = NULL;
+    st.count = malloc(st.ncells * sizeof(*st.count));
+    st.hash = malloc(st.ncells * sizeof(*st.hash));
+    st.value = malloc(st.ncells * sizeof(*st.value));
+    st.queue = malloc(st.ncells * sizeof(*st.queue));
+    st.peeled_hash = malloc(n * sizeof(*st.peeled_hash));
+    st.peeled_value = malloc(n * sizeof(*st.peeled_value));
+    st.peeled_slot = malloc(n * sizeof(*st.peeled_slot));
+    if (st.count == NULL || st.hash == NULL || st.value == NULL || st.queue == NULL) goto done;
+    if (n > 0 && (st.peeled_hash == NULL || st.peeled_value == NULL || st.peeled_slot == NULL)) goto done;
+
+    ret = EAGAIN;
+    for (int i=0; i<builder->max_tries && ret == EAGAIN; i++) {
+        lfr_salt_t salt = fmix64(builder->salt ^ (i+builder->salt_hint));
+        ret = lfr_fuse_peel(&st, builder, salt, mask);
+        if (!ret) {
+            map->salt = salt;
+            map->_salt_hint = i+builder->salt_hint;
+        }
+    }
+    if (ret) goto done;
+
+    /* Solve in the reverse of the order peeled.  Each relation's cell was
+     * only used by relations that were peeled before it, so it can be set
+     * to make that relation's value come out right.
+     */
+    size_t pos[LFR_FUSE_ARITY];
+    memset(st.value, 0, st.ncells * sizeof(*st.value));
+    for (size_t i=n; i-- > 0; ) {
+        lfr_fuse_positions(pos, st.peeled_hash[i], st.segments, st.segment_bits);
+        lfr_response_t value = st.peeled_value[i];
+        for (int j=0; j<LFR_FUSE_ARITY; j++) value ^= st.value[pos[j]];
+        st.value[pos[st.peeled_slot[i]]] = value;
+    }
+
+    data = calloc(1, vector_bytes);
+    if (data == NULL) {
+        ret = ENOMEM;
+        goto done;
+    }
+    for (size_t cell=0; cell<st.ncells; cell++) {
+        lfr_fuse_store(data, cell, value_bits, st.value[cell] & mask);
+    }
+    map->data = data;
+    map->data_is_mine = 1;
+    map->engine = LFR_ENGINE_FUSE;
+    map->blocks = st.segments;
+    map->blocksize = st.segment_bits;
+    map->value_bits = value_bits;
+
+done:
+    free(st.count);
+    free(st.hash);
+    free(st.value);
+    free(st.queue);
+    free(st.peeled_hash);
+    free(st.peeled_value);
+    free(st.peeled_slot);
+    return ret;
+}
+
+lfr_response_t _lfr_fuse_query(const lfr_uniform_map_t map, const uint8_t *key, size_t keybytes) {
+    int value_bits = map->value_bits;
+    hash_result_t hash = lfr_hash(key, keybytes, map->salt);
+    size_t pos[LFR_FUSE_ARITY];
+    lfr_fuse_positions(pos, hash.high64, map->blocks, map->blocksize);
+    lfr_response_t ret = hash.low64;
+    for (int j=0; j<LFR_FUSE_ARITY; j++) ret ^= lfr_fuse_load(map->data, pos[j], value_bits);
+    if (value_bits < (int)(8*sizeof(ret))) ret &= ((lfr_response_t)1 << value_bits) - 1;
+    return ret;
+}
+
+size_t _lfr_fuse_vector_size(const lfr_uniform_map_t map) {
+    return BYTES((map->blocks << map->blocksize) * map->value_bits) + LFR_FUSE_PADDING;
+}
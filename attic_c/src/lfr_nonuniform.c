@@ -442,6 +442,7 @@ int API_VIS lfr_nonuniform_build (
         }
         builder->salt_hint = phase_salt[phase];
         builder->max_tries = LFR_PHASE_TRIES;
+        builder->memory_limit = nonu_builder->memory_limit;
 
         /* Build the uniform map using constrained items */
         for (size_t i=0; i<nrelns; i++) {
@@ -483,7 +484,11 @@ int API_VIS lfr_nonuniform_build (
             }
         }
 
-        if (phase_ret == 0) {
+        if (phase_ret == ENOMEM) {
+            // Retrying with another salt won't help
+            ret = ENOMEM;
+            goto done;
+        } else if (phase_ret == 0) {
             // Success!
             phase++;
             phase_salt[phase] = 0;
@@ -0,0 +1,387 @@
+/**
+ * @file lfr_sharded.c
+ * @author Mike Hamburg
+ * @copyright 2020-2022 Rambus Inc.
+ * Sharded uniform maps.
+ */
+
+#include "lfr_sharded.h"
+#include "util.h"
+#include <errno.h>
+
+#if LFR_THREADED
+#include <pthread.h>
+#endif
+
+/** State shared by the threads building the shards */
+typedef struct {
+    lfr_sharded_map_s *map;
+    const lfr_builder_s *builder; // the relations come from either this...
+    lfr_spill_builder_s *spill;   // ... or this
+    const size_t *order;          // builder's relations, grouped by shard
+    const size_t *offsets;        // where each shard's group starts in order
+    int value_bits;
+    size_t max_tries, max_stash;
+    uint8_t blocksize;
+    uint16_t overprovision;
+    uint8_t shape, precondition, engine;
+    unsigned next;
+    int ret;
+#if LFR_THREADED
+    pthread_mutex_t mut;
+#endif
+} lfr_sharded_build_args_t;
+
+/** A range of the builder's relations to partition, for one thread */
+typedef struct {
+    const lfr_builder_s *builder;
+    lfr_salt_t salt;
+    unsigned nshards;
+    uint32_t *shard_of;
+    size_t begin, end;
+} lfr_sharded_partition_chunk_t;
+
+/** Run fn on each of n argument structs, in parallel if possible.
+ * If args_size is 0, then they all share the same one. */
+static void lfr_sharded_run(void *(*fn)(void *), void *args, size_t args_size, int n) {
+    uint8_t *args_b = (uint8_t *)args;
+#if LFR_THREADED
+    pthread_t threads[n];
+    int i;
+    for (i=1; i<n; i++) {
+        if (pthread_create(&threads[i], NULL, fn, &args_b[i*args_size])) break;
+    }
+    fn(args_b);
+    for (int j=1; j<i; j++) pthread_join(threads[j], NULL);
+
+    // If we couldn't start some of the threads, do their work here
+    for (int j=i; j<n; j++) fn(&args_b[j*args_size]);
+#else
+    for (int i=0; i<n; i++) fn(&args_b[i*args_size]);
+#endif
+}
+
+static void *lfr_sharded_partition_chunk(void *chunk_void) {
+    lfr_sharded_partition_chunk_t *chunk = (lfr_sharded_partition_chunk_t *)chunk_void;
+    const lfr_relation_t *relations = chunk->builder->relations;
+    for (size_t i=chunk->begin; i<chunk->end; i++) {
+        chunk->shard_of[i] = lfr_spill_partition(chunk->salt, relations[i].key, relations[i].keybytes, chunk->nshards);
+    }
+    return NULL;
+}
+
+/** Return whether a shard has no relations, and so is stored as an empty map */
+static inline int lfr_sharded_shard_is_empty(const lfr_uniform_map_s *shard) {
+    return shard->blocks == 0;
+}
+
+/** Build one shard from its relations.  An empty one is left zeroed. */
+static int lfr_sharded_build_one(lfr_sharded_build_args_t *args, unsigned shard) {
+    lfr_builder_t builder;
+    int ret;
+    if (args->builder ? args->offsets[shard] == args->offsets[shard+1] : args->spill->part_used[shard] == 0) {
+        return 0;
+    }
+    if (args->builder) {
+        size_t begin = args->offsets[shard], end = args->offsets[shard+1];
+        ret = lfr_builder_init(builder, end-begin, 0, LFR_NO_COPY_DATA | LFR_NO_HASHTABLE);
+        for (size_t i=begin; i<end && !ret; i++) {
+            const lfr_relation_t *rel = &args->builder->relations[args->order[i]];
+            ret = lfr_builder_insert(builder, rel->key, rel->keybytes, rel->value);
+        }
+    } else {
+        ret = lfr_builder_init(builder, args->spill->part_used[shard], args->spill->part_bytes[shard], 0);
+        if (!ret) ret = lfr_spill_builder_load_partition(builder, args->spill, shard);
+    }
+
+    if (!ret) {
+        builder->salt = fmix64(args->map->salt ^ ((uint64_t)(shard+1) << 32));
+        builder->max_tries = args->max_tries;
+        builder->max_stash = args->max_stash;
+        builder->blocksize = args->blocksize;
+        builder->overprovision = args->overprovision;
+        builder->shape = args->shape;
+        builder->precondition = args->precondition;
+        builder->engine = args->engine;
+        ret = lfr_uniform_build_threaded(&args->map->shards[shard], builder, args->value_bits, 1);
+    }
+    lfr_builder_destroy(builder);
+    return ret;
+}
+
+static void *lfr_sharded_build_thread(void *args_void) {
+    lfr_sharded_build_args_t *args = (lfr_sharded_build_args_t *)args_void;
+    while (1) {
+#if LFR_THREADED
+        pthread_mutex_lock(&args->mut);
+#endif
+        unsigned shard = args->next++;
+        int go = shard < args->map->nshards && !args->ret;
+#if LFR_THREADED
+        pthread_mutex_unlock(&args->mut);
+#endif
+        if (!go) break;
+
+        int ret = lfr_sharded_build_one(args, shard);
+        if (ret) {
+#if LFR_THREADED
+            pthread_mutex_lock(&args->mut);
+#endif
+            if (!args->ret) args->ret = ret;
+#if LFR_THREADED
+            pthread_mutex_unlock(&args->mut);
+#endif
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Build all the shards, with as many workers as fit in memory.
+ * shard_rows and shard_bytes are the largest shard's relations and key bytes.
+ */
+static int lfr_sharded_build_all (
+    lfr_sharded_build_args_t *args,
+    int nthreads,
+    size_t memory_limit,
+    size_t shard_rows,
+    size_t shard_bytes
+) {
+    lfr_sharded_map_s *map = args->map;
+    nthreads = lfr_nthreads(nthreads);
+    if ((unsigned)nthreads > map->nshards) nthreads = map->nshards;
+
+    if (memory_limit) {
+        /* Each worker holds a shard's builder as well as its solver.  Spilled
+         * shards also have their keys and hashtable in memory. */
+        size_t per_worker = _lfr_uniform_estimate_memory(shard_rows, args->value_bits, 1, args->blocksize,
+                args->overprovision, args->precondition, args->max_stash != 0, 1)
+            + shard_rows * sizeof(lfr_relation_t);
+        if (args->spill) per_worker += shard_bytes + 2 * shard_rows * sizeof(lfr_relation_t *);
+        while (nthreads > 1 && nthreads * per_worker > memory_limit) nthreads--;
+        if (per_worker > memory_limit) return ENOMEM;
+    }
+
+    map->shards = calloc(map->nshards, sizeof(*map->shards));
+    if (map->shards == NULL) return ENOMEM;
+
+#if LFR_THREADED
+    int ret = pthread_mutex_init(&args->mut, NULL);
+    if (ret) return ret;
+#endif
+    lfr_sharded_run(lfr_sharded_build_thread, args, 0, nthreads);
+#if LFR_THREADED
+    pthread_mutex_destroy(&args->mut);
+#endif
+    return args->ret;
+}
+
+void API_VIS lfr_sharded_map_destroy(lfr_sharded_map_t map) {
+    if (map->shards) {
+        for (unsigned i=0; i<map->nshards; i++) lfr_uniform_map_destroy(&map->shards[i]);
+    }
+    free(map->shards);
+    memset(map,0,sizeof(*map));
+}
+
+int API_VIS lfr_sharded_build (
+    lfr_sharded_map_t map,
+    const lfr_builder_t builder,
+    int value_bits,
+    unsigned nshards,
+    int nthreads
+) {
+    int ret = 0;
+    size_t n = builder->used;
+    uint32_t *shard_of = NULL;
+    size_t *order = NULL, *offsets = NULL;
+    lfr_sharded_partition_chunk_t *chunks = NULL;
+    memset(map,0,sizeof(*map));
+
+    if (nshards == 0) nshards = (n + LFR_SHARD_ROWS - 1) / LFR_SHARD_ROWS;
+    if (nshards == 0) nshards = 1;
+    map->nshards = nshards;
+    map->salt = builder->salt;
+
+    /* Use the same width for every shard */
+    if (value_bits < 0) {
+        lfr_response_t union_ = 0;
+        for (size_t i=0; i<n; i++) union_ |= builder->relations[i].value;
+        value_bits = 1 + high_bit(union_);
+    }
+
+    /* Find each relation's shard, in parallel */
+    int nchunks = lfr_nthreads(nthreads);
+    shard_of = malloc(n * sizeof(*shard_of));
+    offsets = calloc(nshards+1, sizeof(*offsets));
+    order = malloc(n * sizeof(*order));
+    chunks = calloc(nchunks, sizeof(*chunks));
+    if ((n && (shard_of == NULL || order == NULL)) || offsets == NULL || chunks == NULL) {
+        ret = ENOMEM;
+        goto done;
+    }
+    for (int i=0; i<nchunks; i++) {
+        chunks[i].builder = builder;
+        chunks[i].salt = map->salt;
+        chunks[i].nshards = nshards;
+        chunks[i].shard_of = shard_of;
+        chunks[i].begin = n*i/nchunks;
+        chunks[i].end = n*(i+1)/nchunks;
+    }
+    lfr_sharded_run(lfr_sharded_partition_chunk, chunks, sizeof(*chunks), nchunks);
+
+    /* Group the relations by shard */
+    for (size_t i=0; i<n; i++) offsets[shard_of[i]+1]++;
+    size_t shard_rows = 0;
+    for (unsigned i=0; i<nshards; i++) {
+        if (offsets[i+1] > shard_rows) shard_rows = offsets[i+1];
+        offsets[i+1] += offsets[i];
+    }
+    for (size_t i=0; i<n; i++) order[offsets[shard_of[i]]++] = i;
+    for (unsigned i=nshards; i>0; i--) offsets[i] = offsets[i-1];
+    offsets[0] = 0;
+    free(shard_of);
+    shard_of = NULL;
+
+    lfr_sharded_build_args_t args;
+    memset(&args,0,sizeof(args));
+    args.map = map;
+    args.builder = builder;
+    args.order = order;
+    args.offsets = offsets;
+    args.value_bits = value_bits;
+    args.max_tries = builder->max_tries;
+    args.max_stash = builder->max_stash;
+    args.blocksize = builder->blocksize;
+    args.overprovision = builder->overprovision;
+    args.shape = builder->shape;
+    args.precondition = builder->precondition;
+    args.engine = builder->engine;
+    ret = lfr_sharded_build_all(&args, nthreads, builder->memory_limit, shard_rows, 0);
+
+done:
+    free(chunks);
+    free(shard_of);
+    free(order);
+    free(offsets);
+    if (ret) lfr_sharded_map_destroy(map);
+    return ret;
+}
+
+int API_VIS lfr_sharded_build_from_spill (
+    lfr_sharded_map_t map,
+    lfr_spill_builder_t spill,
+    int value_bits,
+    int nthreads,
+    size_t memory_limit
+) {
+    memset(map,0,sizeof(*map));
+    map->nshards = spill->nparts;
+    map->salt = spill->salt;
+
+    size_t shard_rows = 0, shard_bytes = 0;
+    for (unsigned i=0; i<spill->nparts; i++) {
+        if (spill->part_used[i] > shard_rows) shard_rows = spill->part_used[i];
+        if (spill->part_bytes[i] > shard_bytes) shard_bytes = spill->part_bytes[i];
+    }
+
+    lfr_sharded_build_args_t args;
+    memset(&args,0,sizeof(args));
+    args.map = map;
+    args.spill = spill;
+    args.value_bits = value_bits;
+    args.max_tries = LFR_DEFAULT_TRIES;
+    int ret = lfr_sharded_build_all(&args, nthreads, memory_limit, shard_rows, shard_bytes);
+    if (ret) lfr_sharded_map_destroy(map);
+    return ret;
+}
+
+lfr_response_t API_VIS lfr_sharded_query (
+    const lfr_sharded_map_t map,
+    const uint8_t *key,
+    size_t keybytes
+) {
+    unsigned shard = lfr_spill_partition(map->salt, key, keybytes, map->nshards);
+    if (lfr_sharded_shard_is_empty(&map->shards[shard])) return 0;
+    return lfr_uniform_query(&map->shards[shard], key, keybytes);
+}
+
+typedef struct {
+    uint8_t salt[sizeof(lfr_salt_t)];
+    uint8_t nshards[4];
+} __attribute__((packed)) lfr_sharded_map_header_t;
+
+/* The header is followed by each shard's serial size, in this many bytes LE.
+ * An empty shard has size 0, and no serialized map.
+ */
+#define LFR_SHARD_SIZE_BYTES 6
+
+size_t API_VIS lfr_sharded_map_serial_size(const lfr_sharded_map_t map) {
+    size_t ret = sizeof(lfr_sharded_map_header_t) + map->nshards * LFR_SHARD_SIZE_BYTES;
+    for (unsigned i=0; i<map->nshards; i++) {
+        if (!lfr_sharded_shard_is_empty(&map->shards[i])) ret += lfr_uniform_map_serial_size(&map->shards[i]);
+    }
+    return ret;
+}
+
+int API_VIS lfr_sharded_map_serialize(uint8_t *out, const lfr_sharded_map_t map) {
+    lfr_sharded_map_header_t *header = (lfr_sharded_map_header_t*) out;
+    int ret = ui2le(header->salt, sizeof(header->salt), map->salt);
+    if (ret) return ret;
+    ret = ui2le(header->nshards, sizeof(header->nshards), map->nshards);
+    if (ret) return ret;
+
+    uint8_t *directory = out + sizeof(*header);
+    out = directory + map->nshards * LFR_SHARD_SIZE_BYTES;
+    for (unsigned i=0; i<map->nshards; i++) {
+        int empty = lfr_sharded_shard_is_empty(&map->shards[i]);
+        size_t size = empty ? 0 : lfr_uniform_map_serial_size(&map->shards[i]);
+        ret = ui2le(&directory[i*LFR_SHARD_SIZE_BYTES], LFR_SHARD_SIZE_BYTES, size);
+        if (ret) return ret;
+        if (empty) continue;
+        ret = lfr_uniform_map_serialize(out, &map->shards[i]);
+        if (ret) return ret;
+        out += size;
+    }
+    return 0;
+}
+
+int API_VIS lfr_sharded_map_deserialize (
+    lfr_sharded_map_t map,
+    const uint8_t *data,
+    size_t data_size,
+    uint8_t flags
+) {
+    memset(map,0,sizeof(*map));
+    if (data_size < sizeof(lfr_sharded_map_header_t)) return EINVAL;
+    const lfr_sharded_map_header_t *header = (const lfr_sharded_map_header_t*) data;
+    data_size -= sizeof(*header);
+    data += sizeof(*header);
+
+    size_t nshards = le2ui(header->nshards, sizeof(header->nshards));
+    if (nshards == 0 || data_size / LFR_SHARD_SIZE_BYTES < nshards) return EINVAL;
+    const uint8_t *directory = data;
+    data_size -= nshards * LFR_SHARD_SIZE_BYTES;
+    data += nshards * LFR_SHARD_SIZE_BYTES;
+
+    map->shards = calloc(nshards, sizeof(*map->shards));
+    if (map->shards == NULL) return ENOMEM;
+    map->nshards = nshards;
+    map->salt = le2ui(header->salt, sizeof(header->salt));
+
+    int ret = 0;
+    for (size_t i=0; i<nshards && !ret; i++) {
+        size_t size = le2ui(&directory[i*LFR_SHARD_SIZE_BYTES], LFR_SHARD_SIZE_BYTES);
+        if (size > data_size) {
+            ret = EINVAL;
+            break;
+        }
+        if (size == 0) continue; // empty shard
+        ret = lfr_uniform_map_deserialize(&map->shards[i], data, size, flags);
+        data += size;
+        data_size -= size;
+    }
+    if (!ret && data_size != 0) ret = EINVAL;
+    if (ret) lfr_sharded_map_destroy(map);
+    return ret;
+}
@@ -0,0 +1,204 @@
+/**
+ * @file lfr_sharded.h
+ * @author Mike Hamburg
+ * @copyright 2020-2022 Rambus Inc.
+ *
+ * Sharded uniform maps.  The keys are partitioned by a salted hash into
+ * shards of a few million relations each, and every shard is an ordinary
+ * uniform map which is solved on its own.  Since the solver's cost grows
+ * faster than linearly in the number of relations, this makes large builds
+ * take roughly linear time, and the shards can be built in parallel.  A
+ * shard which fails to solve retries with new salts by itself, without
+ * disturbing the others.
+ *
+ * Queries cost one extra hash of the key, to find the shard.  A shard that
+ * gets no relations is stored as an empty map, which takes no space, and
+ * queries that land in it return 0.
+ */
+#ifndef __LFR_SHARDED_H__
+#define __LFR_SHARDED_H__
+
+#include "lfr_uniform.h"
+#include "lfr_spill.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Default target number of relations in each shard. */
+#define LFR_SHARD_ROWS (1<<21)
+
+/** A compiled sharded map. */
+typedef struct {
+    unsigned nshards;
+    lfr_salt_t salt; // chooses the shard; see lfr_spill_partition
+    lfr_uniform_map_s *shards;
+} lfr_sharded_map_s, lfr_sharded_map_t[1];
+
+/**
+ * Build a sharded map from a builder.  The relations are partitioned using
+ * lfr_spill_partition with the builder's salt, and each shard is built with
+ * the builder's max_tries, max_stash, blocksize, overprovision, shape,
+ * precondition and engine.
+ * The shards are built nthreads at a time, each with one thread, but if
+ * builder->memory_limit is set then fewer are built at once, so that their
+ * estimated memory fits under it.
+ *
+ * @param map The map object.  On success, this function will initialize
+ * the map and allocate memory for it.
+ * @param builder The builder object.
+ * @param value_bits As in lfr_uniform_build.  If -1, then it is computed
+ * from all the relations, so that every shard has the same width.
+ * @param nshards The number of shards, or 0 for one per LFR_SHARD_ROWS relations.
+ * @param nthreads The number of threads, or 0 for default.
+ * @return 0 on success.
+ * @return ENOMEM Not enough memory to solve / return the map, or not even
+ * one shard fits under builder->memory_limit.
+ * @return EAGAIN Some shard failed to solve.
+ */
+int lfr_sharded_build (
+    lfr_sharded_map_t map,
+    const lfr_builder_t builder,
+    int value_bits,
+    unsigned nshards,
+    int nthreads
+);
+
+/**
+ * Build a sharded map with one shard per partition of a spill builder,
+ * so that the relations are never all in memory at once.  Each worker
+ * loads its partition into a builder of its own, which deduplicates it.
+ * The shards use LFR_DEFAULT_TRIES salts each.
+ *
+ * @param map The map object.
+ * @param spill The spill builder.
+ * @param value_bits As in lfr_uniform_build.  If -1, then each shard
+ * gets the width that its own relations need.
+ * @param nthreads The number of threads, or 0 for default.
+ * @param memory_limit If nonzero, build fewer shards at once so that their
+ * estimated memory fits under this many bytes.
+ * @return 0 on success.
+ * @return ENOMEM, EAGAIN as in lfr_sharded_build.
+ * @return EEXIST, EIO as in lfr_spill_builder_load_partition.
+ */
+int lfr_sharded_build_from_spill (
+    lfr_sharded_map_t map,
+    lfr_spill_builder_t spill,
+    int value_bits,
+    int nthreads,
+    size_t memory_limit
+);
+
+/** Destroy a sharded map, and deallocate any memory used to create it. */
+void lfr_sharded_map_destroy(lfr_sharded_map_t map);
+
+/** Query a sharded map.  If the key was used when building
+ * the map, then the same value will be returned.
+ */
+lfr_response_t lfr_sharded_query (
+    const lfr_sharded_map_t map,
+    const uint8_t *key,
+    size_t keybytes
+);
+
+/** Return the number of bytes required to serialize the map */
+size_t lfr_sharded_map_serial_size(const lfr_sharded_map_t map);
+
+/**
+ * Serialize the map.  The output should be lfr_sharded_map_serial_size(map)
+ * bytes long.  It is a short header and a directory of the shards' sizes,
+ * followed by each shard serialized as a uniform map.
+ * @return 0 on success.
+ * @return nonzero on failure.
+ */
+int lfr_sharded_map_serialize(uint8_t *out, const lfr_sharded_map_t map);
+
+/**
+ * Deserialize a map.  If flags & LFR_NO_COPY_DATA, then point to the data; otherwise copy it.
+ * @return 0 on success.
+ * @return nonzero if the map is corrupt.
+ */
+int lfr_sharded_map_deserialize (
+    lfr_sharded_map_t map,
+    const uint8_t *data,
+    size_t data_size,
+    uint8_t flags
+);
+
+#ifdef __cplusplus
+} /* extern "C" */
+
+namespace LibFrayed {
+    /** Wrapper for sharded maps */
+    class ShardedMap {
+    public:
+        /** Wrapped map object */
+        lfr_sharded_map_t map;
+
+        /** Empty constructor */
+        inline ShardedMap() { memset(map,0,sizeof(map)); }
+
+        ShardedMap(const ShardedMap &other) = delete;
+
+        /** Move constructor */
+        inline ShardedMap(ShardedMap &&other) {
+            map[0] = other.map[0];
+            memset(other.map,0,sizeof(other.map));
+        }
+
+        /** Move assignment */
+        inline ShardedMap& operator=(ShardedMap &&other) {
+            lfr_sharded_map_destroy(map);
+            map[0] = other.map[0];
+            memset(other.map,0,sizeof(other.map));
+            return *this;
+        }
+
+        /** Construct from a builder */
+        inline ShardedMap(const Builder &builder, int value_bits, unsigned nshards=0, int nthreads=0) {
+            int ret = lfr_sharded_build(map,builder.builder,value_bits,nshards,nthreads);
+            if (ret == ENOMEM) {
+                throw std::bad_alloc();
+            } else if (ret == EAGAIN) {
+                throw BuildFailedException();
+            } else if (ret) {
+                throw std::runtime_error("LibFrayed::ShardedMap: build failed");
+            }
+        }
+
+        /** Deserialize from vector */
+        inline ShardedMap(const std::vector<uint8_t> &other, uint8_t flags=0) {
+            int ret = lfr_sharded_map_deserialize(map, other.data(), other.size(), flags);
+            if (ret) throw std::runtime_error("corrupt LibFrayed::ShardedMap");
+        }
+
+        /** Destructor */
+        inline ~ShardedMap() { lfr_sharded_map_destroy(map); }
+
+        /** Lookup */
+        inline lfr_response_t lookup(const uint8_t *data, size_t size) const {
+            return lfr_sharded_query(map,data,size);
+        }
+
+        /** Lookup */
+        inline lfr_response_t operator[] (const std::vector<uint8_t> &v) const {
+            return lookup(v.data(),v.size());
+        }
+
+        /** Get serial size */
+        inline size_t serial_size() const { return lfr_sharded_map_serial_size(map); }
+
+        /** Serialize and return as a vector */
+        inline std::vector<uint8_t> serialize() const {
+            std::vector<uint8_t> ret(serial_size());
+            if (lfr_sharded_map_serialize(ret.data(),map)) {
+                throw std::runtime_error("LibFrayed::ShardedMap::serialize failed");
+            }
+            return ret;
+        }
+    };
+}
+
+#endif /* __cplusplus */
+
+#endif /* __LFR_SHARDED_H__ */
@@ -0,0 +1,179 @@
+/**
+ * @file lfr_spill.c
+ * @author Mike Hamburg
+ * @copyright 2020-2022 Rambus Inc.
+ * Out-of-core builders.
+ */
+
+#include "lfr_spill.h"
+#include "util.h"
+#include <errno.h>
+#include <stdio.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LFR_SPILL_BUFSIZE (1<<16)
+
+/* Each record is keybytes (4 bytes LE), value (8 bytes LE), key */
+#define LFR_SPILL_RECORD_HEADER 12
+
+void API_VIS lfr_spill_builder_destroy(lfr_spill_builder_t builder) {
+    if (builder->files) {
+        for (unsigned i=0; i<builder->nparts; i++) {
+            if (builder->files[i]) fclose(builder->files[i]);
+        }
+    }
+    free(builder->files);
+    free(builder->part_used);
+    free(builder->part_bytes);
+    memset(builder,0,sizeof(*builder));
+}
+
+/** Create an anonymous temporary file in tmpdir */
+static FILE *lfr_spill_tmpfile(const char *tmpdir) {
+    if (tmpdir == NULL) return tmpfile();
+
+    const char *template = "/lfr_spill.XXXXXX";
+    size_t len = strlen(tmpdir);
+    char *path = malloc(len + strlen(template) + 1);
+    if (path == NULL) { errno = ENOMEM; return NULL; }
+    memcpy(path,tmpdir,len);
+    strcpy(&path[len],template);
+
+    FILE *ret = NULL;
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+        ret = fdopen(fd,"w+b");
+        if (ret == NULL) close(fd);
+    }
+    free(path);
+    return ret;
+}
+
+int API_VIS lfr_spill_builder_init (
+    lfr_spill_builder_t builder,
+    unsigned nparts,
+    const char *tmpdir
+) {
+    memset(builder,0,sizeof(*builder));
+    if (nparts == 0) return EINVAL;
+
+    if (getentropy(&builder->salt, sizeof(builder->salt))) return errno ? errno : EIO;
+
+    builder->nparts = nparts;
+    builder->files = calloc(nparts, sizeof(*builder->files));
+    builder->part_used = calloc(nparts, sizeof(*builder->part_used));
+    builder->part_bytes = calloc(nparts, sizeof(*builder->part_bytes));
+    if (builder->files == NULL || builder->part_used == NULL || builder->part_bytes == NULL) {
+        lfr_spill_builder_destroy(builder);
+        return ENOMEM;
+    }
+
+    for (unsigned i=0; i<nparts; i++) {
+        builder->files[i] = lfr_spill_tmpfile(tmpdir);
+        if (builder->files[i] == NULL) {
+            int ret = errno ? errno : EIO;
+            lfr_spill_builder_destroy(builder);
+            return ret;
+        }
+        setvbuf(builder->files[i], NULL, _IOFBF, LFR_SPILL_BUFSIZE);
+    }
+
+    return 0;
+}
+
+unsigned API_VIS lfr_spill_partition (
+    lfr_salt_t salt,
+    const uint8_t *key,
+    size_t keybytes,
+    unsigned nparts
+) {
+    uint64_t hash = lfr_hash(key,keybytes,salt).high64;
+    return ((hash>>32) * nparts) >> 32;
+}
+
+/**
+ * After a failed write, cut a partition back to the end of its last whole
+ * record, so that the records written after it still line up.  If the
+ * failure also lost records that were already counted (stdio may drop a
+ * buffer that it couldn't flush), the partition can't be recovered: close
+ * it, so that later inserts into it and loads of it fail with EIO.
+ */
+static void lfr_spill_truncate_partition(lfr_spill_builder_t builder, unsigned part) {
+    FILE *f = builder->files[part];
+    off_t end = builder->part_used[part]*LFR_SPILL_RECORD_HEADER + builder->part_bytes[part];
+    struct stat st;
+    clearerr(f);
+    if (fflush(f) == 0 && fstat(fileno(f),&st) == 0 && st.st_size >= end
+        && ftruncate(fileno(f),end) == 0 && fseeko(f,end,SEEK_SET) == 0) {
+        return;
+    }
+    fclose(f);
+    builder->files[part] = NULL;
+}
+
+int API_VIS lfr_spill_builder_insert (
+    lfr_spill_builder_t builder,
+    const uint8_t *key,
+    size_t keybytes,
+    lfr_response_t value
+) {
+    if (keybytes > UINT32_MAX) return EINVAL;
+    unsigned part = lfr_spill_partition(builder->salt,key,keybytes,builder->nparts);
+    FILE *f = builder->files[part];
+    if (f == NULL) return EIO;
+
+    uint8_t header[LFR_SPILL_RECORD_HEADER];
+    ui2le(header, 4, keybytes);
+    ui2le(&header[4], 8, value);
+    if (fwrite(header,sizeof(header),1,f) != 1 || (keybytes && fwrite(key,keybytes,1,f) != 1)) {
+        lfr_spill_truncate_partition(builder,part);
+        return EIO;
+    }
+
+    builder->used++;
+    builder->part_used[part]++;
+    builder->part_bytes[part] += keybytes;
+    return 0;
+}
+
+int API_VIS lfr_spill_builder_load_partition (
+    lfr_builder_t out,
+    lfr_spill_builder_t builder,
+    unsigned part
+) {
+    if (part >= builder->nparts || (out->flags & LFR_NO_COPY_DATA)) return EINVAL;
+    FILE *f = builder->files[part];
+    if (f == NULL) return EIO;
+    int ret = 0;
+    uint8_t *key = NULL;
+    size_t key_capacity = 0;
+
+    lfr_builder_reset(out);
+    if (fflush(f) || fseeko(f,0,SEEK_SET)) return EIO;
+
+    for (size_t i=0; i<builder->part_used[part]; i++) {
+        uint8_t header[LFR_SPILL_RECORD_HEADER];
+        if (fread(header,sizeof(header),1,f) != 1) { ret = EIO; goto done; }
+        size_t keybytes = le2ui(header, 4);
+        lfr_response_t value = le2ui(&header[4], 8);
+
+        if (keybytes > key_capacity) {
+            uint8_t *new = realloc(key, keybytes);
+            if (new == NULL) { ret = ENOMEM; goto done; }
+            key = new;
+            key_capacity = keybytes;
+        }
+        if (keybytes && fread(key,keybytes,1,f) != 1) { ret = EIO; goto done; }
+
+        if (( ret = lfr_builder_insert(out,key,keybytes,value) )) goto done;
+    }
+
+done:
+    /* Put the file position back at the end, so that we can keep appending */
+    if (fseeko(f,0,SEEK_END) && !ret) ret = EIO;
+    free(key);
+    return ret;
+}
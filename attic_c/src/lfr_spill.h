@@ -0,0 +1,156 @@
+/**
+ * @file lfr_spill.h
+ * @author Mike Hamburg
+ * @copyright 2020-2022 Rambus Inc.
+ *
+ * Out-of-core builders.  A spill builder streams relations into a fixed
+ * number of on-disk partitions, chosen by a salted hash of the key, without
+ * holding them in memory or deduplicating them.  Each partition can then be
+ * loaded into an ordinary builder (which deduplicates it) and compiled on
+ * its own, so peak memory is set by the largest partition instead of by
+ * the whole key set.
+ */
+#ifndef __LFR_SPILL_H__
+#define __LFR_SPILL_H__
+
+#include <stdio.h>
+#include "lfr_builder.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** A builder that spills its relations to disk, partitioned by hash. */
+typedef struct {
+    unsigned nparts;
+    lfr_salt_t salt;
+    size_t used;
+    FILE **files;
+    size_t *part_used;  // number of relations in each partition
+    size_t *part_bytes; // total key bytes in each partition
+} lfr_spill_builder_s, lfr_spill_builder_t[1];
+
+/**
+ * Initialize a spill builder with nparts partitions.  The partitions are
+ * anonymous temporary files, created in tmpdir (or the system default
+ * if tmpdir is NULL) and removed automatically when they are closed.
+ *
+ * @param builder The builder to initialize.
+ * @param nparts The number of partitions.  Must be nonzero.
+ * @param tmpdir Directory for the partition files, or NULL.
+ * @return 0 on success.
+ * @return EINVAL if nparts is zero.
+ * @return ENOMEM if the builder cannot be allocated.
+ * @return errno from the filesystem if the files cannot be created.
+ */
+int lfr_spill_builder_init (
+    lfr_spill_builder_t builder,
+    unsigned nparts,
+    const char *tmpdir
+);
+
+/**
+ * Return the partition which a key belongs to.  This is a multiply-shift
+ * of a salted hash of the key, so it is independent of the hashes used
+ * by the builder's hashtable and by the maps themselves.
+ */
+unsigned lfr_spill_partition (
+    lfr_salt_t salt,
+    const uint8_t *key,
+    size_t keybytes,
+    unsigned nparts
+);
+
+/**
+ * Append a relation to its partition.  Duplicates are not detected here;
+ * they are found when the partition is loaded.
+ *
+ * @return 0 on success.
+ * @return EINVAL if the key is longer than 2^32-1 bytes.
+ * @return EIO if the write fails.  The relation is not inserted, and the
+ * partition is cut back to its last whole record.  If the failure lost
+ * relations that were already inserted, then the partition is closed, and
+ * later inserts into it and loads of it also fail with EIO.
+ */
+int lfr_spill_builder_insert (
+    lfr_spill_builder_t builder,
+    const uint8_t *key,
+    size_t keybytes,
+    lfr_response_t value
+);
+
+/**
+ * Load one partition into an ordinary builder, replacing its contents.
+ * The builder must have been initialized by the caller, and must copy
+ * its data (i.e. not have LFR_NO_COPY_DATA set).  If it has a hashtable,
+ * then duplicate keys are merged.  The same builder may be reused for
+ * each partition in turn, to keep its allocation.
+ *
+ * @return 0 on success.
+ * @return EINVAL if part is out of range or the builder has LFR_NO_COPY_DATA.
+ * @return ENOMEM if the builder cannot grow.
+ * @return EEXIST if a key appears twice with different values.
+ * @return EIO if the partition cannot be read back, or was closed after a
+ * failed insert.
+ */
+int lfr_spill_builder_load_partition (
+    lfr_builder_t out,
+    lfr_spill_builder_t builder,
+    unsigned part
+);
+
+/** Close and remove the partition files, and free the builder's memory. */
+void lfr_spill_builder_destroy(lfr_spill_builder_t builder);
+
+#ifdef __cplusplus
+} /* extern "C" */
+
+namespace LibFrayed {
+    /** C++ wrapper for LibFrayed spill builders */
+    class SpillBuilder {
+    public:
+        /** Wrapped builder object */
+        lfr_spill_builder_t builder;
+
+        /** Construct a spill builder with the given number of partitions */
+        inline SpillBuilder(unsigned nparts, const char *tmpdir=NULL) {
+            int ret = lfr_spill_builder_init(builder,nparts,tmpdir);
+            if (ret == ENOMEM) throw std::bad_alloc();
+            else if (ret) throw std::runtime_error("LibFrayed::SpillBuilder: couldn't create partitions");
+        }
+
+        SpillBuilder(const SpillBuilder &other) = delete;
+
+        /** Destructor */
+        inline ~SpillBuilder() { lfr_spill_builder_destroy(builder); }
+
+        /** Number of relations inserted, including duplicates */
+        inline size_t size() const { return builder->used; }
+
+        /** Number of partitions */
+        inline unsigned nparts() const { return builder->nparts; }
+
+        /** Append a key-value pair */
+        inline void insert(const uint8_t *data, size_t size, lfr_response_t value) {
+            int ret = lfr_spill_builder_insert(builder,data,size,value);
+            if (ret) throw std::runtime_error("LibFrayed::SpillBuilder::insert failed");
+        }
+
+        /** Append a key-value pair */
+        inline void insert(const std::vector<uint8_t> &v, lfr_response_t value) {
+            insert(v.data(),v.size(),value);
+        }
+
+        /** Load a partition into a builder */
+        inline void load_partition(Builder &out, unsigned part) {
+            int ret = lfr_spill_builder_load_partition(out.builder,builder,part);
+            if (ret == ENOMEM) throw std::bad_alloc();
+            else if (ret == EEXIST) throw std::runtime_error("LibFrayed::SpillBuilder: conflicting values for a key");
+            else if (ret) throw std::runtime_error("LibFrayed::SpillBuilder::load_partition failed");
+        }
+    };
+}
+
+#endif /* __cplusplus */
+
+#endif /* __LFR_SPILL_H__ */
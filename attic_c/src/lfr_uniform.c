@@ -7,35 +7,38 @@
 #include "util.h"
 #include "lfr_uniform.h"
 #include "tile_matrix.h"
+#include "lfr_fuse.h"
 #include <string.h>
 #include <errno.h>
+#include <sys/random.h>
+#include <unistd.h>
 
 #if LFR_THREADED
 #include <pthread.h>
-#include <sys/sysctl.h>
 #endif
 
 #ifndef LFR_BLOCKSIZE
-/* The block size in bytes.  You can change it for research purposes,
- * but the resulting library will be incompatible.
+/* The default block size in bytes, for maps whose builder doesn't choose
+ * one.  You can change it for research purposes, but the resulting library
+ * will be incompatible.
  */
 #define LFR_BLOCKSIZE 4
 #endif
 
 const int _lfr_blocksize = LFR_BLOCKSIZE;
 
-#if LFR_BLOCKSIZE==1
-typedef uint8_t lfr_uniform_block_t;
-#elif LFR_BLOCKSIZE==2
-typedef uint16_t lfr_uniform_block_t;
-#elif LFR_BLOCKSIZE==4
-typedef uint32_t lfr_uniform_block_t;
-#elif LFR_BLOCKSIZE==8
-typedef uint64_t lfr_uniform_block_t;
-#else
+/* The largest block size that a builder can choose */
+#define LFR_MAX_BLOCKSIZE 8
+
+#if LFR_BLOCKSIZE!=1 && LFR_BLOCKSIZE!=2 && LFR_BLOCKSIZE!=4 && LFR_BLOCKSIZE!=8
 #error "Need LFR_BLOCKSIZE in [1,2,4,8]"
 #endif
 
+/** Return a builder's or map's block size, given its blocksize field */
+static inline int lfr_uniform_blocksize(uint8_t blocksize) {
+    return blocksize ? blocksize : LFR_BLOCKSIZE;
+}
+
 
 /*************************************************
  * Start of code specific to frayed ribbon shape *
@@ -45,38 +48,70 @@ typedef uint64_t lfr_uniform_block_t;
 typedef uint32_t lfr_uniform_block_index_t;
 
 #ifndef LFR_OVERPROVISION
+/* The default overprovision: maps get 1/LFR_OVERPROVISION extra columns,
+ * or none if it's 0.  Builders can choose their own.
+ */
 #define LFR_OVERPROVISION 1024
 #endif
 
+/** Return a builder's or map's overprovision, given its overprovision field */
+static inline int lfr_uniform_overprovision(uint16_t overprovision) {
+    return overprovision ? overprovision : LFR_OVERPROVISION;
+}
+
+#ifndef LFR_SUBTREE_LEVELS
+/** The bottom levels of the merge tree are merged depth-first, in subtrees this tall */
+#define LFR_SUBTREE_LEVELS 4
+#endif
+
+#ifndef LFR_PRECONDITION_LEVEL
+/** When preconditioning, random rows are added to the merges this many levels up */
+#define LFR_PRECONDITION_LEVEL 6
+#endif
+
 static const size_t EXTRA_ROWS = 8;
-size_t API_VIS _lfr_uniform_provision_columns(size_t rows) {
+size_t API_VIS _lfr_uniform_provision_columns(size_t rows, int blocksize, int overprovision) {
+    blocksize = lfr_uniform_blocksize(blocksize);
+    overprovision = lfr_uniform_overprovision(overprovision);
     size_t cols = rows + EXTRA_ROWS;
-#if LFR_OVERPROVISION
-    cols += cols/LFR_OVERPROVISION;
-#endif
-    cols += (-cols) % (8*LFR_BLOCKSIZE);
-    if (cols <= 8*LFR_BLOCKSIZE) cols = 16*LFR_BLOCKSIZE;
+    if (overprovision) cols += cols/overprovision;
+    cols += (-cols) % (8*blocksize);
+    if (cols <= 8*(size_t)blocksize) cols = 16*blocksize;
     return cols;
 }
 
-size_t API_VIS _lfr_uniform_provision_max_rows(size_t cols) {
+size_t API_VIS _lfr_uniform_provision_max_rows(size_t cols, int blocksize, int overprovision) {
     size_t cols0 = cols;
     (void)cols0;
-#if LFR_OVERPROVISION
-    cols -= cols / (LFR_OVERPROVISION+1);
-#endif
+    overprovision = lfr_uniform_overprovision(overprovision);
+    if (overprovision) cols -= cols / (overprovision+1);
     if (cols <= EXTRA_ROWS) return 0;
-    if (_lfr_uniform_provision_columns(cols-EXTRA_ROWS) > cols0) cols--;
-    assert(_lfr_uniform_provision_columns(cols-EXTRA_ROWS) <= cols0);
+    if (_lfr_uniform_provision_columns(cols-EXTRA_ROWS, blocksize, overprovision) > cols0) cols--;
+    assert(_lfr_uniform_provision_columns(cols-EXTRA_ROWS, blocksize, overprovision) <= cols0);
     return cols - EXTRA_ROWS;
 }
 
-/** The main sampling function: given a seed, sample block positions */
-static inline void _lfr_uniform_sample_block_positions (
+/**
+ * The main sampling function: given a seed, sample block positions.
+ * The overprovision is as in lfr_uniform_overprovision.  It bounds the
+ * stride seed below, which keeps the blocks from being too far apart.
+ *
+ * With LFR_SHAPE_XOR, the blocks only choose the level of the merge tree
+ * at which the row is resolved, and then the second block is resampled
+ * from anywhere in the subtree next to the first one's at that level,
+ * using offset_seed32.  That subtree isn't empty, since it holds the block
+ * that was sampled.
+ */
+static inline __attribute__((always_inline))
+void _lfr_uniform_sample_block_positions (
     lfr_uniform_block_index_t out[2],
     size_t nblocks,
     uint32_t stride_seed32,
-    uint32_t a_seed32
+    uint32_t a_seed32,
+    uint32_t offset_seed32,
+    int blocksize,
+    int overprovision,
+    int shape
 ) {
     /* Parse the seed into uints */
     uint64_t stride_seed = stride_seed32;
@@ -86,20 +121,30 @@ static inline void _lfr_uniform_sample_block_positions (
     // calculate log(nblocks)<<48 in a smooth way
     uint64_t k = high_bit(nblocks);
     uint64_t smoothlog = (k<<48) + (nblocks<<(48-k)) - (1ull<<48);
-    uint64_t leading_coefficient = (12ull<<8)/LFR_BLOCKSIZE; // experimentally determined
+    uint64_t leading_coefficient = (12ull<<8)/blocksize; // experimentally determined
     uint64_t num = smoothlog * leading_coefficient; 
 
-#if LFR_OVERPROVISION
-    stride_seed |= (1ull<<33) / LFR_OVERPROVISION; // | instead of + because it can't overflow
-#endif
+    /* Spare columns beyond the default don't call for a higher bound:
+     * at 1/32 it fails about 10% of solves which succeed without it.
+     */
+    if (overprovision && overprovision < LFR_OVERPROVISION) overprovision = LFR_OVERPROVISION;
+    if (overprovision) stride_seed |= (1ull<<33) / overprovision; // | instead of + because it can't overflow
     uint64_t den = ((stride_seed * stride_seed) * nblocks_huge) >> 32;
-#if (!LFR_OVERPROVISION) || (LFR_OVERPROVISION > 1ull<<16)
-    den++; // to prevent it from being 0
-#endif
+    /* overprovision is at most 0xFFFF, so stride_seed is at least 1<<17, and
+     * den is at least 4*nblocks.  Without overprovision, it could be 0.
+     */
+    if (!overprovision) den++;
     uint64_t b_seed = (num / den + a_seed) & 0xFFFFFFFF; // den can't be 0 because stride_seed is adjusted
 
     uint64_t a = (a_seed * nblocks_huge)>>32, b = (b_seed * nblocks_huge)>>32;
     if (a==b && ++b >= nblocks) b=0;
+    if (shape == LFR_SHAPE_XOR) {
+        int level = high_bit(a ^ b);
+        uint64_t sibling = ((a >> level) ^ 1) << level;
+        uint64_t width = nblocks - sibling;
+        if (width > 1ull<<level) width = 1ull<<level;
+        b = sibling + (((uint64_t)offset_seed32 * width) >> 32);
+    }
     out[0] = a;
     out[1] = b;
 }
@@ -110,7 +155,7 @@ static inline void _lfr_uniform_sample_block_positions (
 
 typedef struct {
     lfr_uniform_block_index_t block_positions[2];
-    uint8_t keyout[2*LFR_BLOCKSIZE];
+    uint8_t keyout[2*LFR_MAX_BLOCKSIZE]; // the first 2*blocksize bytes are used
     lfr_response_t augmented;
 } _lfr_hash_result_t;
 
@@ -119,28 +164,44 @@ _lfr_hash_result_t _lfr_uniform_hash (
     const uint8_t *key,
     size_t key_length,
     lfr_salt_t salt,
-    size_t nblocks
+    size_t nblocks,
+    int blocksize,
+    int overprovision,
+    int shape
 ) {
     _lfr_hash_result_t result;
-    size_t s = sizeof(result.keyout);
+    size_t s = 2*blocksize;
     s += (-s)%8;
-    uint8_t hash[s];
     
     hash_result_t data = lfr_hash(key, key_length, salt);
-    _lfr_uniform_sample_block_positions(result.block_positions,nblocks,(uint32_t)data.high64,data.high64>>32);
+    _lfr_uniform_sample_block_positions(result.block_positions,nblocks,(uint32_t)data.high64,data.high64>>32,data.low64>>32,
+        blocksize,overprovision,shape);
     result.augmented = data.low64;
 
     // PERF: can we optimize this further eg by not cycling through ui2le?
     for (unsigned i=0; i<s/8; i++) {
         data.high64 += data.low64;
         data.low64  ^= rotl64(data.high64, 39);
-        ui2le(&hash[i*8],  8, data.low64);
+        ui2le(&result.keyout[i*8],  8, data.low64);
     }
-    memcpy(result.keyout,hash,sizeof(result.keyout));
 
     return result;
 }
 
+/**
+ * Xor the mask for a wide value into out.  The mask is the hash's augmented
+ * word, followed by more words derived from it, so its first 64 bits are the
+ * same as for a narrow value.
+ */
+static inline void lfr_uniform_xor_wide_mask(uint8_t *out, size_t bytes, lfr_response_t augmented) {
+    for (size_t word=0; word*sizeof(augmented) < bytes; word++) {
+        lfr_response_t mask = word ? fmix64(augmented + word) : augmented;
+        for (size_t i=word*sizeof(augmented); i<bytes && mask; i++, mask >>= 8) {
+            out[i] ^= (uint8_t)mask;
+        }
+    }
+}
+
 /* A structure for tracking when a given half-row will meet its other half */
 typedef struct {
     uint32_t row;       // When it gets merged, what's its row index?
@@ -151,10 +212,14 @@ typedef struct {
 typedef struct {
     tile_matrix_t data;
     resolution_t *row_resolution;
+    size_t *row_relation; // if stashing, which relation each merged row came from; not owned
+    size_t *leaf_relation; // if factoring, which relation's value each leaf row carries, or SIZE_MAX; not owned
     tile_matrix_systematic_t systematic; // from parents
+    tile_matrix_t factor_sys, factor_out; // if factoring: the merged rows' values, times these, give the systematic form's and output's
     size_t cols;
     size_t rows;
-    lfr_salt_t salt;
+    size_t extra_rows; // random rows to add when merging, if preconditioning
+    lfr_salt_t salt;   // seeds the random rows
     int error;
 #if LFR_THREADED
     pthread_cond_t cv;
@@ -180,6 +245,8 @@ static void lfr_builder_destroy_groups(group_t *groups, size_t ngroups) {
         for (size_t i=0; i<ngroups; i++) {
             tile_matrix_destroy(&groups[i].data);
             tile_matrix_systematic_destroy(&groups[i].systematic);
+            tile_matrix_destroy(&groups[i].factor_sys);
+            tile_matrix_destroy(&groups[i].factor_out);
             free(groups[i].row_resolution);
 #if LFR_THREADED
             pthread_cond_destroy(&groups[i].cv);
@@ -190,17 +257,20 @@ static void lfr_builder_destroy_groups(group_t *groups, size_t ngroups) {
     }
 }
 
-static int wait_for_solved(group_t *group, uint8_t solved) {
+static int wait_for_solved(group_t *group, uint8_t solved, const int *cancel) {
 #if LFR_THREADED
     pthread_mutex_lock(&group->mut);
-    while (group->solved != solved && !group->error) {
+    int cancelled = 0;
+    while (group->solved != solved && !group->error
+        && !(cancelled = cancel && __atomic_load_n(cancel, __ATOMIC_RELAXED))) {
         pthread_cond_wait(&group->cv, &group->mut);
     }
-    int ret = group->error;
+    int ret = group->error ? group->error : cancelled ? ECANCELED : 0;
     pthread_mutex_unlock(&group->mut);
     return ret;
 #else
     (void)solved;
+    (void)cancel;
     return group->error;
 #endif
 }
@@ -218,10 +288,31 @@ static void mark_as_solved(group_t *group, uint8_t solved, int error) {
 #endif
 }
 
+static void cancel_all(group_t *groups, size_t ngroups, int *cancel) {
+    /* Tell the other threads to stop, and wake up anyone waiting on a group.
+     * Taking each group's lock after setting the flag means that a waiter
+     * either sees the flag or is already asleep and gets the broadcast.
+     */
+    __atomic_store_n(cancel, 1, __ATOMIC_RELAXED);
+#if LFR_THREADED
+    for (size_t i=0; i<ngroups; i++) {
+        pthread_mutex_lock(&groups[i].mut);
+        pthread_cond_broadcast(&groups[i].cv);
+        pthread_mutex_unlock(&groups[i].mut);
+    }
+#else
+    (void)groups;
+    (void)ngroups;
+#endif
+}
+
 static uint32_t mark_as_mine(group_t *group, uint32_t my_mark) {
 #if LFR_THREADED
-    // return 0 on success, 1 if already taken
-    return __atomic_exchange_n(&group->mark, my_mark, __ATOMIC_RELAXED) == my_mark;
+    // return 0 on success, 1 if already taken.  Only claim it from the previous
+    // mark, so that a straggler can't reclaim a group that's already been
+    // solved in the backward pass.
+    uint32_t prev = my_mark-1;
+    return !__atomic_compare_exchange_n(&group->mark, &prev, my_mark, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
 #else
     (void)group;
     (void)my_mark;
@@ -230,34 +321,199 @@ static uint32_t mark_as_mine(group_t *group, uint32_t my_mark) {
 }
 
 /** Return the number of blocks required for a given number of relations */
-static inline size_t nblocks(size_t nrelns) {
-    return _lfr_uniform_provision_columns(nrelns) / 8 / LFR_BLOCKSIZE;
+static inline size_t nblocks(size_t nrelns, int blocksize, int overprovision) {
+    return _lfr_uniform_provision_columns(nrelns, blocksize, overprovision) / 8 / blocksize;
+}
+
+/** Relations set aside because they made a merge rank-deficient */
+typedef struct {
+    size_t *row_relation; // shared by the groups' row_relation
+    size_t *stashed;      // indices of the stashed relations
+    size_t nstashed, max;
+} lfr_uniform_stash_t;
+
+/* Each stash record is keybytes (4 bytes LE), value (8 bytes LE), key */
+#define LFR_STASH_RECORD_HEADER 12
+
+/** Return the number of slots in a stash's index: a power of 2, at most 1/8 full */
+static inline size_t lfr_uniform_stash_slots(size_t nstash) {
+    return (size_t)2 << high_bit(8*nstash - 1);
+}
+
+/**
+ * Index a map's stash records in an open-addressed table, by the augmented
+ * word of each key's hash.  Each slot holds a record's offset in the stash
+ * plus 1, or 0 if it's empty.
+ */
+static int lfr_uniform_stash_index(lfr_uniform_map_s *map) {
+    size_t slots = lfr_uniform_stash_slots(map->nstash);
+    size_t *index = calloc(slots, sizeof(*index));
+    if (index == NULL) return ENOMEM;
+    const uint8_t *record = map->stash;
+    for (size_t i=0; i<map->nstash; i++) {
+        size_t len = le2ui(record, 4);
+        hash_result_t hash = lfr_hash(&record[LFR_STASH_RECORD_HEADER], len, map->salt);
+        size_t slot = hash.low64 & (slots-1);
+        while (index[slot]) slot = (slot+1) & (slots-1);
+        index[slot] = record - map->stash + 1;
+        record += LFR_STASH_RECORD_HEADER + len;
+    }
+    map->stash_index = index;
+    return 0;
+}
+
+static int lfr_uniform_compare_index(const void *a, const void *b) {
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+/** Several maps' values for each of a builder's relations, packed side by side */
+typedef struct {
+    unsigned nmaps;
+    const lfr_response_t *const *values; // NULL entries mean the builder's own values
+    const int *value_bits;
+} lfr_uniform_multi_t;
+
+/** Where the relations come from: either a builder, or a source callback */
+typedef struct {
+    const lfr_builder_s *builder;
+    lfr_relation_source_t source;
+    void *ctx;
+    size_t nitems;
+    const lfr_uniform_multi_t *multi; // NULL unless building several maps at once
+    const uint8_t *wide_values; // if not NULL, each relation's value, wide_bytes long, instead of the builder's
+    size_t wide_bytes;
+    int unbucketed; // hash a builder's relations while filling, instead of bucketing them first, to save memory
+} lfr_uniform_input_t;
+
+/** Get the next relation from the input, or return ENOENT */
+static inline int lfr_uniform_input_next (
+    const lfr_uniform_input_t *input,
+    size_t *index,
+    lfr_relation_t *relation
+) {
+    if (input->builder) {
+        if (*index >= input->builder->used) return ENOENT;
+        *relation = input->builder->relations[(*index)++];
+        return 0;
+    }
+    int ret = input->source(input->ctx, relation);
+    if (ret == 0 && (*index)++ >= input->nitems) ret = EINVAL;
+    return ret;
+}
+
+/** Return the block size of the maps built from the input */
+static inline int lfr_uniform_input_blocksize(const lfr_uniform_input_t *input) {
+    return lfr_uniform_blocksize(input->builder ? input->builder->blocksize : 0);
+}
+
+/** Return the overprovision of the maps built from the input */
+static inline int lfr_uniform_input_overprovision(const lfr_uniform_input_t *input) {
+    return lfr_uniform_overprovision(input->builder ? input->builder->overprovision : 0);
+}
+
+/** Return the row shape of the maps built from the input */
+static inline int lfr_uniform_input_shape(const lfr_uniform_input_t *input) {
+    return input->builder ? input->builder->shape : LFR_SHAPE_FRAYED;
 }
 
-/* Load the data into matrices for the group solver */
+/** Return whether to precondition the solve with random rows */
+static inline int lfr_uniform_input_precondition(const lfr_uniform_input_t *input) {
+    return input->builder ? input->builder->precondition : 0;
+}
+
+/** Rewind the input to the beginning */
+static inline int lfr_uniform_input_rewind(const lfr_uniform_input_t *input, size_t *index) {
+    *index = 0;
+    return input->source ? input->source(input->ctx, NULL) : 0;
+}
+
+/* Load the data into matrices for the group solver.
+ * If pfirst_block is not NULL, then also record each relation's first block
+ * there, for lfr_uniform_bucket_relations.
+ */
 static int lfr_uniform_build_setup (
     group_t **pgroups,
-    const lfr_builder_t builder,
+    size_t *pnrelns,
+    lfr_uniform_block_index_t **pfirst_block,
+    const lfr_uniform_input_t *input,
     lfr_salt_t salt,
-    unsigned value_bits
+    int *pvalue_bits,
+    lfr_uniform_stash_t *stash
 ) {
     int ret=0;
-    size_t blocks = nblocks(builder->used);
+    int blocksize = lfr_uniform_input_blocksize(input), overprovision = lfr_uniform_input_overprovision(input);
+    int shape = lfr_uniform_input_shape(input);
+    size_t blocks = nblocks(input->builder ? input->builder->used : input->nitems, blocksize, overprovision);
     size_t log_blocks = high_bit(blocks-1);
     size_t ngroups = 1ull << (2+log_blocks);
+    lfr_uniform_block_index_t *first_block = NULL;
     group_t *groups = calloc(ngroups, sizeof(*groups));
+    if (groups == NULL) return ENOMEM;
+    if (pfirst_block) {
+        first_block = malloc(input->builder->used * sizeof(*first_block));
+        if (input->builder->used > 0 && first_block == NULL) goto fail;
+    }
     
-    /* Count number of elements in each block. */
-    for (size_t i=0; i<builder->used; i++) {
+    /* Count number of elements in each block, and the union of the values. */
+    lfr_response_t union_ = 0;
+    lfr_relation_t relation;
+    size_t nrelns;
+    if (( ret = lfr_uniform_input_rewind(input, &nrelns) )) goto fail;
+    while ((ret = lfr_uniform_input_next(input, &nrelns, &relation)) == 0) {
         _lfr_hash_result_t hash = _lfr_uniform_hash (
-            builder->relations[i].key,
-            builder->relations[i].keybytes,
-            salt, blocks
+            relation.key,
+            relation.keybytes,
+            salt, blocks, blocksize, overprovision, shape
         );
+        if (first_block) first_block[nrelns-1] = hash.block_positions[0];
         size_t a = 1+2*hash.block_positions[0];
         size_t b = 1+2*hash.block_positions[1];
         groups[a].rows++;
         groups[b].rows++;
+        if (stash) groups[(a<b) ? resolution_block(a,b) : resolution_block(b,a)].rows++;
+        union_ |= relation.value;
+    }
+    if (ret != ENOENT) goto fail;
+    ret = 0;
+    /* A source was counted before the build, so it must give that many again */
+    if (input->source && nrelns != input->nitems) {
+        ret = EINVAL;
+        goto fail;
+    }
+    if (*pvalue_bits < 0) *pvalue_bits = 1 + high_bit(union_);
+    unsigned value_bits = *pvalue_bits;
+    /* TODO: what if value_bits == 0? */
+
+    /* If preconditioning, spend the columns beyond what the default
+     * overprovision would give on random rows, which are added to the merges
+     * LFR_PRECONDITION_LEVEL levels up in proportion to their width.  Those
+     * merges are cheap, and each row added makes all the merges above them
+     * a column narrower, including the expensive last one.
+     */
+    if (lfr_uniform_input_precondition(input)) {
+        size_t cols = blocks*8*blocksize, want = _lfr_uniform_provision_columns(nrelns, blocksize, LFR_OVERPROVISION);
+        __uint128_t budget = (cols > want) ? cols - want : 0;
+        size_t level = (LFR_PRECONDITION_LEVEL < log_blocks) ? LFR_PRECONDITION_LEVEL : log_blocks;
+        size_t step = 1ull << level;
+        for (size_t mid=step; budget && level && (mid-step)/2 < blocks; mid += 2*step) {
+            size_t lo = (mid-step)/2, hi = (mid+step)/2;
+            if (hi > blocks) hi = blocks;
+            groups[mid].extra_rows = (size_t)(budget*hi/blocks - budget*lo/blocks);
+            groups[mid].salt = fmix64(salt ^ mid);
+        }
+    }
+
+    /* Lay out the merged rows' relation indices, one run per merge group */
+    if (stash) {
+        stash->row_relation = malloc(nrelns * sizeof(*stash->row_relation));
+        if (nrelns > 0 && stash->row_relation == NULL) goto fail;
+        size_t offset = 0;
+        for (size_t i=0; i<ngroups; i+=2) {
+            groups[i].row_relation = &stash->row_relation[offset];
+            offset += groups[i].rows;
+            groups[i].rows = 0; // reset for next step
+        }
     }
 
 #if LFR_THREADED
@@ -274,8 +530,8 @@ static int lfr_uniform_build_setup (
     /* Create matrices */
     for (size_t i=0; i<blocks; i++) {
         group_t *g = &groups[2*i+1];
-        g->cols = LFR_BLOCKSIZE*8;
-        ret = tile_matrix_init(&g->data, g->rows, LFR_BLOCKSIZE*8, value_bits);
+        g->cols = blocksize*8;
+        ret = tile_matrix_init(&g->data, g->rows, blocksize*8, value_bits);
         if (ret) { goto fail; }
         g->row_resolution = calloc(g->rows, sizeof(*g->row_resolution));
         if (g->row_resolution == NULL) { goto fail; }
@@ -284,56 +540,67 @@ static int lfr_uniform_build_setup (
 
     /* Success! */
     *pgroups = groups;
+    *pnrelns = nrelns;
+    if (pfirst_block) *pfirst_block = first_block;
     return 0;
 
 fail:
     if (ret==0) ret = ENOMEM;
     lfr_builder_destroy_groups(groups, ngroups);
+    free(first_block);
+    if (stash) {
+        free(stash->row_relation);
+        stash->row_relation = NULL;
+    }
     return ret;
 }
 
-static int lfr_uniform_half_merge(
+static void lfr_uniform_half_merge(
     tile_matrix_t *working,
     resolution_t *merged_resolution_data,
-    group_t *half,
+    tile_matrix_t *half,
+    const resolution_t *half_resolution,
     size_t rows_expected,
     size_t offset,
-    uint8_t merge_step
+    uint8_t merge_step,
+    int compact
 ) {
     /* The merge step merges certain rows from each of two halves into a single matrix,
-     * then row reduces it.  This subroutine does half the merge: it copies the rows
-     * to be dealt with in this block to working, and limits the `half` matrix to the
-     * rows not to be merged.
+     * then row reduces it.  This subroutine does half the merge: it xors the rows
+     * to be dealt with in this block straight into their places in working, unless
+     * it's NULL, and if compact, limits the `half` matrix to the rows not to be
+     * merged.  The resolution data of those rows is copied to merged_resolution_data,
+     * unless it's NULL.
+     *
+     * The unmerged rows are compacted in runs.  Each run is moved down once the
+     * next merged row (which it may overwrite) has been read.
      */
-    
-    // Create scratch matrix
-    tile_matrix_t copy_scratch[1];
-    int ret = tile_matrix_init(copy_scratch,rows_expected,half->data.cols,half->data.aug_cols);
-    if (ret) { return ret; }
-
-    // Copy the desired rows into the scratch matrix
-    size_t ncopied=0, n_not_copied=0;
-    for (size_t row=0; row<half->data.rows; row++) {
-        if (half->row_resolution[row].merge_step == merge_step) {
+    size_t ncopied=0, n_not_copied=0, run_start=0, run_length=0;
+    for (size_t row=0; row<half->rows; row++) {
+        if (half_resolution[row].merge_step == merge_step) {
             ncopied++;
-            size_t target_row = half->row_resolution[row].row;
+            size_t target_row = half_resolution[row].row;
             assert(target_row < rows_expected);
-            tile_matrix_xor_row(copy_scratch,&half->data,target_row,row);
+            if (working) tile_matrix_xor_row_offset(working,half,target_row,row,offset);
+            if (run_length && compact) {
+                tile_matrix_copy_rows(half,half,n_not_copied,run_start,run_length);
+                n_not_copied += run_length;
+                run_length = 0;
+            }
         } else {
-            merged_resolution_data[n_not_copied] = half->row_resolution[row];
-            // can't use the faster (?) xor here because the target isn't 0
-            tile_matrix_copy_rows(&half->data,&half->data,n_not_copied,row,1);
-            n_not_copied++;
+            if (merged_resolution_data) merged_resolution_data[n_not_copied + run_length] = half_resolution[row];
+            if (run_length++ == 0) run_start = row;
         }
     }
-    tile_matrix_change_nrows(&half->data, n_not_copied);
+    if (!compact) return;
+    if (run_length) {
+        tile_matrix_copy_rows(half,half,n_not_copied,run_start,run_length);
+        n_not_copied += run_length;
+    }
+    tile_matrix_change_nrows(half, n_not_copied);
     assert(ncopied == rows_expected);
-
-    // Copy the scratch matrix into the working matrix, at some offset
-    tile_matrix_copy_cols(working,copy_scratch,offset,0,half->data.cols);
-    tile_matrix_xor_augdata(working,copy_scratch);
-    tile_matrix_destroy(copy_scratch);
-    return 0;
+    (void)ncopied;
+    (void)rows_expected;
 }
 
 static int lfr_uniform_project_out(
@@ -343,7 +610,8 @@ static int lfr_uniform_project_out(
     size_t nrows,
     size_t ech_offset,
     size_t non_ech_offset,
-    size_t n_ech
+    size_t n_ech,
+    const int *cancel
 ) {
     /* Half of the projection phase of the merge step.
     *
@@ -351,64 +619,140 @@ static int lfr_uniform_project_out(
      * the other side are already accounted for in `sys`, and the unmerged ones remain.
      * This function deals with the unmerged rows, and is destructive to `group`
      */
-    tile_matrix_t tmpb[1];
-    memset(tmpb,0,sizeof(tmpb)); // preclear in case we fail before init'ing
     int ret = tile_matrix_init(target, nrows, sys->rhs.cols, sys->rhs.aug_cols);
-    if (ret) { goto done; }
-
-    // Copy the non-echelon columns to output, and the echelon ones to tmpb
-    ret = tile_matrix_init(tmpb, nrows, n_ech, 0);
-    if (ret) { goto done; }
-
-    // Copy depending on whether in/out of echelon.
-    // Profiling indicates that this is a performance-sensitive routine.  Instead
-    // of copying the columns one-at-a-time, copy them in bulk
-    size_t col_out_tmpb=0, col_out_target=non_ech_offset;
-    size_t n_in_echelon=0, n_not_in_echelon=0, col;
-    for (col=0; col<group->data.cols; col++) {
-        if (bitset_test_bit(sys->column_is_in_echelon, col+ech_offset)) {
-            if (n_not_in_echelon) {
-                // previous group was not in echelon, but this is; resolve them
-                tile_matrix_copy_cols(target,&group->data,col_out_target,col-n_not_in_echelon,n_not_in_echelon);
-                col_out_target += n_not_in_echelon;
-                n_not_in_echelon = 0;
-            }
-            n_in_echelon++;
-        } else {
-            if (n_in_echelon) {
-                // previous group was in echelon, but this is not; resolve them
-                tile_matrix_copy_cols(tmpb,&group->data,col_out_tmpb,col-n_in_echelon,n_in_echelon);
-                col_out_tmpb += n_in_echelon;
-                n_in_echelon = 0;
-            }
-            n_not_in_echelon++;
-        }
-    }
-    if (n_not_in_echelon) {
-        tile_matrix_copy_cols(target,&group->data,col_out_target,col-n_not_in_echelon,n_not_in_echelon);
-        col_out_target += n_not_in_echelon;
-    } else if (n_in_echelon) {
-        tile_matrix_copy_cols(tmpb,&group->data,col_out_tmpb,col-n_in_echelon,n_in_echelon);
-        col_out_tmpb += n_in_echelon;
-    }
-    assert(col_out_tmpb == tmpb->cols);
-    tile_matrix_xor_augdata(target, &group->data);
+    if (ret) return ret;
 
     tile_matrix_t sys_submatrix[1]; // Not destroyed because it's a submatrix
     size_t prev_ech = ech_offset-non_ech_offset; // previous rows in echelon
     prev_ech += (-prev_ech)%TILE_SIZE; // padded
     _tile_aligned_submatrix(sys_submatrix, &sys->rhs, n_ech, prev_ech);
 
-    // Do the projection
-    tile_matrix_multiply_accumulate(target, tmpb, sys_submatrix);
+    // Copy the non-echelon columns to output, and project the echelon ones
+    // through sys_submatrix.  Profiling indicates that this is a
+    // performance-sensitive routine, so it's done in one pass over the group.
+    ret = tile_matrix_project_columns_cancellable(target, &group->data,
+        sys->column_is_in_echelon, ech_offset, non_ech_offset, sys_submatrix, cancel);
 
-done:
-    tile_matrix_destroy(tmpb);
     if (ret) tile_matrix_destroy(target);
     return ret;
 }
 
-static int lfr_uniform_build_merge(group_t *result, group_t *left, group_t *right, uint8_t merge_step, int last) {
+static int lfr_uniform_stash_dependent_rows (
+    tile_matrix_systematic_t *sys,
+    tile_matrix_t *working,
+    const group_t *result,
+    lfr_uniform_stash_t *stash,
+    const int *cancel
+) {
+    /* The merged rows in working are linearly dependent.  Move just enough of
+     * their relations to the stash to fix that, and put the rest in systematic
+     * form.  The stashed rows drop out of the solve entirely: nothing below
+     * this merge refers to a merged row's index.  Dependent random rows from
+     * preconditioning, which come after the merged ones, are just dropped.
+     * This destroys working.
+     */
+    size_t rows = working->rows, ndependent, nstash;
+    bitset_t dependent = bitset_init(rows);
+    if (dependent == NULL) return ENOMEM;
+
+    int ret = tile_matrix_dependent_rows(dependent, &ndependent, working, cancel);
+    if (ret) goto done;
+
+    nstash = ndependent;
+    for (size_t row=result->rows; row<rows; row++) nstash -= bitset_test_bit(dependent, row);
+    size_t slot = __atomic_fetch_add(&stash->nstashed, nstash, __ATOMIC_RELAXED);
+    if (slot + nstash > stash->max) {
+        ret = -1; // full; fail as if there were no stash
+        goto done;
+    }
+
+    for (size_t row=0, out=0; row<rows; row++) {
+        if (bitset_test_bit(dependent, row)) {
+            if (row < result->rows) stash->stashed[slot++] = result->row_relation[row];
+        } else {
+            if (out != row) tile_matrix_copy_rows(working, working, out, row, 1);
+            out++;
+        }
+    }
+    ret = tile_matrix_change_nrows(working, rows-ndependent);
+    if (!ret) ret = tile_matrix_systematic_form_cancellable(sys, working, cancel);
+
+done:
+    bitset_destroy(dependent);
+    return ret;
+}
+
+static int lfr_uniform_add_random_rows(tile_matrix_t *working, const group_t *result) {
+    /* Append result->extra_rows random rows to a merge, or fewer if they
+     * would take up more than half of its spare columns.  They aren't any
+     * relation's, so their augmented columns can be anything, and are zero.
+     * The random tiles come from the group's salt, so a merge made again
+     * gets the same rows, and are masked as in tile_matrix_randomize.
+     */
+    size_t rows = working->rows, extra = result->extra_rows;
+    size_t spare = (working->cols > rows) ? working->cols - rows : 0;
+    if (extra > spare/2) extra = spare/2;
+    if (extra == 0) return 0;
+
+    int ret = tile_matrix_change_nrows(working, rows + extra);
+    if (ret) return ret;
+    size_t tcols = TILES_SPANNING(working->cols), tstride = working->stride;
+    tile_t last_col_mask = (working->cols % TILE_SIZE) ? tile_mask_of_cols_less_than(working->cols % TILE_SIZE) : tile_full();
+    for (size_t row=rows, n; row<rows+extra; row += n) {
+        size_t trow = row/TILE_SIZE;
+        n = TILE_SIZE - row%TILE_SIZE;
+        if (n > rows+extra-row) n = rows+extra-row;
+        tile_t row_mask = tile_row_bulk_mask(row%TILE_SIZE, n);
+        for (size_t tcol=0; tcol<tcols; tcol++) {
+            tile_t t = fmix64(result->salt + trow*tcols + tcol) & row_mask;
+            if (tcol == tcols-1) t &= last_col_mask;
+            working->data[trow*tstride + tcol] |= t;
+        }
+    }
+    return 0;
+}
+
+/* Make the working matrix for a merge: xor the merged half-rows of left and
+ * right into it, and append the random rows, if any.  The other rows'
+ * resolution data goes in merged_resolution, unless it's NULL.  If compact,
+ * the merged half-rows are removed from left and right.
+ */
+static int lfr_uniform_merge_working (
+    tile_matrix_t *working,
+    resolution_t *merged_resolution,
+    const group_t *result,
+    group_t *left,
+    group_t *right,
+    uint8_t merge_step,
+    int factoring,
+    int compact
+) {
+    size_t augcols = left->data.aug_cols, nrows = result->rows;
+    size_t left_unmerged = left->data.rows - nrows;
+    assert(augcols == right->data.aug_cols);
+    int ret = tile_matrix_init(working, nrows, left->data.cols + right->data.cols,
+        factoring ? nrows : augcols);
+    if (ret) return ret;
+
+    lfr_uniform_half_merge(working, merged_resolution, &left->data, left->row_resolution,
+        nrows, 0, merge_step, compact);
+    lfr_uniform_half_merge(working, merged_resolution ? &merged_resolution[left_unmerged] : NULL,
+        &right->data, right->row_resolution, nrows, left->data.cols, merge_step, compact);
+    if (factoring) tile_matrix_xor_aug_identity(working);
+    if (result->extra_rows) ret = lfr_uniform_add_random_rows(working, result);
+    return ret;
+}
+
+static int lfr_uniform_build_merge (
+    group_t *result,
+    group_t *left,
+    group_t *right,
+    uint8_t merge_step,
+    int last,
+    int factoring,
+    lfr_uniform_stash_t *stash,
+    const int *cancel
+) {
     /**
      * Given a collection of half rows in e.g. groups 1 and 3 (would be blocks 0 and 1 in orig matrix),
      * combine them into status for group 2 spanning both blocks.
@@ -425,16 +769,17 @@ static int lfr_uniform_build_merge(group_t *result, group_t *left, group_t *righ
      * 
      * Remember the systematic matrix and the output, but delete the two groups of
      * input half-rows.
+     *
+     * If factoring, the groups have no values.  Instead, the merged rows get the
+     * identity as their augmented columns, so the systematic form and output
+     * end up with the matrices which map the merged rows' values to theirs.  These
+     * are split off into factor_sys and factor_out, and the input groups' row
+     * resolution is kept, so that lfr_uniform_resolve_values can replay the merge.
      */
     int ret;
 
-    // make a working matrix for the merged rows
-    size_t augcols = left->data.aug_cols;
-    assert(augcols == right->data.aug_cols);
     tile_matrix_t working[1];
-    size_t nrows = result->rows;
-    ret = tile_matrix_init(working, nrows, left->data.cols + right->data.cols, augcols);
-    if (ret) { goto done; }
+    memset(working,0,sizeof(working));
 
     // allocate the merged resolution data
     size_t n_resolution = left->data.rows + right->data.rows - 2*result->rows;
@@ -444,18 +789,26 @@ static int lfr_uniform_build_merge(group_t *result, group_t *left, group_t *righ
         goto done;
     }
 
-    // Copy matrices into the working one
-    ret = lfr_uniform_half_merge(working, merged_resolution, left,  result->rows, 0, merge_step);
-    if (ret) goto done;
-
-    merged_resolution += left->data.rows;
-    ret = lfr_uniform_half_merge(working, merged_resolution, right, result->rows, left->data.cols, merge_step);
-    if (ret) goto done;
+    // Make a working matrix for the merged rows.  If stashing, leave the
+    // halves whole until the merge succeeds, so that it can be made again.
+    ret = lfr_uniform_merge_working(working, merged_resolution, result, left, right,
+        merge_step, factoring, stash == NULL);
+    if (ret) { goto done; }
 
-    // Put the merged matrix in systematic form
-    ret = tile_matrix_systematic_form(&result->systematic, working);
+    // Put the merged matrix in systematic form.  This destroys working, so
+    // if some of its rows need stashing, make it again from the halves.
+    ret = tile_matrix_systematic_form_cancellable(&result->systematic, working, cancel);
     tile_matrix_destroy(working);
+    if (ret == -1 && stash) {
+        ret = lfr_uniform_merge_working(working, NULL, result, left, right, merge_step, factoring, 0);
+        if (!ret) ret = lfr_uniform_stash_dependent_rows(&result->systematic, working, result, stash, cancel);
+        tile_matrix_destroy(working);
+    }
     if (ret) goto done;
+    if (stash) {
+        lfr_uniform_half_merge(NULL, NULL, &left->data, left->row_resolution, result->rows, 0, merge_step, 1);
+        lfr_uniform_half_merge(NULL, NULL, &right->data, right->row_resolution, result->rows, 0, merge_step, 1);
+    }
 
     // Align the "left" and "right" halves of the systematic form matrix
     size_t cur_rows = result->systematic.rhs.rows;
@@ -468,18 +821,22 @@ static int lfr_uniform_build_merge(group_t *result, group_t *left, group_t *righ
         tile_matrix_move_rows(&result->systematic.rhs, left_ech+pad_rows, left_ech, cur_rows-left_ech);
     }
 
-    if (last) { goto done; } // there shouldn't be any rows left over anyway
+    if (last) {
+        // there shouldn't be any rows left over anyway
+        if (factoring) ret = tile_matrix_split_aug(&result->factor_sys, &result->systematic.rhs);
+        goto done;
+    }
 
     // Create the merged matrix
     //  ... project out left
     size_t merged_rows_left  = left ->data.rows;
-    ret = lfr_uniform_project_out(&result->data, left, &result->systematic, merged_rows_left, 0, 0, left_ech);
+    ret = lfr_uniform_project_out(&result->data, left, &result->systematic, merged_rows_left, 0, 0, left_ech, cancel);
     if (ret) { goto done; }
 
     //  ... project out right, into a temporary matrix
     size_t merged_rows_right = right->data.rows;
     tile_matrix_t merge_tmp[1];
-    ret = lfr_uniform_project_out(merge_tmp, right, &result->systematic, merged_rows_right, left->data.cols, left_non_ech, right_ech);
+    ret = lfr_uniform_project_out(merge_tmp, right, &result->systematic, merged_rows_right, left->data.cols, left_non_ech, right_ech, cancel);
     if (ret) { goto done; } // in this case lfr_uniform_project_out destroys merge_tmp
 
     // Append the temporary matrix to the bottom of the result
@@ -493,12 +850,18 @@ static int lfr_uniform_build_merge(group_t *result, group_t *left, group_t *righ
     tile_matrix_destroy(merge_tmp);
 
     result->cols = result->systematic.rhs.cols;
+    if (factoring) {
+        ret = tile_matrix_split_aug(&result->factor_sys, &result->systematic.rhs);
+        if (!ret) ret = tile_matrix_split_aug(&result->factor_out, &result->data);
+    }
 
 done:
-    free(left->row_resolution);
-    left->row_resolution = NULL;
-    free(right->row_resolution);
-    right->row_resolution = NULL;
+    if (!factoring) {
+        free(left->row_resolution);
+        left->row_resolution = NULL;
+        free(right->row_resolution);
+        right->row_resolution = NULL;
+    }
     tile_matrix_destroy(working);
     tile_matrix_destroy(&left->data);
     tile_matrix_destroy(&right->data);
@@ -526,62 +889,79 @@ static int lfr_uniform_move_group(group_t *target, group_t *source) {
     return 0;
 }
 
-static int lfr_uniform_backward_solve(group_t *left, group_t *right, group_t *center) {
+static int lfr_uniform_backward_solve (
+    tile_matrix_t *left,
+    size_t rows_left,
+    tile_matrix_t *right,
+    size_t rows_right,
+    tile_matrix_t *center,
+    const tile_matrix_systematic_t *sys,
+    const tile_matrix_t *sys_aug,
+    const int *cancel
+) {
     /* Backward solution step.
      * This is relatively easy: at each level we have an equation of the form 
+     *
+     * The systematic form's augmented columns are sys_aug if it isn't NULL.
+     * Destroys center.
      */
-    size_t augcols = center->data.aug_cols;
+    size_t augcols = center->aug_cols;
 
     tile_matrix_t tmp[1];
-    int ret = tile_matrix_init(tmp, center->systematic.rhs.rows, 0, augcols);
+    int ret = tile_matrix_init(tmp, sys->rhs.rows, 0, augcols);
     if (ret) { goto done; }
+    if (sys_aug && sys_aug->rows) tile_matrix_xor_augdata(tmp, sys_aug);
 
-    size_t rows_left = left->cols, rows_right = right->cols;
-    ret = tile_matrix_init(&left->data,  rows_left, 0,  augcols);
+    ret = tile_matrix_init(left, rows_left, 0,  augcols);
     if (ret) { goto done; }
 
-    ret = tile_matrix_init(&right->data, rows_right, 0, augcols);
+    ret = tile_matrix_init(right, rows_right, 0, augcols);
     if (ret) { goto done; }
 
     // multiply up
-    tile_matrix_multiply_accumulate(tmp, &center->systematic.rhs, &center->data);
-
-    size_t col_test=0, sys_row=0, ipt_row=0;
+    ret = tile_matrix_multiply_accumulate_cancellable(tmp, &sys->rhs, center, cancel);
+    if (ret) { goto done; }
 
-    // unmerge left
-    for (size_t row=0; row<rows_left; row++) {
-        if (bitset_test_bit(center->systematic.column_is_in_echelon, col_test++)) {
-            // pull it from systematic component.  Using xor because the input is zero
-            tile_matrix_xor_row(&left->data, tmp, row, sys_row++);
-        } else {
-            // pull it from input
-            tile_matrix_xor_row(&left->data, &center->data, row, ipt_row++);
-        }
-    }
+    // unmerge left, pulling each row from the systematic component or the input.
+    // Using xor because the outputs are zero
+    bitset_t ech = sys->column_is_in_echelon;
+    size_t sys_row = tile_matrix_expand_rows(left, tmp, 0, ech, 0, 1);
+    size_t ipt_row = tile_matrix_expand_rows(left, center, 0, ech, 0, 0);
 
     // Account for the padding in the sys matrix
     sys_row += (-sys_row) % TILE_SIZE;
 
     // unmerge right
-    for (size_t row=0; row<rows_right; row++) {
-        if (bitset_test_bit(center->systematic.column_is_in_echelon, col_test++)) {
-            // pull it from systematic component
-            tile_matrix_xor_row(&right->data, tmp, row, sys_row++);
-        } else {
-            // pull it from input
-            tile_matrix_xor_row(&right->data, &center->data, row, ipt_row++);
-        }
-    }
+    tile_matrix_expand_rows(right, tmp, sys_row, ech, rows_left, 1);
+    tile_matrix_expand_rows(right, center, ipt_row, ech, rows_left, 0);
 
 done:
     tile_matrix_destroy(tmp);
-    tile_matrix_destroy(&center->data);
-    tile_matrix_systematic_destroy(&center->systematic);
+    tile_matrix_destroy(center);
     return ret;
 }
 
+/** A builder relation, hashed and ready to copy into the groups */
+typedef struct {
+    _lfr_hash_result_t hash; // with the value xored in
+    size_t index;
+} lfr_uniform_hashed_t;
+
+/** The private part of a factorization */
+struct lfr_uniform_factor_state_s {
+    group_t *groups;
+    size_t ngroups;
+    lfr_response_t *hashes;  // each relation's hash, without its value
+    size_t *leaf_relation;   // shared by the leaf groups' leaf_relation
+};
+typedef struct lfr_uniform_factor_state_s lfr_uniform_factor_state_t;
+
 typedef struct  {
-    const lfr_builder_s *matrix; // TODO: rename
+    const lfr_uniform_input_t *input;
+    lfr_uniform_hashed_t *hashed; // builder relations bucketed by block; freed after filling
+    size_t nrelns;  // number of relations counted in setup
+    size_t nfilled; // number of relations pulled from a source so far
+    int input_done, input_ret;
     group_t *groups;
     size_t ngroups;
     lfr_salt_t salt;
@@ -591,43 +971,354 @@ typedef struct  {
 #endif
     int counter;
     int nthreads;
+    size_t next_subtree; // next bottom subtree to be claimed by a thread
     int ret;
+    int *cancel; // set when the solve should give up, either by us or by the caller
+    lfr_uniform_stash_t *stash; // NULL unless stashing
+    lfr_uniform_factor_state_t *factor; // NULL unless factoring
 } lfr_uniform_build_args_t;
 
-static void initialize_row (
+static int initialize_row (
     group_t *left,
     group_t *right,
     group_t *resolution,
-    const uint8_t *keydata,
+    const uint8_t *keyleft,
+    const uint8_t *keyright,
     const uint8_t *augdata,
-    int merge_step
+    int merge_step,
+    size_t index
 ) {
+        int ret = 0;
 #if LFR_THREADED
         pthread_mutex_lock(&left->mut);
         pthread_mutex_lock(&right->mut);
         pthread_mutex_lock(&resolution->mut);
 #endif
+        if (left->rows >= left->data.rows || right->rows >= right->data.rows) {
+            // The input changed since it was counted
+            ret = EINVAL;
+            goto done;
+        }
         size_t row_left  = left->rows++, row_right = right->rows++;
         size_t row_res   = resolution->rows++;
+        if (resolution->row_relation) resolution->row_relation[row_res] = index;
+        if (right->leaf_relation) {
+            left->leaf_relation[row_left] = SIZE_MAX;
+            right->leaf_relation[row_right] = index; // it gets the value
+        }
 
-        // PERF: this step is pretty slow
-        tile_matrix_set_row(&left->data,  row_left,  keydata, NULL);
+        // Rows are assigned in order under the lock, so they can be staged
+        tile_matrix_stage_row(&left->data,  row_left,  keyleft, NULL);
         left->row_resolution[row_left].merge_step = merge_step;
         left->row_resolution[row_left].row = row_res;
 
-        tile_matrix_set_row(&right->data, row_right, &keydata[LFR_BLOCKSIZE], augdata);
+        tile_matrix_stage_row(&right->data, row_right, keyright, augdata);
         right->row_resolution[row_right].merge_step = merge_step;
         right->row_resolution[row_right].row = row_res;
+done:
 #if LFR_THREADED
         pthread_mutex_unlock(&resolution->mut);
         pthread_mutex_unlock(&left->mut);
         pthread_mutex_unlock(&right->mut);
 #endif
+        return ret;
+}
+
+/**
+ * Copy a hashed relation into the groups, whose blocks are blocksize bytes.
+ * Its value is already xored into hash.augmented, unless it's a wide value,
+ * wide_bytes long.
+ */
+static int lfr_uniform_add_hashed (
+    group_t *groups,
+    const _lfr_hash_result_t *hash,
+    size_t index,
+    const uint8_t *wide,
+    size_t wide_bytes,
+    int blocksize
+) {
+    lfr_uniform_block_index_t block_left  = 2 * hash->block_positions[0] + 1;
+    lfr_uniform_block_index_t block_right = 2 * hash->block_positions[1] + 1;
+    const uint8_t *keyleft = hash->keyout, *keyright = &hash->keyout[blocksize];
+
+    if (block_left > block_right) {
+        lfr_uniform_block_index_t tmp = block_left;
+        block_left = block_right;
+        block_right = tmp;
+
+        const uint8_t *tmpk = keyleft;
+        keyleft = keyright;
+        keyright = tmpk;
+    }
+
+    uint32_t resolution = resolution_block(block_left, block_right);
+    uint32_t merge_step = __builtin_ctzll(resolution);
+    uint8_t augmented_b[LFR_MAX_VALUE_BITS/8];
+    if (wide) {
+        memcpy(augmented_b, wide, wide_bytes);
+        lfr_uniform_xor_wide_mask(augmented_b, wide_bytes, hash->augmented);
+    } else {
+        ui2le(augmented_b, sizeof(hash->augmented), hash->augmented);
+    }
+
+    return initialize_row(&groups[block_left], &groups[block_right], &groups[resolution],
+        keyleft, keyright, augmented_b, merge_step, index);
+}
+
+/** Hash a relation and copy it into the groups */
+static int lfr_uniform_add_relation (
+    group_t *groups,
+    const lfr_relation_t *relation,
+    size_t index,
+    lfr_salt_t salt,
+    size_t blocks,
+    int blocksize,
+    int overprovision,
+    int shape
+) {
+    _lfr_hash_result_t hash = _lfr_uniform_hash(
+        relation->key,
+        relation->keybytes,
+        salt,
+        blocks,
+        blocksize,
+        overprovision,
+        shape
+    );
+    hash.augmented ^= relation->value;
+    return lfr_uniform_add_hashed(groups, &hash, index, NULL, 0, blocksize);
+}
+
+/**
+ * Return a relation's augmented columns, given its hash.  Usually that's the
+ * hash xor the value.  For several maps at once, each map's columns get the
+ * low bits of the hash xor that map's value, since that's what its queries
+ * use.  Wide values are xored in later, by lfr_uniform_add_hashed.
+ */
+static inline lfr_response_t lfr_uniform_augmented (
+    const lfr_uniform_input_t *input,
+    lfr_response_t hash,
+    const lfr_relation_t *relation,
+    size_t index
+) {
+    const lfr_uniform_multi_t *multi = input->multi;
+    if (input->wide_values) return hash; // the value is xored in when the row is staged
+    if (multi == NULL) return hash ^ relation->value;
+    lfr_response_t ret = 0;
+    unsigned offset = 0;
+    for (unsigned j=0; j<multi->nmaps; j++) {
+        int bits = multi->value_bits[j];
+        if (bits == 0) continue;
+        lfr_response_t value = multi->values[j] ? multi->values[j][index] : relation->value;
+        lfr_response_t mask = (bits == 8*sizeof(mask)) ? -(lfr_response_t)1 : ((lfr_response_t)1 << bits) - 1;
+        ret |= ((hash ^ value) & mask) << offset;
+        offset += bits;
+    }
+    return ret;
+}
+
+/** Hash a builder's relation, ready to copy into the groups */
+static void lfr_uniform_hash_relation (
+    lfr_uniform_hashed_t *out,
+    const lfr_uniform_input_t *input,
+    size_t index,
+    lfr_salt_t salt,
+    size_t blocks
+) {
+    const lfr_relation_t *relation = &input->builder->relations[index];
+    out->hash = _lfr_uniform_hash(relation->key, relation->keybytes, salt, blocks,
+        lfr_uniform_input_blocksize(input), lfr_uniform_input_overprovision(input), lfr_uniform_input_shape(input));
+    out->hash.augmented = lfr_uniform_augmented(input, out->hash.augmented, relation, index);
+    out->index = index;
+}
+
+/** One thread's share of lfr_uniform_bucket_relations */
+typedef struct {
+    const lfr_uniform_input_t *input;
+    const lfr_uniform_block_index_t *first_block;
+    size_t begin, end, blocks;
+    lfr_salt_t salt;
+    size_t *cursor; // shared: where the next relation in each block goes
+    lfr_uniform_hashed_t *out;
+} lfr_uniform_bucket_chunk_t;
+
+static void *lfr_uniform_bucket_chunk(void *chunk_void) {
+    const lfr_uniform_bucket_chunk_t *chunk = (const lfr_uniform_bucket_chunk_t *)chunk_void;
+    for (size_t i=chunk->begin; i<chunk->end; i++) {
+        size_t pos = __atomic_fetch_add(&chunk->cursor[chunk->first_block[i]], 1, __ATOMIC_RELAXED);
+        lfr_uniform_hash_relation(&chunk->out[pos], chunk->input, i, chunk->salt, chunk->blocks);
+    }
+    return NULL;
+}
+
+/**
+ * Hash the builder's relations again, and bucket-sort the results by their
+ * first block, using the blocks recorded by lfr_uniform_build_setup.  Filling
+ * the groups in this order writes each one's rows together, instead of
+ * scattering every relation across the groups and missing in cache.
+ *
+ * With several threads, the relations within a block end up in no particular
+ * order, which doesn't change the solution.
+ */
+static int lfr_uniform_bucket_relations (
+    lfr_uniform_hashed_t **pout,
+    const lfr_uniform_input_t *input,
+    const lfr_uniform_block_index_t *first_block,
+    size_t blocks,
+    lfr_salt_t salt,
+    int nthreads
+) {
+    const lfr_builder_s *builder = input->builder;
+    size_t nrelns = builder->used;
+    size_t *cursor = calloc(blocks+1, sizeof(*cursor));
+    lfr_uniform_hashed_t *out = malloc(nrelns * sizeof(*out));
+    if (cursor == NULL || (nrelns > 0 && out == NULL)) {
+        free(cursor);
+        free(out);
+        return ENOMEM;
+    }
+    for (size_t i=0; i<nrelns; i++) cursor[first_block[i]+1]++;
+    for (size_t b=0; b<blocks; b++) cursor[b+1] += cursor[b];
+
+    lfr_uniform_bucket_chunk_t chunks[nthreads];
+    for (int t=0; t<nthreads; t++) {
+        chunks[t].input = input;
+        chunks[t].first_block = first_block;
+        chunks[t].begin = nrelns*t / nthreads;
+        chunks[t].end = nrelns*(t+1) / nthreads;
+        chunks[t].blocks = blocks;
+        chunks[t].salt = salt;
+        chunks[t].cursor = cursor;
+        chunks[t].out = out;
+    }
+#if LFR_THREADED
+    pthread_t threads[nthreads];
+    int t;
+    for (t=1; t<nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, lfr_uniform_bucket_chunk, &chunks[t])) break;
+    }
+    lfr_uniform_bucket_chunk(&chunks[0]);
+    for (int j=1; j<t; j++) pthread_join(threads[j], NULL);
+
+    // If we couldn't start some of the threads, do their chunks here
+    for (int j=t; j<nthreads; j++) lfr_uniform_bucket_chunk(&chunks[j]);
+#else
+    for (int t=0; t<nthreads; t++) lfr_uniform_bucket_chunk(&chunks[t]);
+#endif
+
+    free(cursor);
+    *pout = out;
+    return 0;
+}
+
+/** Number of relations that a thread pulls from a source at once */
+#define LFR_SOURCE_BATCH 256
+
+/**
+ * Pull relations from a source in batches, and copy them into the groups.
+ * The source is called under the args mutex, and the keys are copied out
+ * so that the hashing can happen in parallel.  On error, the caller should
+ * set args->input_ret to stop the other threads.
+ */
+static int lfr_uniform_fill_from_source (
+    lfr_uniform_build_args_t *args,
+    size_t blocks,
+    int blocksize,
+    int overprovision,
+    int shape
+) {
+    const lfr_uniform_input_t *input = args->input;
+    lfr_relation_t batch[LFR_SOURCE_BATCH];
+    size_t offsets[LFR_SOURCE_BATCH];
+    uint8_t *keys = NULL;
+    size_t keys_capacity = 0;
+    int ret = 0, finished = 0;
+
+    while (!finished) {
+        size_t n=0, keys_used=0;
+        ret = 0;
+#if LFR_THREADED
+        pthread_mutex_lock(&args->mut);
+#endif
+        size_t first = args->nfilled;
+        for (; n<LFR_SOURCE_BATCH && !args->input_done && !args->input_ret; n++) {
+            ret = lfr_uniform_input_next(input, &args->nfilled, &batch[n]);
+            if (ret == ENOENT) {
+                args->input_done = 1;
+                ret = 0;
+                break;
+            } else if (ret == 0 && args->nfilled > args->nrelns) {
+                ret = EINVAL; // more than last time
+            }
+            if (ret == 0 && keys_used + batch[n].keybytes > keys_capacity) {
+                size_t new_capacity = 2*keys_capacity + batch[n].keybytes;
+                uint8_t *new = realloc(keys, new_capacity);
+                if (new == NULL) {
+                    ret = ENOMEM;
+                } else {
+                    keys = new;
+                    keys_capacity = new_capacity;
+                }
+            }
+            if (ret) {
+                args->input_ret = ret;
+                break;
+            }
+            memcpy(&keys[keys_used], batch[n].key, batch[n].keybytes);
+            offsets[n] = keys_used;
+            keys_used += batch[n].keybytes;
+        }
+        finished = args->input_done || args->input_ret;
+#if LFR_THREADED
+        pthread_mutex_unlock(&args->mut);
+#endif
+
+        for (size_t i=0; i<n; i++) {
+            batch[i].key = &keys[offsets[i]];
+            ret = lfr_uniform_add_relation(args->groups, &batch[i], first+i, args->salt, blocks,
+                blocksize, overprovision, shape);
+            if (ret) break;
+        }
+        if (ret) finished = 1;
+    }
+
+    free(keys);
+    return ret;
+}
+
+/** Merge the two groups under groups[mid] at the given level, once they are
+ * solved, and mark it as solved.  The caller must have marked it as theirs.
+ */
+static int lfr_uniform_merge_step(lfr_uniform_build_args_t *args, int lgstep, size_t mid, int last) {
+    group_t *groups = args->groups;
+    size_t step = 1ull << lgstep;
+    group_t *out = &groups[mid], *left = &groups[mid-step/2], *right = &groups[mid+step/2];
+
+    int ret = wait_for_solved(left,1,args->cancel);
+    if (!ret) ret = wait_for_solved(right,1,args->cancel);
+
+    /* Only a group past the last block has no columns.  A block with no rows
+     * still has its columns, which must be merged in even though nothing
+     * constrains them.
+     */
+    if (ret) {
+        // fall through
+    } else if (right->cols == 0) {
+        ret = lfr_uniform_move_group(out, left);
+    } else if (left->cols == 0) {
+        ret = lfr_uniform_move_group(out, right);
+    } else {
+        ret = lfr_uniform_build_merge(out, left, right, lgstep, last, args->factor != NULL,
+            args->stash, args->cancel);
+    }
+    if (ret && ret != ECANCELED) cancel_all(groups, args->ngroups, args->cancel);
+    mark_as_solved(out,1,ret); // don't die and leave them hanging
+    return ret;
 }
 
 static void *lfr_uniform_build_thread (void *args_void) {
     lfr_uniform_build_args_t *args = (lfr_uniform_build_args_t *)args_void;
-    const lfr_builder_s *builder = args->matrix;
+    const lfr_uniform_input_t *input = args->input;
     group_t *groups = args->groups;
     size_t ngroups = args->ngroups;
     
@@ -644,49 +1335,85 @@ static void *lfr_uniform_build_thread (void *args_void) {
 #else
     int threadid = 0, nthreads = 1;
 #endif
+    int ret = 0;
 
     /* Copy rows into submatrices, and count resolutions */
-    size_t start = args->matrix->used*threadid / nthreads;
-    size_t end = args->matrix->used*(threadid+1) / nthreads;
-    size_t blocks = nblocks(args->matrix->used);
-    for (size_t i=start; i<end; i++) {
-        _lfr_hash_result_t hash = _lfr_uniform_hash(
-            builder->relations[i].key,
-            builder->relations[i].keybytes,
-            args->salt,
-            blocks
-        );
-        hash.augmented ^= builder->relations[i].value;
-        lfr_uniform_block_index_t block_left  = 2 * hash.block_positions[0] + 1;
-        lfr_uniform_block_index_t block_right = 2 * hash.block_positions[1] + 1;
-
-        if (block_left > block_right) {
-            lfr_uniform_block_index_t tmp = block_left;
-            block_left = block_right;
-            block_right = tmp;
-
-            uint8_t tmpb[LFR_BLOCKSIZE];
-            memcpy(tmpb,hash.keyout,LFR_BLOCKSIZE);
-            memcpy(hash.keyout,&hash.keyout[LFR_BLOCKSIZE],LFR_BLOCKSIZE);
-            memcpy(&hash.keyout[LFR_BLOCKSIZE],tmpb,LFR_BLOCKSIZE);
+    int blocksize = lfr_uniform_input_blocksize(input), overprovision = lfr_uniform_input_overprovision(input);
+    size_t blocks = nblocks(input->builder ? input->builder->used : input->nitems, blocksize, overprovision);
+    if (input->builder) {
+        size_t start = input->builder->used*threadid / nthreads;
+        size_t end = input->builder->used*(threadid+1) / nthreads;
+        for (size_t i=start; i<end; i++) {
+            lfr_uniform_hashed_t unsorted, *h = &unsorted;
+            if (args->hashed) {
+                h = &args->hashed[i];
+            } else {
+                lfr_uniform_hash_relation(&unsorted, input, i, args->salt, blocks);
+            }
+            size_t index = h->index;
+            const uint8_t *wide = input->wide_values ? &input->wide_values[index*input->wide_bytes] : NULL;
+            ret = lfr_uniform_add_hashed(groups, &h->hash, index, wide, input->wide_bytes, blocksize);
+            if (ret) break;
+            if (args->factor) {
+                args->factor->hashes[index] = h->hash.augmented ^ input->builder->relations[index].value;
+            }
         }
-
-
-        uint32_t resolution = resolution_block(block_left, block_right);
-        uint32_t merge_step = __builtin_ctzll(resolution);
-        uint8_t augmented_b[sizeof(hash.augmented)];
-        ui2le(augmented_b, sizeof(augmented_b), hash.augmented);
-
-        initialize_row(&groups[block_left], &groups[block_right], &groups[resolution], hash.keyout, augmented_b, merge_step);
+    } else {
+        ret = lfr_uniform_fill_from_source(args, blocks, blocksize, overprovision, lfr_uniform_input_shape(input));
+    }
+    if (ret) {
+#if LFR_THREADED
+        pthread_mutex_lock(&args->mut);
+#endif
+        if (!args->input_ret) args->input_ret = ret;
+#if LFR_THREADED
+        pthread_mutex_unlock(&args->mut);
+#endif
     }
 
     // synchronize
-    wait_for_solved(&groups[0],threadid);
+    wait_for_solved(&groups[0],threadid,NULL);
     mark_as_solved(&groups[0],threadid+1,0);
-    wait_for_solved(&groups[0],nthreads);
+    wait_for_solved(&groups[0],nthreads,NULL);
+    if (threadid == 0) {
+        // Everyone is done filling
+        free(args->hashed);
+        args->hashed = NULL;
+    }
+
+    // If the input was bad, or a source produced fewer relations than it
+    // did when counting, then the groups are inconsistent and we can't solve.
+#if LFR_THREADED
+    pthread_mutex_lock(&args->mut);
+#endif
+    if (!args->input_ret && input->source && args->nfilled != args->nrelns) args->input_ret = EINVAL;
+    ret = args->input_ret;
+#if LFR_THREADED
+    pthread_mutex_unlock(&args->mut);
+#endif
+    if (ret) return NULL;
     
-    int lgstep, ret, i_did_last = 0;
-    for (lgstep=1; 1ull<<lgstep < ngroups; lgstep++) {
+    /* Merge the bottom levels a small subtree at a time.  Each thread claims
+     * whole subtrees, so it doesn't wait on other threads' neighboring groups,
+     * and each merge's output is consumed soon after it's made.  The last
+     * level is never part of a subtree.
+     */
+    int lgstep, i_did_last = 0, sublevels = 0;
+    while (sublevels < LFR_SUBTREE_LEVELS && 2ull<<(sublevels+1) < ngroups) sublevels++;
+    size_t span = 2ull << sublevels;
+    while (sublevels) {
+        size_t base = span * __atomic_fetch_add(&args->next_subtree, 1, __ATOMIC_RELAXED);
+        if (base >= ngroups) break;
+        for (lgstep=1; lgstep<=sublevels; lgstep++) {
+            size_t step = 1ull << lgstep;
+            for (size_t mid=base+step; mid<base+span && mid<ngroups; mid += 2*step) {
+                if (mark_as_mine(&groups[mid],1)) continue;
+                if (( ret = lfr_uniform_merge_step(args, lgstep, mid, 0) )) goto done;
+            }
+        }
+    }
+
+    for (lgstep=sublevels+1; 1ull<<lgstep < ngroups; lgstep++) {
         // check in to see if we failed
 #if LFR_THREADED
         pthread_mutex_lock(&args->mut);
@@ -698,29 +1425,15 @@ static void *lfr_uniform_build_thread (void *args_void) {
         size_t step = 1ull << lgstep;
         int last = 2*step >= ngroups;
         for (size_t mid=step; mid<ngroups; mid += 2*step) {
-            uint64_t left_i = mid-step/2, right_i = mid+step/2;
-            group_t *out = &groups[mid], *left = &groups[left_i], *right = &groups[right_i];
-            
-            if (mark_as_mine(out,1)) continue;
-            ret = wait_for_solved(left,1);
-            if (!ret) ret = wait_for_solved(right,1);
-            
-            if (ret) {
-                // fall through
-            } else if (right->data.rows == 0) {
-                ret = lfr_uniform_move_group(out, left);
-            } else if (left->data.rows == 0) {
-                ret = lfr_uniform_move_group(out, right);
-            } else {
-                ret = lfr_uniform_build_merge(&groups[mid], left, right, lgstep, last);
-            }
-            mark_as_solved(out,1,ret); // don't die and leave them hanging
-        
-            if (ret) goto done;
+            if (mark_as_mine(&groups[mid],1)) continue;
+            if (( ret = lfr_uniform_merge_step(args, lgstep, mid, last) )) goto done;
             if (last) i_did_last = 1;
         }
     }
     
+    // A factorization stops here, and solves for its values later
+    if (args->factor) goto done;
+
     // Start the backprop with remaining free variables all set to 0
     lgstep--;
     group_t *final_group = &groups[1ull<<lgstep];
@@ -728,7 +1441,7 @@ static void *lfr_uniform_build_thread (void *args_void) {
         ret = tile_matrix_init(&final_group->data, final_group->systematic.rhs.cols, 0, args->value_bits);
         mark_as_solved(final_group,2,ret);
     } else {
-        ret = wait_for_solved(final_group,2);
+        ret = wait_for_solved(final_group,2,args->cancel);
     }
     if (ret) goto done;
 
@@ -740,9 +1453,13 @@ static void *lfr_uniform_build_thread (void *args_void) {
             group_t *in = &groups[mid], *left = &groups[left_i], *right = &groups[right_i];
 
             if (mark_as_mine(in,2)) continue;
-            ret = wait_for_solved(in,2);
+            ret = wait_for_solved(in,2,args->cancel);
 
-            if (!ret) ret = lfr_uniform_backward_solve(left, right, in);
+            if (!ret) {
+                ret = lfr_uniform_backward_solve(&left->data, left->cols, &right->data, right->cols,
+                    &in->data, &in->systematic, NULL, args->cancel);
+            }
+            tile_matrix_systematic_destroy(&in->systematic);
             mark_as_solved(left,2,ret);
             mark_as_solved(right,2,ret);
             if (ret) goto done;
@@ -752,8 +1469,9 @@ static void *lfr_uniform_build_thread (void *args_void) {
 done:
 #if LFR_THREADED
     if (ret) {
+        // Don't let a thread that was only cancelled hide the real error
         pthread_mutex_lock(&args->mut);
-        args->ret = ret;
+        if (!args->ret || args->ret == ECANCELED) args->ret = ret;
         pthread_mutex_unlock(&args->mut);
     }
 #else
@@ -764,6 +1482,7 @@ done:
 
 void API_VIS lfr_uniform_map_destroy(lfr_uniform_map_t doomed) {
     if (doomed->data_is_mine) free((uint8_t*)doomed->data);
+    free((size_t*)doomed->stash_index);
     memset(doomed, 0, sizeof(*doomed));
 }
 
@@ -772,51 +1491,230 @@ int API_VIS lfr_uniform_build (lfr_uniform_map_t output, const lfr_builder_t bui
 }
 
 size_t API_VIS _lfr_uniform_map_vector_size(const lfr_uniform_map_t map) {
-    return map->blocks * LFR_BLOCKSIZE * map->value_bits;
+    if (map->engine == LFR_ENGINE_FUSE) return _lfr_fuse_vector_size(map);
+    return map->blocks * lfr_uniform_blocksize(map->blocksize) * map->value_bits;
 }
 
+/* Fitted to measured builds of 3 thousand to 1 million relations: the
+ * matrices and resolution data for both halves of each row, plus the merge
+ * scratch space and the output, came to at most 22 bytes per relation plus 3
+ * per byte of block size, and about 2 more per 8 value bits.  Each extra thread adds up to about 1/2 byte per relation for its
+ * in-flight merge.  The groups themselves are counted separately, because
+ * small blocks make for a lot of them.
+ *
+ * On top of that, bucketing a builder's relations by block holds every
+ * relation's hash while the groups are filled.  When it's on, that's when
+ * the peak is.
+ */
+static const size_t MEMORY_PER_RELATION = 22, MEMORY_PER_BLOCK_BYTE = 3, MEMORY_OVERHEAD = 1<<16;
+
+size_t API_VIS _lfr_uniform_estimate_memory (
+    size_t nrelations,
+    int value_bits,
+    int nthreads,
+    int blocksize,
+    int overprovision,
+    int precondition,
+    int stashing,
+    int bucketing
+) {
+    if (value_bits < 0) value_bits = 64;
+    if (value_bits > LFR_MAX_VALUE_BITS) value_bits = LFR_MAX_VALUE_BITS;
+    nthreads = lfr_nthreads(nthreads);
+    blocksize = lfr_uniform_blocksize(blocksize);
+    overprovision = lfr_uniform_overprovision(overprovision);
+    size_t blocks = nblocks(nrelations, blocksize, overprovision);
+    size_t log_blocks = high_bit(blocks-1), ngroups = 1ull << (2+log_blocks);
+    size_t in_flight = nrelations/2; // for each merge in progress
+    size_t ret = MEMORY_OVERHEAD
+        + ngroups * sizeof(group_t)
+        + nrelations * (MEMORY_PER_RELATION + MEMORY_PER_BLOCK_BYTE*blocksize + value_bits/4)
+        + (nthreads-1) * in_flight;
+
+    /* Bucketing a builder's relations holds all of their hashes while filling */
+    if (bucketing) ret += nrelations * sizeof(lfr_uniform_hashed_t);
+
+    /* Columns beyond what the default overprovision would give are either
+     * spent on random rows as wide as the merges they're added to, or else
+     * left free.  Free columns are carried up through every merge, so they
+     * cost about quadratically.
+     */
+    size_t cols = blocks*8*blocksize, want = _lfr_uniform_provision_columns(nrelations, blocksize, LFR_OVERPROVISION);
+    size_t spare = (cols > want) ? cols - want : 0;
+    if (precondition) {
+        size_t level = (LFR_PRECONDITION_LEVEL < log_blocks) ? LFR_PRECONDITION_LEVEL : log_blocks;
+        ret += spare * (((size_t)blocksize << level) + value_bits/8);
+    } else {
+        ret += spare/8 * (spare/4);
+    }
+
+    /* The stash records which relation each row came from.  A merge which
+     * needs to stash rows is made again from its halves, so it keeps no copy.
+     * Finding the rows to stash takes more, but only for that rare merge.
+     */
+    if (stashing) ret += nrelations * sizeof(size_t);
+    return ret;
+}
+
+size_t API_VIS lfr_build_estimate_memory(size_t nrelations, int value_bits, int nthreads) {
+    return _lfr_uniform_estimate_memory(nrelations, value_bits, nthreads, 0, 0, 0, 0, 1);
+}
+
+/** Estimate the peak memory of building from a builder, with its options */
+static size_t lfr_uniform_builder_estimate_memory(const lfr_builder_s *builder, int value_bits, int nthreads, int bucketing) {
+    return _lfr_uniform_estimate_memory(builder->used, value_bits, nthreads, builder->blocksize,
+        builder->overprovision, builder->precondition, builder->max_stash != 0, bucketing);
+}
+
+/**
+ * Reduce *ntries and *nthreads until the build fits under the builder's
+ * memory limit.  Bucketing the relations costs more memory than anything but
+ * the tries, so if the build doesn't fit with it, set *unbucketed before
+ * reducing the threads.  Return ENOMEM if it doesn't fit even with one thread.
+ */
+static int lfr_uniform_fit_memory(const lfr_builder_t builder, int value_bits, int *nthreads, int *ntries, int *unbucketed) {
+    *unbucketed = 0;
+    if (builder->memory_limit == 0) return 0;
+    if (value_bits < 0) {
+        lfr_response_t union_ = 0;
+        for (size_t i=0; i<builder->used; i++) union_ |= builder->relations[i].value;
+        value_bits = 1 + high_bit(union_);
+    }
+    *nthreads = lfr_nthreads(*nthreads);
+
+    /* Concurrent tries each need their own memory, so drop those first */
+    if (*ntries > *nthreads) *ntries = *nthreads;
+    while (*ntries > 1 && (*ntries) *
+        lfr_uniform_builder_estimate_memory(builder, value_bits, *nthreads / *ntries, 1) > builder->memory_limit) {
+        (*ntries)--;
+    }
+    if (lfr_uniform_builder_estimate_memory(builder, value_bits, *nthreads, 1) > builder->memory_limit) {
+        *unbucketed = 1;
+    }
+    while (*nthreads > 1 && lfr_uniform_builder_estimate_memory(builder, value_bits, *nthreads,
+        !*unbucketed) > builder->memory_limit) {
+        (*nthreads)--;
+    }
+    if (lfr_uniform_builder_estimate_memory(builder, value_bits, *nthreads, !*unbucketed) > builder->memory_limit) {
+        return ENOMEM;
+    }
+    return 0;
+}
+
+/** Allocate a factorization's per-relation arrays, and lay out the leaf groups' rows */
+static int lfr_uniform_factor_setup (
+    lfr_uniform_factor_state_t *state,
+    group_t *groups,
+    size_t blocks,
+    size_t nrelns
+) {
+    size_t nrows = 0;
+    for (size_t block=0; block<blocks; block++) nrows += groups[2*block+1].data.rows;
+    state->hashes = malloc(nrelns * sizeof(*state->hashes));
+    state->leaf_relation = malloc(nrows * sizeof(*state->leaf_relation));
+    if ((nrelns > 0 && state->hashes == NULL) || (nrows > 0 && state->leaf_relation == NULL)) {
+        free(state->hashes);
+        free(state->leaf_relation);
+        state->hashes = NULL;
+        state->leaf_relation = NULL;
+        return ENOMEM;
+    }
+
+    size_t offset = 0;
+    for (size_t block=0; block<blocks; block++) {
+        groups[2*block+1].leaf_relation = &state->leaf_relation[offset];
+        offset += groups[2*block+1].data.rows;
+    }
+    return 0;
+}
+
+/**
+ * Write one block of the map's vector, from the augmented columns of its
+ * solution, which has blocksize*8 rows.
+ */
+static void lfr_uniform_write_block(uint8_t *out, const tile_matrix_t *m, int value_bits, int blocksize) {
+    size_t tstride = m->stride, off = TILES_SPANNING(m->cols);
+    for (int which_augcol=0; which_augcol<value_bits; which_augcol++) {
+        for (size_t tile=0; tile<(size_t)blocksize*8/TILE_SIZE; tile++) {
+            tile_t t = m->data[tile*tstride + off + which_augcol/TILE_SIZE] >> (TILE_SIZE*(which_augcol % TILE_SIZE));
+            for (int b=0; b<TILE_SIZE/8; b++) {
+                *(out++) = (uint8_t)(t>>(8*b));
+            }
+        }
+    }
+}
+
+/**
+ * Try to build a map with one salt.  If factor isn't NULL, then instead of
+ * building a map, keep the forward pass's results in it for resolving values
+ * later.  In that case, value_bits must be 0.
+ */
 static int lfr_uniform_build_core (
     lfr_uniform_map_t output,
-    const lfr_builder_t builder,
+    const lfr_uniform_input_t *input,
     int value_bits,
     int nthreads,
-    lfr_salt_t salt
+    lfr_salt_t salt,
+    int *cancel,
+    lfr_uniform_factor_state_t *factor
 ) {
-    int ret=0;
-    size_t blocks = nblocks(builder->used);
+    int ret=0, cancelled=0;
+    int blocksize = lfr_uniform_input_blocksize(input);
+    if (blocksize != 1 && blocksize != 2 && blocksize != 4 && blocksize != 8) return EINVAL;
+    int shape = lfr_uniform_input_shape(input);
+    if (shape != LFR_SHAPE_FRAYED && shape != LFR_SHAPE_XOR) return EINVAL;
+    size_t blocks = nblocks(input->builder ? input->builder->used : input->nitems,
+        blocksize, lfr_uniform_input_overprovision(input));
     size_t ngroups = 1ull << (2+high_bit(blocks-1));
     group_t *groups = NULL;
     memset(output,0,sizeof(*output));
 
-    if (value_bits < 0) {
-        lfr_response_t union_ = 0;
-        for (size_t i=0; i<builder->used; i++) {
-            union_ |= builder->relations[i].value;
-        }
-        value_bits = 1 + high_bit(union_);
-    } else if ((unsigned)value_bits > 8*sizeof(lfr_response_t)) {
-        return -EINVAL;
-    }
-    /* TODO: what if value_bits == 0? */
+    if (value_bits > (input->wide_values ? LFR_MAX_VALUE_BITS : (int)(8*sizeof(lfr_response_t)))) return EINVAL;
 
+    nthreads = lfr_nthreads(nthreads);
 #if LFR_THREADED
-    size_t len = sizeof(nthreads);
-    int mib[2] = { CTL_HW, HW_NCPU }, sret=0;
-    if (nthreads <= 0) sret = sysctl(mib, 2, &nthreads, &len, NULL, 0);
-    if (nthreads <= 0 || sret != 0) nthreads = 1;
     pthread_t threads[nthreads];
-#else
-    nthreads = 1;
 #endif
 
+    lfr_uniform_stash_t stash;
+    memset(&stash,0,sizeof(stash));
+    if (input->builder && input->builder->max_stash && !factor && !input->multi && !input->wide_values) {
+        stash.max = input->builder->max_stash;
+        stash.stashed = malloc(stash.max * sizeof(*stash.stashed));
+        if (stash.stashed == NULL) return ENOMEM;
+    }
+
     lfr_uniform_build_args_t args;
     memset(&args,0,sizeof(args));
     args.salt = salt;
-    ret = lfr_uniform_build_setup(&groups, builder, salt, value_bits);
-    if (ret) { goto done; }
+    args.stash = stash.max ? &stash : NULL;
+    args.factor = factor;
+    lfr_uniform_block_index_t *first_block = NULL;
+    int bucketing = input->builder && !input->unbucketed;
+    ret = lfr_uniform_build_setup(&groups, &args.nrelns, bucketing ? &first_block : NULL,
+        input, salt, &value_bits, args.stash);
+    if (ret) {
+        free(stash.stashed);
+        return ret; // not a solve failure, so don't retry
+    }
+    if (factor) {
+        /* Lay out the leaf rows' relation indices, one run per block */
+        ret = lfr_uniform_factor_setup(factor, groups, blocks, args.nrelns);
+        if (ret) goto done;
+    }
+    if (bucketing) {
+        ret = lfr_uniform_bucket_relations(&args.hashed, input, first_block, blocks, salt, nthreads);
+        free(first_block);
+        if (ret) goto done;
+    }
+    if (( ret = lfr_uniform_input_rewind(input, &args.nfilled) )) {
+        args.input_ret = ret;
+        goto done;
+    }
 
     // Forward solve
-    args.matrix = &builder[0];
+    args.input = input;
+    args.cancel = cancel ? cancel : &cancelled;
     args.value_bits = value_bits;
     args.groups = groups;
     args.ngroups = ngroups;
@@ -847,10 +1745,23 @@ static int lfr_uniform_build_core (
     pthread_mutex_destroy(&args.mut);
 #endif
     if (!ret) ret = args.ret;
+    if (args.input_ret) ret = args.input_ret;
     if (ret) goto done;
 
-    // Write output
-    uint8_t *out_data = calloc(value_bits, blocks * LFR_BLOCKSIZE);
+    if (factor) {
+        factor->groups = groups;
+        factor->ngroups = ngroups;
+        groups = NULL;
+        goto done;
+    }
+
+    // Write output, with the stash (if any) after the vector
+    size_t vector_bytes = value_bits * blocks * blocksize, stash_bytes = 0;
+    if (stash.nstashed) qsort(stash.stashed, stash.nstashed, sizeof(*stash.stashed), lfr_uniform_compare_index);
+    for (size_t i=0; i<stash.nstashed; i++) {
+        stash_bytes += LFR_STASH_RECORD_HEADER + input->builder->relations[stash.stashed[i]].keybytes;
+    }
+    uint8_t *out_data = calloc(1, vector_bytes + stash_bytes);
     output->data = (const uint8_t *)out_data;
     if (output->data == NULL) {
         ret = ENOMEM;
@@ -860,24 +1771,156 @@ static int lfr_uniform_build_core (
     output->value_bits = value_bits;
     output->data_is_mine = 1;
     output->blocks = blocks;
+    output->blocksize = input->builder ? input->builder->blocksize : 0;
+    output->overprovision = input->builder ? input->builder->overprovision : 0;
+    output->shape = shape;
 
-    size_t byte_index=0;
     for (size_t block=0; block<blocks; block++) {
-        const tile_matrix_t *m = &groups[2*block+1].data;
-        size_t tstride = m->stride, off = TILES_SPANNING(m->cols);
-        for (int which_augcol=0; which_augcol<value_bits; which_augcol++) {
-            for (size_t tile=0; tile<LFR_BLOCKSIZE*8/TILE_SIZE; tile++) {
-                tile_t out = m->data[tile*tstride + off + which_augcol/TILE_SIZE] >> (TILE_SIZE*(which_augcol % TILE_SIZE));
-                for (int b=0; b<TILE_SIZE/8; b++) {
-                    out_data[byte_index++] = (uint8_t)(out>>(8*b));
-                }
-            }
+        lfr_uniform_write_block(&out_data[block*value_bits*blocksize], &groups[2*block+1].data, value_bits, blocksize);
+    }
+
+    if (stash.nstashed) {
+        uint8_t *record = &out_data[vector_bytes];
+        lfr_response_t mask = (value_bits == 8*sizeof(lfr_response_t)) ? -(lfr_response_t)1
+            : ((lfr_response_t)1 << value_bits) - 1;
+        for (size_t i=0; i<stash.nstashed; i++) {
+            const lfr_relation_t *rel = &input->builder->relations[stash.stashed[i]];
+            if (( ret = ui2le(record, 4, rel->keybytes) )) goto done;
+            ui2le(&record[4], 8, rel->value & mask);
+            memcpy(&record[LFR_STASH_RECORD_HEADER], rel->key, rel->keybytes);
+            record += LFR_STASH_RECORD_HEADER + rel->keybytes;
         }
+        output->stash = &out_data[vector_bytes];
+        output->nstash = stash.nstashed;
+        if (( ret = lfr_uniform_stash_index(output) )) goto done;
     }
 
 done:
+    free(args.hashed);
     lfr_builder_destroy_groups(groups, ngroups);
-    if (ret != 0 && ret != ENOMEM) ret = EAGAIN;
+    free(stash.row_relation);
+    free(stash.stashed);
+    if (ret && output->data_is_mine) lfr_uniform_map_destroy(output);
+    if (ret != 0 && ret != ENOMEM && !args.input_ret) ret = EAGAIN;
+    return ret;
+}
+
+#if LFR_THREADED
+/* State shared between concurrent salt attempts */
+typedef struct {
+    const lfr_uniform_input_t *input;
+    int value_bits, nthreads;
+    pthread_mutex_t mut;
+    int next;      // next try to start
+    int stop;      // first try which succeeded or failed hard; no later one matters
+    int ret;       // result of try number stop
+    int *cancel;   // cancel flag for each try
+    lfr_uniform_map_s map; // result of try number stop, if it succeeded
+} lfr_uniform_parallel_tries_t;
+
+static void *lfr_uniform_parallel_try_thread(void *args_void) {
+    lfr_uniform_parallel_tries_t *args = (lfr_uniform_parallel_tries_t *)args_void;
+    const lfr_builder_s *builder = args->input->builder;
+
+    while (1) {
+        pthread_mutex_lock(&args->mut);
+        int i = args->next++;
+        int go = i < args->stop;
+        pthread_mutex_unlock(&args->mut);
+        if (!go) break;
+
+        lfr_uniform_map_t map;
+        lfr_salt_t salt = fmix64(builder->salt ^ (i+builder->salt_hint));
+        int ret = lfr_uniform_build_core(map,args->input,args->value_bits,args->nthreads,salt,&args->cancel[i],NULL);
+
+        pthread_mutex_lock(&args->mut);
+        if (ret != EAGAIN && i < args->stop) {
+            // This try is decisive, unless an earlier one is too
+            lfr_uniform_map_destroy(&args->map);
+            if (ret == 0) {
+                args->map = map[0];
+                args->map._salt_hint = i+builder->salt_hint;
+            }
+            args->stop = i;
+            args->ret = ret;
+            for (int j=i+1; j<builder->max_tries; j++) {
+                __atomic_store_n(&args->cancel[j], 1, __ATOMIC_RELAXED);
+            }
+        } else if (ret == 0) {
+            lfr_uniform_map_destroy(map);
+        }
+        pthread_mutex_unlock(&args->mut);
+    }
+    return NULL;
+}
+
+/* Try up to ntries salts at once, each with nthreads/ntries threads */
+static int lfr_uniform_build_parallel_tries (
+    lfr_uniform_map_t output,
+    const lfr_uniform_input_t *input,
+    int value_bits,
+    int nthreads,
+    int ntries
+) {
+    const lfr_builder_s *builder = input->builder;
+    lfr_uniform_parallel_tries_t args;
+    memset(&args,0,sizeof(args));
+    args.input = input;
+    args.value_bits = value_bits;
+    args.nthreads = nthreads / ntries;
+    args.stop = builder->max_tries;
+    args.ret = EAGAIN;
+    args.cancel = calloc(builder->max_tries, sizeof(*args.cancel));
+    if (args.cancel == NULL) return ENOMEM;
+    int ret = pthread_mutex_init(&args.mut, NULL);
+    if (ret) {
+        free(args.cancel);
+        return ret;
+    }
+
+    pthread_t threads[ntries];
+    int i;
+    for (i=1; i<ntries; i++) {
+        if (pthread_create(&threads[i], NULL, lfr_uniform_parallel_try_thread, &args)) break;
+    }
+    lfr_uniform_parallel_try_thread(&args);
+    for (int j=1; j<i; j++) pthread_join(threads[j], NULL);
+
+    pthread_mutex_destroy(&args.mut);
+    free(args.cancel);
+    if (args.ret == 0) output[0] = args.map;
+    return args.ret;
+}
+#endif
+
+/** Build from a builder, trying its salts as described for lfr_uniform_build_threaded */
+static int lfr_uniform_build_with_tries (
+    lfr_uniform_map_t output,
+    const lfr_uniform_input_t *input,
+    int value_bits,
+    int nthreads
+) {
+    const lfr_builder_s *builder = input->builder;
+    if (builder->engine != LFR_ENGINE_FRAYED) return EINVAL;
+    int ntries = builder->parallel_tries;
+    lfr_uniform_input_t fitted = *input;
+    int ret = lfr_uniform_fit_memory(builder, value_bits, &nthreads, &ntries, &fitted.unbucketed);
+    if (ret) return ret;
+    input = &fitted;
+
+#if LFR_THREADED
+    nthreads = lfr_nthreads(nthreads);
+    if (ntries > nthreads) ntries = nthreads;
+    if (ntries > builder->max_tries) ntries = builder->max_tries;
+    if (ntries > 1) return lfr_uniform_build_parallel_tries(output,input,value_bits,nthreads,ntries);
+#endif
+
+    ret = EAGAIN;
+    for (int i=0; i<builder->max_tries && ret == EAGAIN; i++) {
+        lfr_salt_t salt = fmix64(builder->salt ^ (i+builder->salt_hint));
+        ret = lfr_uniform_build_core(output,input,value_bits,nthreads,salt,NULL,NULL);
+        if (!ret) output->_salt_hint = i+builder->salt_hint;
+    }
     return ret;
 }
 
@@ -887,57 +1930,502 @@ int API_VIS lfr_uniform_build_threaded (
     int value_bits,
     int nthreads
 ) {
-    int ret=EAGAIN;
-    for (int i=0; i<builder->max_tries && ret; i++) {
+    if (builder->engine == LFR_ENGINE_FUSE) return _lfr_fuse_build(output,builder,value_bits);
+    lfr_uniform_input_t input = { builder, NULL, NULL, 0, NULL, NULL, 0, 0 };
+    return lfr_uniform_build_with_tries(output,&input,value_bits,nthreads);
+}
+
+int API_VIS lfr_uniform_build_wide (
+    lfr_uniform_map_t output,
+    const lfr_builder_t builder,
+    const uint8_t *values,
+    int value_bits,
+    int nthreads
+) {
+    if (value_bits < 0 || value_bits > LFR_MAX_VALUE_BITS) return EINVAL;
+    lfr_uniform_input_t input = { builder, NULL, NULL, 0, NULL, values, (value_bits+7)/8, 0 };
+    return lfr_uniform_build_with_tries(output,&input,value_bits,nthreads);
+}
+
+int API_VIS lfr_uniform_build_multi (
+    lfr_uniform_map_s *maps,
+    unsigned nmaps,
+    const lfr_builder_t builder,
+    const lfr_response_t *const *values,
+    const int *value_bits,
+    int nthreads
+) {
+    int bits[nmaps ? nmaps : 1], total = 0;
+    for (unsigned j=0; j<nmaps; j++) {
+        bits[j] = value_bits[j];
+        if (bits[j] < 0) {
+            lfr_response_t union_ = 0;
+            for (size_t i=0; i<builder->used; i++) union_ |= values[j] ? values[j][i] : builder->relations[i].value;
+            bits[j] = 1 + high_bit(union_);
+        }
+        total += bits[j];
+        if (total > (int)(8*sizeof(lfr_response_t))) return EINVAL;
+    }
+    memset(maps, 0, nmaps*sizeof(*maps));
+
+    lfr_uniform_multi_t multi = { nmaps, values, bits };
+    lfr_uniform_input_t input = { builder, NULL, NULL, 0, &multi, NULL, 0, 0 };
+    lfr_uniform_map_t combined;
+    int ret = lfr_uniform_build_with_tries(combined,&input,total,nthreads);
+    if (ret) return ret;
+
+    /* Split the combined vector.  Each block holds each column in turn, so
+     * each map's part of a block is contiguous. */
+    size_t blocks = combined->blocks, offset = 0;
+    int blocksize = lfr_uniform_blocksize(combined->blocksize);
+    for (unsigned j=0; j<nmaps; j++) {
+        size_t block_bytes = bits[j] * blocksize;
+        uint8_t *data = malloc(blocks * block_bytes);
+        if (blocks * block_bytes > 0 && data == NULL) {
+            for (unsigned k=0; k<j; k++) lfr_uniform_map_destroy(&maps[k]);
+            ret = ENOMEM;
+            break;
+        }
+        for (size_t block=0; block<blocks; block++) {
+            memcpy(&data[block*block_bytes], &combined->data[(block*total + offset) * blocksize], block_bytes);
+        }
+        offset += bits[j];
+        maps[j].blocks = blocks;
+        maps[j].salt = combined->salt;
+        maps[j]._salt_hint = combined->_salt_hint;
+        maps[j].blocksize = combined->blocksize;
+        maps[j].overprovision = combined->overprovision;
+        maps[j].shape = combined->shape;
+        maps[j].value_bits = bits[j];
+        maps[j].data = data;
+        maps[j].data_is_mine = 1;
+    }
+    lfr_uniform_map_destroy(combined);
+    return ret;
+}
+
+int API_VIS lfr_uniform_build_from_source (
+    lfr_uniform_map_t output,
+    lfr_relation_source_t source,
+    void *ctx,
+    size_t nitems,
+    int value_bits
+) {
+    return lfr_uniform_build_from_source_threaded(output,source,ctx,nitems,value_bits,0);
+}
+
+/** Count the relations in a source, up to nitems, and size the build from that count */
+static int lfr_uniform_count_source(lfr_uniform_input_t *input) {
+    size_t count;
+    lfr_relation_t relation;
+    int ret = lfr_uniform_input_rewind(input, &count);
+    while (!ret) ret = lfr_uniform_input_next(input, &count, &relation);
+    if (ret != ENOENT) return ret;
+    input->nitems = count;
+    return 0;
+}
+
+int API_VIS lfr_uniform_build_from_source_threaded (
+    lfr_uniform_map_t output,
+    lfr_relation_source_t source,
+    void *ctx,
+    size_t nitems,
+    int value_bits,
+    int nthreads
+) {
+    lfr_uniform_input_t input = { NULL, source, ctx, nitems, NULL, NULL, 0, 0 };
+    lfr_salt_t salt;
+    if (getentropy(&salt, sizeof(salt))) return errno ? errno : EIO;
+
+    int ret = lfr_uniform_count_source(&input);
+    if (ret) return ret;
+    ret = EAGAIN;
+    for (int i=0; i<LFR_DEFAULT_TRIES && ret == EAGAIN; i++) {
+        ret = lfr_uniform_build_core(output,&input,value_bits,nthreads,fmix64(salt ^ i),NULL,NULL);
+        if (!ret) output->_salt_hint = i;
+    }
+    return ret;
+}
+
+int API_VIS lfr_uniform_factor (
+    lfr_uniform_factor_t factor,
+    const lfr_builder_t builder,
+    int nthreads
+) {
+    lfr_uniform_input_t input = { builder, NULL, NULL, 0, NULL, NULL, 0, 0 };
+    memset(factor,0,sizeof(*factor));
+    if (builder->engine != LFR_ENGINE_FRAYED) return EINVAL;
+    lfr_uniform_factor_state_t *state = calloc(1, sizeof(*state));
+    if (state == NULL) return ENOMEM;
+
+    int ret = EAGAIN;
+    for (int i=0; i<builder->max_tries && ret == EAGAIN; i++) {
+        lfr_uniform_map_t unused;
         lfr_salt_t salt = fmix64(builder->salt ^ (i+builder->salt_hint));
-        ret = lfr_uniform_build_core(output,builder,value_bits,nthreads,salt);
-        if (!ret) output->_salt_hint = i+builder->salt_hint;
+        ret = lfr_uniform_build_core(unused,&input,0,nthreads,salt,NULL,state);
+        if (!ret) {
+            factor->salt = salt;
+            factor->_salt_hint = i+builder->salt_hint;
+        } else {
+            free(state->hashes);
+            free(state->leaf_relation);
+            memset(state,0,sizeof(*state));
+        }
+    }
+    if (ret) {
+        free(state);
+        return ret;
+    }
+
+    factor->blocksize = builder->blocksize;
+    factor->overprovision = builder->overprovision;
+    factor->shape = builder->shape;
+    factor->blocks = nblocks(builder->used, lfr_uniform_blocksize(builder->blocksize),
+        lfr_uniform_overprovision(builder->overprovision));
+    factor->nrelns = builder->used;
+    factor->state = state;
+    return 0;
+}
+
+void API_VIS lfr_uniform_factor_destroy(lfr_uniform_factor_t factor) {
+    lfr_uniform_factor_state_t *state = factor->state;
+    if (state) {
+        lfr_builder_destroy_groups(state->groups, state->ngroups);
+        free(state->hashes);
+        free(state->leaf_relation);
+        free(state);
+    }
+    memset(factor,0,sizeof(*factor));
+}
+
+/**
+ * Replay a merge of a factorization on the values.  Left and right are the
+ * values of the two halves' rows, and are destroyed.  The merged rows' values,
+ * times factor_sys, become the systematic form's augmented columns in sys, and
+ * (unless last) the unmerged rows' values, plus factor_out times the merged
+ * rows' values, become the output's in out.
+ */
+static int lfr_uniform_resolve_merge (
+    tile_matrix_t *out,
+    tile_matrix_t *sys,
+    tile_matrix_t *left,
+    tile_matrix_t *right,
+    const group_t *result,
+    const group_t *left_group,
+    const group_t *right_group,
+    uint8_t merge_step,
+    int last
+) {
+    int ret;
+    size_t value_bits = left->aug_cols;
+    if (right_group->cols == 0 || left_group->cols == 0) {
+        // The merge just moved the side that exists, as in lfr_uniform_move_group
+        tile_matrix_t *moved = right_group->cols ? right : left;
+        *out = *moved;
+        memset(moved, 0, sizeof(*moved));
+        tile_matrix_destroy(left);
+        tile_matrix_destroy(right);
+        return 0;
     }
+
+    tile_matrix_t working[1];
+    memset(working,0,sizeof(working));
+    ret = tile_matrix_init(working, result->rows, 0, value_bits);
+    if (ret) goto done;
+    lfr_uniform_half_merge(working, NULL, left, left_group->row_resolution, result->rows, 0, merge_step, 1);
+    lfr_uniform_half_merge(working, NULL, right, right_group->row_resolution, result->rows, 0, merge_step, 1);
+
+    ret = tile_matrix_init(sys, result->factor_sys.rows, 0, value_bits);
+    if (ret) goto done;
+    tile_matrix_multiply_accumulate(sys, &result->factor_sys, working);
+    if (last) goto done;
+
+    ret = tile_matrix_init(out, left->rows + right->rows, 0, value_bits);
+    if (ret) goto done;
+    tile_matrix_copy_rows(out, left, 0, 0, left->rows);
+    tile_matrix_copy_rows(out, right, left->rows, 0, right->rows);
+    tile_matrix_multiply_accumulate(out, &result->factor_out, working);
+
+done:
+    tile_matrix_destroy(working);
+    tile_matrix_destroy(left);
+    tile_matrix_destroy(right);
     return ret;
 }
 
-typedef struct {
-    lfr_uniform_block_t x;
-} __attribute__((packed)) unaligned_block_t;
+int API_VIS lfr_uniform_resolve_values (
+    lfr_uniform_map_t output,
+    const lfr_uniform_factor_t factor,
+    const lfr_response_t *values,
+    int value_bits
+) {
+    const lfr_uniform_factor_state_t *state = factor->state;
+    const group_t *groups = state->groups;
+    size_t ngroups = state->ngroups, blocks = factor->blocks;
+    memset(output,0,sizeof(*output));
 
-uint64_t API_VIS lfr_uniform_query (
+    if (value_bits > (int)(8*sizeof(lfr_response_t))) return EINVAL;
+    if (value_bits < 0) {
+        lfr_response_t union_ = 0;
+        for (size_t i=0; i<factor->nrelns; i++) union_ |= values[i];
+        value_bits = 1 + high_bit(union_);
+    }
+
+    // The values of each group's rows, and of its systematic form's
+    int ret = 0;
+    tile_matrix_t *vals = calloc(2*ngroups, sizeof(*vals)), *sys_vals = &vals[ngroups];
+    if (vals == NULL) return ENOMEM;
+
+    // Each leaf row's value is its hash plus its relation's value, if it has one
+    for (size_t block=0; block<blocks; block++) {
+        const group_t *g = &groups[2*block+1];
+        tile_matrix_t *m = &vals[2*block+1];
+        ret = tile_matrix_init(m, g->rows, 0, value_bits);
+        if (ret) goto done;
+        for (size_t row=0; row<g->rows; row++) {
+            size_t rel = g->leaf_relation[row];
+            uint8_t augdata[sizeof(lfr_response_t)];
+            ui2le(augdata, sizeof(augdata), (rel == SIZE_MAX) ? 0 : state->hashes[rel] ^ values[rel]);
+            tile_matrix_stage_row(m, row, NULL, augdata);
+        }
+    }
+
+    // Forward pass, through the saved merges
+    int lgstep;
+    for (lgstep=1; 1ull<<lgstep < ngroups; lgstep++) {
+        size_t step = 1ull << lgstep;
+        int last = 2*step >= ngroups;
+        for (size_t mid=step; mid<ngroups; mid += 2*step) {
+            size_t left = mid-step/2, right = mid+step/2;
+            ret = lfr_uniform_resolve_merge(&vals[mid], &sys_vals[mid], &vals[left], &vals[right],
+                &groups[mid], &groups[left], &groups[right], lgstep, last);
+            if (ret) goto done;
+        }
+    }
+
+    // Backward pass, as in lfr_uniform_build_thread
+    lgstep--;
+    tile_matrix_t *final_vals = &vals[1ull<<lgstep];
+    tile_matrix_destroy(final_vals);
+    ret = tile_matrix_init(final_vals, groups[1ull<<lgstep].systematic.rhs.cols, 0, value_bits);
+    if (ret) goto done;
+    for (; lgstep >= 1; lgstep--) {
+        size_t step = 1ull << lgstep;
+        for (size_t mid=step; mid<ngroups; mid += 2*step) {
+            size_t left = mid-step/2, right = mid+step/2;
+            ret = lfr_uniform_backward_solve(&vals[left], groups[left].cols, &vals[right], groups[right].cols,
+                &vals[mid], &groups[mid].systematic, &sys_vals[mid], NULL);
+            tile_matrix_destroy(&sys_vals[mid]);
+            if (ret) goto done;
+        }
+    }
+
+    int blocksize = lfr_uniform_blocksize(factor->blocksize);
+    size_t block_bytes = value_bits * blocksize;
+    uint8_t *out_data = calloc(1, blocks * block_bytes);
+    if (out_data == NULL) {
+        ret = ENOMEM;
+        goto done;
+    }
+    for (size_t block=0; block<blocks; block++) {
+        lfr_uniform_write_block(&out_data[block*block_bytes], &vals[2*block+1], value_bits, blocksize);
+    }
+    output->data = (const uint8_t *)out_data;
+    output->data_is_mine = 1;
+    output->salt = factor->salt;
+    output->_salt_hint = factor->_salt_hint;
+    output->blocksize = factor->blocksize;
+    output->overprovision = factor->overprovision;
+    output->shape = factor->shape;
+    output->value_bits = value_bits;
+    output->blocks = blocks;
+
+done:
+    if (vals) {
+        for (size_t i=0; i<2*ngroups; i++) tile_matrix_destroy(&vals[i]);
+        free(vals);
+    }
+    return ret;
+}
+
+/**
+ * Look up a key in the map's stash, given its hash's augmented word.
+ * Return 1 and set *value if it's there.
+ */
+static int lfr_uniform_stash_lookup (
+    lfr_response_t *value,
     const lfr_uniform_map_t map,
+    lfr_response_t augmented,
     const uint8_t *key,
     size_t keybytes
 ) {
-    size_t value_bits = map->value_bits;
-    
-    _lfr_hash_result_t hash = _lfr_uniform_hash(key, keybytes, map->salt, map->blocks);
-    lfr_uniform_block_t key_blk[2];
-    memcpy(key_blk, hash.keyout, sizeof(key_blk));
+    size_t mask = lfr_uniform_stash_slots(map->nstash) - 1;
+    for (size_t slot = augmented & mask; map->stash_index[slot]; slot = (slot+1) & mask) {
+        const uint8_t *record = &map->stash[map->stash_index[slot] - 1];
+        if (le2ui(record, 4) == keybytes && !memcmp(&record[LFR_STASH_RECORD_HEADER], key, keybytes)) {
+            *value = le2ui(&record[4], 8);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/** Return the number of bytes in the map's stash records */
+static size_t lfr_uniform_stash_bytes(const lfr_uniform_map_t map) {
+    const uint8_t *record = map->stash;
+    for (size_t i=0; i<map->nstash; i++) {
+        record += LFR_STASH_RECORD_HEADER + le2ui(record, 4);
+    }
+    return record - map->stash;
+}
+
+/**
+ * Load a block of blocksize bytes.  Keys and vectors are loaded the same
+ * way, so the parity of their dot product doesn't depend on endianness.
+ */
+static inline __attribute__((always_inline))
+uint64_t lfr_uniform_load_block(const uint8_t *p, int blocksize) {
+    uint64_t x = 0;
+    memcpy(&x, p, blocksize);
+    return x;
+}
+
+/**
+ * Query a map with blocks of blocksize bytes.  It's inlined with a constant
+ * blocksize by lfr_uniform_query, so that each size gets its own loop, and
+ * default maps get a constant overprovision and shape too.
+ */
+static inline __attribute__((always_inline))
+uint64_t lfr_uniform_query_blocksize (
+    const lfr_uniform_map_t map,
+    const uint8_t *key,
+    size_t keybytes,
+    int blocksize,
+    int overprovision,
+    int shape
+) {
+    size_t value_bits = map->value_bits, nbits = value_bits;
+    _lfr_hash_result_t hash = _lfr_uniform_hash(key, keybytes, map->salt, map->blocks,
+        blocksize, overprovision, shape);
+    uint64_t key0 = lfr_uniform_load_block(hash.keyout, blocksize);
+    uint64_t key1 = lfr_uniform_load_block(&hash.keyout[blocksize], blocksize);
     lfr_response_t ret = hash.augmented;
+    if (map->nstash && lfr_uniform_stash_lookup(&ret, map, hash.augmented, key, keybytes)) return ret;
     uint64_t mask;
-    if (value_bits == 8*sizeof(ret)) {
+    if (value_bits >= 8*sizeof(ret)) {
         mask = -1ull;
+        nbits = 8*sizeof(ret); // the low bits of a wide map
     } else {
         mask = (1ull<<value_bits) - 1;
     }
 
-    const unaligned_block_t *vectors_blk = (const unaligned_block_t *) map->data;
-    const unaligned_block_t *blkptr0 = &vectors_blk[value_bits*hash.block_positions[0]];
-    const unaligned_block_t *blkptr1 = &vectors_blk[value_bits*hash.block_positions[1]];
+    const uint8_t *blkptr0 = &map->data[value_bits*blocksize*hash.block_positions[0]];
+    const uint8_t *blkptr1 = &map->data[value_bits*blocksize*hash.block_positions[1]];
 
     #pragma clang loop vectorize(disable) // small trip count, not worth it
-    for (size_t obit=0; obit<value_bits; obit++) {
-        lfr_uniform_block_t dot = (blkptr0[obit].x & key_blk[0]) ^ (blkptr1[obit].x & key_blk[1]);
+    for (size_t obit=0; obit<nbits; obit++) {
+        uint64_t dot = (lfr_uniform_load_block(&blkptr0[obit*blocksize], blocksize) & key0)
+                     ^ (lfr_uniform_load_block(&blkptr1[obit*blocksize], blocksize) & key1);
         ret ^= (uint64_t)parity(dot) << obit;
     }
     return ret & mask;
 }
 
+uint64_t API_VIS lfr_uniform_query (
+    const lfr_uniform_map_t map,
+    const uint8_t *key,
+    size_t keybytes
+) {
+    if (map->overprovision == 0 && map->shape == LFR_SHAPE_FRAYED && map->engine == LFR_ENGINE_FRAYED
+        && lfr_uniform_blocksize(map->blocksize) == LFR_BLOCKSIZE) {
+        return lfr_uniform_query_blocksize(map, key, keybytes, LFR_BLOCKSIZE, LFR_OVERPROVISION, LFR_SHAPE_FRAYED);
+    }
+    if (map->engine == LFR_ENGINE_FUSE) return _lfr_fuse_query(map, key, keybytes);
+    int overprovision = lfr_uniform_overprovision(map->overprovision), shape = map->shape;
+    switch (lfr_uniform_blocksize(map->blocksize)) {
+    case 1:  return lfr_uniform_query_blocksize(map, key, keybytes, 1, overprovision, shape);
+    case 2:  return lfr_uniform_query_blocksize(map, key, keybytes, 2, overprovision, shape);
+    case 8:  return lfr_uniform_query_blocksize(map, key, keybytes, 8, overprovision, shape);
+    default: return lfr_uniform_query_blocksize(map, key, keybytes, 4, overprovision, shape);
+    }
+}
+
+void API_VIS lfr_uniform_query_wide (
+    uint8_t *out,
+    const lfr_uniform_map_t map,
+    const uint8_t *key,
+    size_t keybytes
+) {
+    size_t value_bits = map->value_bits, bytes = (value_bits+7)/8;
+    if (value_bits <= 8*sizeof(lfr_response_t)) {
+        ui2le(out, bytes, lfr_uniform_query(map,key,keybytes));
+        return;
+    }
+
+    int blocksize = lfr_uniform_blocksize(map->blocksize);
+    _lfr_hash_result_t hash = _lfr_uniform_hash(key, keybytes, map->salt, map->blocks,
+        blocksize, lfr_uniform_overprovision(map->overprovision), map->shape);
+    uint64_t key0 = lfr_uniform_load_block(hash.keyout, blocksize);
+    uint64_t key1 = lfr_uniform_load_block(&hash.keyout[blocksize], blocksize);
+
+    const uint8_t *blkptr0 = &map->data[value_bits*blocksize*hash.block_positions[0]];
+    const uint8_t *blkptr1 = &map->data[value_bits*blocksize*hash.block_positions[1]];
+
+    memset(out, 0, bytes);
+    for (size_t obit=0; obit<value_bits; obit++) {
+        uint64_t dot = (lfr_uniform_load_block(&blkptr0[obit*blocksize], blocksize) & key0)
+                     ^ (lfr_uniform_load_block(&blkptr1[obit*blocksize], blocksize) & key1);
+        out[obit/8] |= parity(dot) << (obit%8);
+    }
+    lfr_uniform_xor_wide_mask(out, bytes, hash.augmented);
+    if (value_bits % 8) out[bytes-1] &= (1u << (value_bits%8)) - 1;
+}
+
 typedef struct {
     uint8_t salt[sizeof(lfr_salt_t)];
     uint8_t blocks[5];
     uint8_t value_bits;
 } __attribute__((packed)) lfr_uniform_map_header_t;
 
+/* Set in the header's value_bits if the vector is followed by a stash:
+ * the number of records (4 bytes LE), then the records themselves.
+ */
+#define LFR_UNIFORM_HEADER_STASH 0x80
+
+/* The header's value_bits (without the stash flag) if there are more than
+ * 64.  The real number follows the header, as 2 bytes LE.
+ */
+#define LFR_UNIFORM_HEADER_WIDE 0x7F
+#define LFR_UNIFORM_WIDE_BYTES 2
+
+/* The number of blocks takes the low 4 bytes of the header's blocks, since
+ * blocks are indexed with 32 bits.  The top byte is the block size, or 0
+ * for LFR_BLOCKSIZE, so that default maps serialize as they always have.
+ */
+#define LFR_UNIFORM_HEADER_BLOCKSIZE 4
+
+/* Set in the header's block size byte if the map's overprovision isn't
+ * LFR_OVERPROVISION.  It follows the header (and the wide value bits, if
+ * any), as 2 bytes LE.
+ */
+#define LFR_UNIFORM_HEADER_OVERPROVISION 0x80
+#define LFR_UNIFORM_OVERPROVISION_BYTES 2
+
+/* Set in the header's block size byte if the map has LFR_SHAPE_XOR */
+#define LFR_UNIFORM_HEADER_XOR_SHAPE 0x40
+
+/* Set in the header's block size byte if the map has LFR_ENGINE_FUSE.  Then
+ * the low bits are the log2 segment length, blocks is the number of
+ * segments, and there's no overprovision, shape or stash.
+ */
+#define LFR_UNIFORM_HEADER_FUSE 0x20
+
 size_t API_VIS lfr_uniform_map_serial_size(const lfr_uniform_map_t map) {
-    return sizeof(lfr_uniform_map_header_t) + _lfr_uniform_map_vector_size(map);
+    size_t ret = sizeof(lfr_uniform_map_header_t) + _lfr_uniform_map_vector_size(map);
+    if (map->value_bits > 8*sizeof(lfr_response_t)) ret += LFR_UNIFORM_WIDE_BYTES;
+    if (lfr_uniform_overprovision(map->overprovision) != LFR_OVERPROVISION) ret += LFR_UNIFORM_OVERPROVISION_BYTES;
+    if (map->nstash) ret += 4 + lfr_uniform_stash_bytes(map);
+    return ret;
 }
 
 int API_VIS lfr_uniform_map_serialize(uint8_t *out, const lfr_uniform_map_t map) {
@@ -945,11 +2433,39 @@ int API_VIS lfr_uniform_map_serialize(uint8_t *out, const lfr_uniform_map_t map)
     
     int ret = ui2le(header->salt, sizeof(header->salt), map->salt);
     if (ret) return ret;
-    ret = ui2le(header->blocks, sizeof(header->blocks), map->blocks);
+    ret = ui2le(header->blocks, LFR_UNIFORM_HEADER_BLOCKSIZE, map->blocks);
     if (ret) return ret;
+    if (map->engine == LFR_ENGINE_FUSE) {
+        header->blocks[LFR_UNIFORM_HEADER_BLOCKSIZE] = LFR_UNIFORM_HEADER_FUSE | map->blocksize;
+    } else {
+        int blocksize = lfr_uniform_blocksize(map->blocksize);
+        header->blocks[LFR_UNIFORM_HEADER_BLOCKSIZE] = (blocksize == LFR_BLOCKSIZE) ? 0 : blocksize;
+        if (map->shape == LFR_SHAPE_XOR) header->blocks[LFR_UNIFORM_HEADER_BLOCKSIZE] |= LFR_UNIFORM_HEADER_XOR_SHAPE;
+    }
     header->value_bits = map->value_bits;
+    out += sizeof(*header);
+    if (map->value_bits > 8*sizeof(lfr_response_t)) {
+        header->value_bits = LFR_UNIFORM_HEADER_WIDE;
+        ret = ui2le(out, LFR_UNIFORM_WIDE_BYTES, map->value_bits);
+        if (ret) return ret;
+        out += LFR_UNIFORM_WIDE_BYTES;
+    }
+    if (lfr_uniform_overprovision(map->overprovision) != LFR_OVERPROVISION) {
+        header->blocks[LFR_UNIFORM_HEADER_BLOCKSIZE] |= LFR_UNIFORM_HEADER_OVERPROVISION;
+        ret = ui2le(out, LFR_UNIFORM_OVERPROVISION_BYTES, map->overprovision);
+        if (ret) return ret;
+        out += LFR_UNIFORM_OVERPROVISION_BYTES;
+    }
     
-    memcpy(out + sizeof(*header), map->data, _lfr_uniform_map_vector_size(map));
+    size_t vector_bytes = _lfr_uniform_map_vector_size(map);
+    memcpy(out, map->data, vector_bytes);
+    if (map->nstash) {
+        header->value_bits |= LFR_UNIFORM_HEADER_STASH;
+        out += vector_bytes;
+        ret = ui2le(out, 4, map->nstash);
+        if (ret) return ret;
+        memcpy(out + 4, map->stash, lfr_uniform_stash_bytes(map));
+    }
     return 0;
 }
 
@@ -966,14 +2482,69 @@ int API_VIS lfr_uniform_map_deserialize (
     data_size -= sizeof(*header);
     data += sizeof(*header);
 
-    uint64_t value_bits = header->value_bits;
-    if (value_bits > 8*sizeof(lfr_response_t)) return EINVAL;
+    uint64_t value_bits = header->value_bits & ~LFR_UNIFORM_HEADER_STASH;
+    if (value_bits == LFR_UNIFORM_HEADER_WIDE) {
+        if (data_size < LFR_UNIFORM_WIDE_BYTES) return EINVAL;
+        value_bits = le2ui(data, LFR_UNIFORM_WIDE_BYTES);
+        data_size -= LFR_UNIFORM_WIDE_BYTES;
+        data += LFR_UNIFORM_WIDE_BYTES;
+        if (value_bits <= 8*sizeof(lfr_response_t) || value_bits > LFR_MAX_VALUE_BITS) return EINVAL;
+    } else if (value_bits > 8*sizeof(lfr_response_t)) {
+        return EINVAL;
+    }
 
-    uint64_t blocks = le2ui(header->blocks, sizeof(header->blocks));
-    /* Check can't overflow because it's 1 byte * 5 bytes * small sizeof */
-    if (data_size != value_bits * blocks * LFR_BLOCKSIZE) return EINVAL;
+    uint16_t overprovision = 0;
+    if (header->blocks[LFR_UNIFORM_HEADER_BLOCKSIZE] & LFR_UNIFORM_HEADER_OVERPROVISION) {
+        if (data_size < LFR_UNIFORM_OVERPROVISION_BYTES) return EINVAL;
+        overprovision = le2ui(data, LFR_UNIFORM_OVERPROVISION_BYTES);
+        data_size -= LFR_UNIFORM_OVERPROVISION_BYTES;
+        data += LFR_UNIFORM_OVERPROVISION_BYTES;
+        if (overprovision == 0) return EINVAL;
+    }
+
+    uint64_t blocks = le2ui(header->blocks, LFR_UNIFORM_HEADER_BLOCKSIZE);
+    uint8_t size_byte = header->blocks[LFR_UNIFORM_HEADER_BLOCKSIZE];
+    uint8_t shape = (size_byte & LFR_UNIFORM_HEADER_XOR_SHAPE) ? LFR_SHAPE_XOR : LFR_SHAPE_FRAYED;
+    uint8_t engine = (size_byte & LFR_UNIFORM_HEADER_FUSE) ? LFR_ENGINE_FUSE : LFR_ENGINE_FRAYED;
+    uint8_t blocksize = size_byte
+        & ~(LFR_UNIFORM_HEADER_OVERPROVISION | LFR_UNIFORM_HEADER_XOR_SHAPE | LFR_UNIFORM_HEADER_FUSE);
+    size_t vector_bytes, nstash = 0;
+    if (engine == LFR_ENGINE_FUSE) {
+        if (size_byte & (LFR_UNIFORM_HEADER_OVERPROVISION | LFR_UNIFORM_HEADER_XOR_SHAPE)) return EINVAL;
+        if (header->value_bits & LFR_UNIFORM_HEADER_STASH) return EINVAL;
+        if (value_bits > 8*sizeof(lfr_response_t) || blocksize > LFR_FUSE_MAX_SEGMENT_BITS || blocks < 3) return EINVAL;
+        map->blocks = blocks;
+        map->blocksize = blocksize;
+        map->value_bits = value_bits;
+        /* Can't overflow because it's 4 bytes * 18 bits * 64 */
+        vector_bytes = _lfr_fuse_vector_size(map);
+    } else {
+        if (blocksize != 0 && blocksize != 1 && blocksize != 2 && blocksize != 4 && blocksize != 8) return EINVAL;
+        /* Check can't overflow because it's 2 bytes * 4 bytes * 1 byte */
+        vector_bytes = value_bits * blocks * lfr_uniform_blocksize(blocksize);
+    }
+    if (header->value_bits & LFR_UNIFORM_HEADER_STASH) {
+        /* Check that the stash records exactly fill the rest */
+        if (data_size < vector_bytes + 4) return EINVAL;
+        size_t offset = vector_bytes + 4;
+        nstash = le2ui(&data[vector_bytes], 4);
+        for (size_t i=0; i<nstash; i++) {
+            if (data_size - offset < LFR_STASH_RECORD_HEADER) return EINVAL;
+            size_t len = le2ui(&data[offset], 4);
+            offset += LFR_STASH_RECORD_HEADER;
+            if (data_size - offset < len) return EINVAL;
+            offset += len;
+        }
+        if (offset != data_size) return EINVAL;
+    } else if (data_size != vector_bytes) {
+        return EINVAL;
+    }
 
     map->blocks = blocks;
+    map->blocksize = blocksize;
+    map->overprovision = overprovision;
+    map->shape = shape;
+    map->engine = engine;
     map->value_bits = value_bits;
     if (flags & LFR_NO_COPY_DATA) {
         map->data_is_mine = 0;
@@ -990,5 +2561,13 @@ int API_VIS lfr_uniform_map_deserialize (
     }
     map->salt = le2ui(header->salt, sizeof(header->salt));
     map->_salt_hint = 0;
+    if (nstash) {
+        map->nstash = nstash;
+        map->stash = &map->data[vector_bytes + 4];
+        if (lfr_uniform_stash_index(map)) {
+            lfr_uniform_map_destroy(map);
+            return ENOMEM;
+        }
+    }
     return 0;
 }
@@ -35,14 +35,24 @@ extern "C" {
  *                     Compiled uniform maps                     *
  *****************************************************************/
 
+/** The most value bits that a map can have, with lfr_uniform_build_wide */
+#define LFR_MAX_VALUE_BITS 256
+
 /** A compiled uniform map. */ 
 typedef struct {
     size_t blocks;
     lfr_salt_t salt;
-    uint8_t value_bits;
+    uint16_t value_bits;
     uint8_t data_is_mine; // vector memory was allocated here, and should be deallocated with lfr_uniform_map_destroy
     uint8_t _salt_hint; // used when the salt is derived
     const uint8_t *data; // never modified but may be freed
+    uint8_t blocksize; // bytes per block (1, 2, 4 or 8), or 0 for LFR_BLOCKSIZE
+    uint16_t overprovision; // 1/overprovision extra columns, or 0 for LFR_OVERPROVISION
+    uint8_t shape; // LFR_SHAPE_FRAYED or LFR_SHAPE_XOR
+    uint8_t engine; // LFR_ENGINE_FRAYED, or LFR_ENGINE_FUSE for which blocks are segments, and blocksize is their log2 length
+    size_t nstash; // number of relations in the stash
+    const uint8_t *stash; // relations stored exactly, after the vector in data
+    const size_t *stash_index; // hash table of the stash records, always allocated here if there's a stash
 } lfr_uniform_map_s, lfr_uniform_map_t[1];
 
 /** High-level build function: using the builder, compile to a map object.
@@ -62,14 +72,252 @@ int lfr_uniform_build(lfr_uniform_map_t map, const lfr_builder_t builder, int va
  * can set the number of threads.  Set to 0 for default.  If the library was not
  * built with thread support (by default it is not), then this call ignores
  * nthreads and always uses 1 thread.
+ *
+ * If builder->parallel_tries > 1, then that many salts are tried at once, each
+ * with its share of the threads.  When one succeeds, the attempts with later
+ * salts are cancelled, but earlier ones are allowed to finish, so the result
+ * is the same map as trying the salts one at a time.  Since a single solve
+ * can't keep many cores busy, this mostly reduces the tail latency of builds
+ * that need several tries.
+ *
+ * If builder->max_stash is set, then a salt for which a few relations are
+ * linearly dependent on the rest isn't thrown away.  Instead, up to max_stash
+ * of those relations are stored exactly in a small table (the "stash") beside
+ * the map, and the rest are solved as usual.  This makes most builds succeed
+ * on the first try, at the cost of one size_t per relation while building,
+ * and when querying, of a probe into a small hash table of the stashed keys.
+ * Maps without a stash query and serialize exactly as before.
+ *
+ * If builder->memory_limit is set, then the number of threads is reduced until
+ * the estimated peak memory fits under it.  The estimate is as in
+ * lfr_build_estimate_memory, but accounts for the builder's blocksize,
+ * overprovision, precondition and max_stash.  Before reducing the threads,
+ * the build stops bucketing the relations by block, which is faster but
+ * holds a hash of every relation at once.  If it doesn't fit even with one
+ * thread, this returns ENOMEM without trying.  It never shards by itself:
+ * the caller must split the relations into smaller maps, e.g. with
+ * lfr_sharded_build, which applies the memory limit to its shards.
+ *
+ * If builder->engine is LFR_ENGINE_FUSE, then the map is a binary fuse map
+ * instead (see lfr_fuse.h), which is built on one thread, without a stash,
+ * and ignoring parallel_tries, blocksize, overprovision, shape and
+ * precondition.  The wide and multi builds and lfr_uniform_factor don't
+ * support it, and return EINVAL.
  */
 int lfr_uniform_build_threaded(lfr_uniform_map_t map, const lfr_builder_t builder, int value_bits, int nthreads);
 
+/**
+ * Build a map whose values are wider than an lfr_response_t, up to
+ * LFR_MAX_VALUE_BITS bits.  Each block's columns are still stored together,
+ * so a query reads the same two blocks as for a narrow map, just more of each.
+ * Query it with lfr_uniform_query_wide.
+ *
+ * The threads, tries and memory_limit are as in lfr_uniform_build_threaded,
+ * but the builder's values and max_stash are ignored.
+ *
+ * @param map The map object.  On success, this function will initialize
+ * the map and allocate memory for it.
+ * @param builder The builder object.
+ * @param values The values, (value_bits+7)/8 bytes each, in the order of
+ * builder->relations.  Bit i of a value is bit i%8 of its byte i/8.
+ * @param value_bits The number of bits in each value.
+ * @param nthreads The number of threads, or 0 for default.
+ * @return 0 on success.
+ * @return EINVAL value_bits is more than LFR_MAX_VALUE_BITS.
+ * @return ENOMEM, EAGAIN as in lfr_uniform_build.
+ */
+int lfr_uniform_build_wide (
+    lfr_uniform_map_t map,
+    const lfr_builder_t builder,
+    const uint8_t *values,
+    int value_bits,
+    int nthreads
+);
+
+/**
+ * Build several maps over the builder's keys, with different values, in one
+ * solve.  All the maps' value columns are solved together as one map's, and
+ * the result is split, so the maps share a salt and block layout.  This is
+ * about as fast as building the widest of them alone.
+ *
+ * The threads, tries and memory_limit are as in lfr_uniform_build_threaded,
+ * but builder->max_stash is ignored.
+ *
+ * @param maps An array of nmaps map objects.  On success, this function will
+ * initialize them and allocate memory for them.
+ * @param nmaps The number of maps.
+ * @param builder The builder object.
+ * @param values For each map, its values, in the order of builder->relations;
+ * or NULL to use the builder's values.
+ * @param value_bits For each map, as in lfr_uniform_build.  The total must be
+ * at most 64.
+ * @param nthreads The number of threads, or 0 for default.
+ * @return 0 on success.
+ * @return EINVAL The maps have more than 64 value bits in total.
+ * @return ENOMEM, EAGAIN as in lfr_uniform_build.
+ */
+int lfr_uniform_build_multi (
+    lfr_uniform_map_s *maps,
+    unsigned nmaps,
+    const lfr_builder_t builder,
+    const lfr_response_t *const *values,
+    const int *value_bits,
+    int nthreads
+);
+
+/**
+ * A source of relations, for building a map without a builder.  Each call
+ * should store the next relation in *relation and return 0, or return ENOENT
+ * once there are no more.  A call with relation == NULL should rewind the
+ * source to the beginning and return 0.  Any other return value aborts the
+ * build, and is returned from it.
+ *
+ * The key pointed to by relation->key need only stay valid until the next
+ * call.  Every pass must produce the same relations in the same order, and
+ * they must not contain duplicate keys.  The source is only ever called by
+ * one thread at a time.
+ */
+typedef int (*lfr_relation_source_t)(void *ctx, lfr_relation_t *relation);
+
+/**
+ * Build a map by pulling relations from a source, instead of from a builder.
+ * The relations are never stored: the source is read once up front to
+ * count them, and then twice per attempt, once to set up and once to fill
+ * the matrices, so memory use is just that of the solver.  Tries up to
+ * LFR_DEFAULT_TRIES random salts.
+ *
+ * @param map The map object.  On success, this function will initialize
+ * the map and allocate memory for it.
+ * @param source The source callback.
+ * @param ctx Context passed to the source callback.
+ * @param nitems Upper bound on the number of relations in the source.
+ * The map is sized from the number the source actually produces, so this
+ * need not be exact.
+ * @param value_bits As in lfr_uniform_build.
+ * @return 0 on success.
+ * @return ENOMEM Not enough memory to solve / return the map.
+ * @return EAGAIN The solution failed; either it has inconsistent values
+ * or should be tried again with a different salt.
+ * @return EINVAL if the source produced more than nitems relations, or
+ * different relations on different passes.
+ * @return Any error returned by the source.
+ */
+int lfr_uniform_build_from_source (
+    lfr_uniform_map_t map,
+    lfr_relation_source_t source,
+    void *ctx,
+    size_t nitems,
+    int value_bits
+);
+
+/** As lfr_uniform_build_from_source, with the thread count as in lfr_uniform_build_threaded. */
+int lfr_uniform_build_from_source_threaded (
+    lfr_uniform_map_t map,
+    lfr_relation_source_t source,
+    void *ctx,
+    size_t nitems,
+    int value_bits,
+    int nthreads
+);
+
+/**
+ * Estimate the peak memory, in bytes, that building a map will allocate: the
+ * solver's matrices and bookkeeping, plus the output map, with the default
+ * blocksize and overprovision and without preconditioning or a stash.  This
+ * doesn't include the builder itself.  This is a curve fitted to measured
+ * builds of 3 thousand to 1 million relations, not a guaranteed bound;
+ * outside that range, leave some headroom.
+ *
+ * @param nrelations The number of relations.
+ * @param value_bits The number of value bits, or -1 if not known (assumes 64).
+ * @param nthreads The number of threads, or 0 for default.
+ */
+size_t lfr_build_estimate_memory(size_t nrelations, int value_bits, int nthreads);
+
+/**
+ * As lfr_build_estimate_memory, but for a builder with the given blocksize
+ * and overprovision (or 0 for the defaults), precondition, whether it has a
+ * max_stash, and whether the build buckets its relations by block before
+ * filling the matrices.  lfr_build_estimate_memory is the case where they're
+ * all 0 except bucketing.
+ */
+size_t _lfr_uniform_estimate_memory (
+    size_t nrelations,
+    int value_bits,
+    int nthreads,
+    int blocksize,
+    int overprovision,
+    int precondition,
+    int stashing,
+    int bucketing
+);
+
 /** Destroy a map object, and deallocate any memory used to create it. */
 void lfr_uniform_map_destroy(lfr_uniform_map_t map);
 
+/**
+ * A factorization of a builder's keys: everything from the forward pass of
+ * a successful solve which doesn't depend on the values.  It can rebuild the
+ * map for new values without hashing the keys or eliminating again.
+ */
+typedef struct {
+    size_t blocks;
+    lfr_salt_t salt;
+    uint8_t _salt_hint; // used when the salt is derived
+    uint8_t blocksize; // as in lfr_uniform_map_s
+    uint16_t overprovision; // as in lfr_uniform_map_s
+    uint8_t shape; // as in lfr_uniform_map_s
+    size_t nrelns; // the number of relations, and of values to resolve
+    struct lfr_uniform_factor_state_s *state; // private to lfr_uniform.c
+} lfr_uniform_factor_s, lfr_uniform_factor_t[1];
+
+/**
+ * Factor a builder's relations, trying salts as in lfr_uniform_build.
+ * Their values are ignored, as are the builder's max_stash, parallel_tries
+ * and memory_limit.  The factorization keeps about twice the peak memory
+ * of a build until it is destroyed.
+ *
+ * @param factor The factorization.  On success, this function will initialize
+ * it and allocate memory for it.
+ * @param builder The builder object.
+ * @param nthreads The number of threads, or 0 for default.
+ * @return 0 on success.
+ * @return ENOMEM Not enough memory.
+ * @return EAGAIN Every salt failed.
+ */
+int lfr_uniform_factor(lfr_uniform_factor_t factor, const lfr_builder_t builder, int nthreads);
+
+/**
+ * Build a map from a factorization and new values for its relations.  This
+ * redoes only the arithmetic on the values: each merge's values are multiplied
+ * by matrices saved in the factorization, and then the backward pass runs as
+ * usual.  It uses one thread, and the factorization may be used by several
+ * calls at once.
+ *
+ * @param map The map object.  On success, this function will initialize
+ * the map and allocate memory for it.
+ * @param factor The factorization.
+ * @param values The new values, in the order of the builder's relations
+ * when it was factored.  There must be factor->nrelns of them.
+ * @param value_bits As in lfr_uniform_build.
+ * @return 0 on success.
+ * @return ENOMEM Not enough memory.
+ * @return EINVAL value_bits is too big.
+ */
+int lfr_uniform_resolve_values (
+    lfr_uniform_map_t map,
+    const lfr_uniform_factor_t factor,
+    const lfr_response_t *values,
+    int value_bits
+);
+
+/** Destroy a factorization, and deallocate its memory. */
+void lfr_uniform_factor_destroy(lfr_uniform_factor_t factor);
+
 /** Query a uniform map.  If the key was used when building
- * the map, then the same value will be returned.
+ * the map, then the same value will be returned.  If the map has
+ * a stash, it is checked first.  For a map with more than 64 value
+ * bits, this returns the low 64 bits of lfr_uniform_query_wide.
  */
 lfr_response_t lfr_uniform_query (
     const lfr_uniform_map_t map,
@@ -77,6 +325,16 @@ lfr_response_t lfr_uniform_query (
     size_t keybytes
 );
 
+/** Query a uniform map of any width, and write the value to out as
+ * (map->value_bits+7)/8 bytes, in the layout of lfr_uniform_build_wide.
+ */
+void lfr_uniform_query_wide (
+    uint8_t *out,
+    const lfr_uniform_map_t map,
+    const uint8_t *key,
+    size_t keybytes
+);
+
 /*****************************************************************
  *                         Serialization                         *
  *****************************************************************/
@@ -103,7 +361,7 @@ int lfr_uniform_map_deserialize(
     uint8_t flags
 );
 
-/** Mirror of LFR_BLOCKSIZE */
+/** Mirror of LFR_BLOCKSIZE, the block size of maps whose builder doesn't choose one */
 extern const int _lfr_blocksize;
 
 
@@ -115,12 +373,14 @@ extern const int _lfr_blocksize;
 size_t _lfr_uniform_map_vector_size(const lfr_uniform_map_t map);
 
 /**
- * Return the number of columns required for the given number of rows.
- * It will always be a multiple of 8*LFR_BLOCKSIZE.  Useful for sizing
+ * Return the number of columns required for the given number of rows,
+ * with blocks of blocksize bytes (or 0 for LFR_BLOCKSIZE) and the given
+ * overprovision (or 0 for LFR_OVERPROVISION).
+ * It will always be a multiple of 8*blocksize.  Useful for sizing
  * the map.  The number of bytes required for the map's data will be
  * (columns * value_bits) / 8.
  */
-size_t _lfr_uniform_provision_columns(size_t rows);
+size_t _lfr_uniform_provision_columns(size_t rows, int blocksize, int overprovision);
 
 /**
  * For testing purposes.  Return the maximum number of rows such that
@@ -130,7 +390,7 @@ size_t _lfr_uniform_provision_columns(size_t rows);
  * efficiency but the worst-case scenario in terms of failure probability
  * and thus speed.
  */
-size_t _lfr_uniform_provision_max_rows(size_t cols);
+size_t _lfr_uniform_provision_max_rows(size_t cols, int blocksize, int overprovision);
 
 #ifdef __cplusplus
 } // extern "C"
@@ -144,6 +404,32 @@ namespace LibFrayed {
         virtual const char* what() const _NOEXCEPT { return ("LibFrayed map build failed"); }
     };
 
+    /** Wrapper for factorizations */
+    class UniformFactor {
+    public:
+        /** Wrapped factorization */
+        lfr_uniform_factor_t factor;
+
+        /** Factor a builder's relations */
+        inline UniformFactor(const LibFrayed::Builder &builder, int nthreads=0) {
+            int ret = lfr_uniform_factor(factor,builder.builder,nthreads);
+            if (ret == ENOMEM) {
+                throw std::bad_alloc();
+            } else if (ret == EAGAIN) {
+                throw BuildFailedException();
+            } else if (ret == EINVAL) {
+                throw std::invalid_argument("LibFrayed::UniformFactor: the builder's engine or options can't be factored");
+            } else if (ret) {
+                throw std::runtime_error("LibFrayed::UniformFactor: factoring failed");
+            }
+        }
+
+        UniformFactor(const UniformFactor &other) = delete;
+
+        /** Destructor */
+        inline ~UniformFactor() { lfr_uniform_factor_destroy(factor); }
+    };
+
     /** Wrapper for map */
     class UniformMap {
     public:
@@ -191,6 +477,31 @@ namespace LibFrayed {
             }
         }
 
+        /** Construct from a factorization and new values */
+        inline UniformMap(const LibFrayed::UniformFactor &factor, const std::vector<lfr_response_t> &values, int value_bits) {
+            if (values.size() != factor.factor->nrelns) {
+                throw std::invalid_argument("LibFrayed::UniformMap: wrong number of values");
+            }
+            int ret = lfr_uniform_resolve_values(map,factor.factor,values.data(),value_bits);
+            if (ret == ENOMEM) {
+                throw std::bad_alloc();
+            } else if (ret) {
+                throw std::runtime_error("LibFrayed::UniformMap: resolving values failed");
+            }
+        }
+
+        /** Construct from a relation source */
+        inline UniformMap(lfr_relation_source_t source, void *ctx, size_t nitems, int value_bits, int nthreads=0) {
+            int ret = lfr_uniform_build_from_source_threaded(map,source,ctx,nitems,value_bits,nthreads);
+            if (ret == ENOMEM) {
+                throw std::bad_alloc();
+            } else if (ret == EAGAIN) {
+                throw BuildFailedException();
+            } else if (ret) {
+                throw std::runtime_error("LibFrayed::UniformMap: relation source failed");
+            }
+        }
+
         /** Destructor */
         inline ~UniformMap() { lfr_uniform_map_destroy(map); }
 
@@ -209,6 +520,13 @@ namespace LibFrayed {
             return lookup(v);
         }
 
+        /** Lookup in a map of any width */
+        inline std::vector<uint8_t> lookup_wide(const std::vector<uint8_t> &v) const {
+            std::vector<uint8_t> ret((map->value_bits+7)/8);
+            lfr_uniform_query_wide(ret.data(),map,v.data(),v.size());
+            return ret;
+        }
+
         /** Get serial size */
         inline size_t serial_size() const { return lfr_uniform_map_serial_size(map); }
         
@@ -205,7 +205,41 @@ static __attribute__((noinline)) void tile_matrix_rowtimes(tile_t *c, tile_t a,
     }
 }
 
+/* Perform c += a[0:ntiles-1] * (column of b[0:ntiles-1], stride_b apart).
+ * When the product is only one tile wide, this beats one rowop per tile,
+ * which has to precompute a multiplication table to use it only once.
+ */
+static void tile_matrix_dotop(tile_t *c, const tile_t *a, const tile_t *b, size_t stride_b, size_t ntiles) {
+    const size_t TVL = TILE_VECTOR_LENGTH;
+    tile_t column[TILE_VECTOR_LENGTH];
+    tile_vector_t acc = tile_vzero();
+
+    for (; ntiles >= TVL; ntiles -= TVL, a += TVL, b += TVL*stride_b) {
+        for (size_t k=0; k<TVL; k++) column[k] = b[k*stride_b];
+        acc ^= tile_vmul_lanes(tile_read_v(a), tile_read_v(column));
+    }
+    if (ntiles > 0) {
+        for (size_t k=0; k<ntiles; k++) column[k] = b[k*stride_b];
+        acc ^= tile_vmul_lanes(tile_read_vpartial(a, ntiles), tile_read_vpartial(column, ntiles));
+    }
+    *c ^= tile_vsum(acc);
+}
+
+/** Has another thread asked us to stop? */
+static inline int tile_matrix_cancelled(const int *cancel) {
+    return cancel != NULL && __atomic_load_n(cancel, __ATOMIC_RELAXED);
+}
+
 void tile_matrix_multiply_accumulate(tile_matrix_t *out, const tile_matrix_t *a, const tile_matrix_t *b) {
+    tile_matrix_multiply_accumulate_cancellable(out,a,b,NULL);
+}
+
+int tile_matrix_multiply_accumulate_cancellable (
+    tile_matrix_t *out,
+    const tile_matrix_t *a,
+    const tile_matrix_t *b,
+    const int *cancel
+) {
     assert(a->cols == b->rows);
     assert(b->cols == out->cols);
     assert(a->rows == out->rows);
@@ -220,14 +254,165 @@ void tile_matrix_multiply_accumulate(tile_matrix_t *out, const tile_matrix_t *a,
     size_t t_auglen = TILES_SPANNING(a->aug_cols);
 
     for (size_t i=0; i<trows; i++) {
-        for (size_t j=0; j<tmatch; j++) {
-            tile_t aij = a->data[i*tstride_a+j];
-            tile_matrix_rowop(&out->data[i*tstride_c], aij, &b->data[j*tstride_b], oplen);
+        if (tile_matrix_cancelled(cancel)) return ECANCELED;
+        if (oplen == 1) {
+            tile_matrix_dotop(&out->data[i*tstride_c], &a->data[i*tstride_a], b->data, tstride_b, tmatch);
+        } else {
+            for (size_t j=0; j<tmatch; j++) {
+                tile_t aij = a->data[i*tstride_a+j];
+                tile_matrix_rowop(&out->data[i*tstride_c], aij, &b->data[j*tstride_b], oplen);
+            }
         }
         for (size_t j=0; j<t_auglen; j++) {
             out->data[i*tstride_c+augoff_out+j] ^= a->data[i*tstride_a+augoff_a+j];
         }
     }
+    return 0;
+}
+
+/** Where one tile-column of a source matrix goes when it is compacted:
+ * the columns in `select` are packed into the destination starting at
+ * column col_dst of tile tile_dst, and run over into the next tile if spill.
+ */
+typedef struct {
+    size_t tile_dst;
+    uint8_t select, col_dst, spill;
+} tile_compaction_t;
+
+/** Most merges are small enough to plan on the stack, without a malloc per call */
+#define TILE_COMPACTION_STACK_TCOLS 64
+
+/**
+ * Plan to compact the columns col < ncols which have select[col+offset] == set,
+ * to the destination columns starting at col_dst.  The plan has one entry
+ * for each of the TILES_SPANNING(ncols) source tile-columns.
+ * @return the number of columns selected.
+ */
+static size_t tile_compaction_plan (
+    tile_compaction_t *plan,
+    size_t ncols,
+    const bitset_t select,
+    size_t offset,
+    int set,
+    size_t col_dst
+) {
+    size_t total = 0;
+    for (size_t tcol=0; tcol<TILES_SPANNING(ncols); tcol++) {
+        uint8_t sel = bitset_get_8_bits(select, tcol*TILE_SIZE+offset);
+        if (!set) sel = ~sel;
+        if (ncols - tcol*TILE_SIZE < TILE_SIZE) sel &= (1 << (ncols - tcol*TILE_SIZE)) - 1;
+        size_t col = col_dst + total, n = popcount(sel);
+        plan[tcol].tile_dst = col / TILE_SIZE;
+        plan[tcol].select = sel;
+        plan[tcol].col_dst = col % TILE_SIZE;
+        plan[tcol].spill = col%TILE_SIZE + n > TILE_SIZE;
+        total += n;
+    }
+    return total;
+}
+
+/** Compact one source tile into a destination tile-row, as planned. */
+static inline void tile_compact_xor(tile_t *row_dst, tile_t src, const tile_compaction_t *c) {
+    if (c->select == 0) return;
+    tile_t t = tile_compact_cols(src, c->select);
+    row_dst[c->tile_dst] ^= t << (8*c->col_dst);
+    if (c->spill) row_dst[c->tile_dst+1] ^= t >> (8*(TILE_SIZE-c->col_dst));
+}
+
+int tile_matrix_compact_cols (
+    tile_matrix_t *b,
+    const tile_matrix_t *a,
+    const bitset_t select,
+    size_t offset,
+    int set,
+    size_t colb
+) {
+    assert(TILES_SPANNING(a->rows) <= TILES_SPANNING(b->rows));
+    size_t tcols = TILES_SPANNING(a->cols);
+    tile_compaction_t plan_stack[TILE_COMPACTION_STACK_TCOLS], *plan = plan_stack;
+    if (tcols > TILE_COMPACTION_STACK_TCOLS) {
+        plan = malloc(tcols * sizeof(*plan));
+        if (plan == NULL) return ENOMEM;
+    }
+    size_t ncols = tile_compaction_plan(plan, a->cols, select, offset, set, colb);
+    assert(colb + ncols <= b->cols);
+    (void)ncols;
+
+    for (size_t trow=0; trow<TILES_SPANNING(a->rows); trow++) {
+        const tile_t *ra = &a->data[trow*a->stride];
+        tile_t *rb = &b->data[trow*b->stride];
+        for (size_t tcol=0; tcol<tcols; tcol++) tile_compact_xor(rb, ra[tcol], &plan[tcol]);
+    }
+
+    if (plan != plan_stack) free(plan);
+    return 0;
+}
+
+int tile_matrix_project_columns_cancellable (
+    tile_matrix_t *out,
+    const tile_matrix_t *a,
+    const bitset_t column_is_in_echelon,
+    size_t ech_offset,
+    size_t col_out,
+    const tile_matrix_t *b,
+    const int *cancel
+) {
+    assert(a->rows <= out->rows);
+    assert(b->cols == out->cols);
+    assert(b->aug_cols <= out->aug_cols);
+    assert(a->aug_cols <= out->aug_cols);
+
+    size_t tech = TILES_SPANNING(b->rows), tcols = TILES_SPANNING(a->cols);
+    tile_compaction_t plan_stack[2*TILE_COMPACTION_STACK_TCOLS], *plan = plan_stack;
+    tile_t row_ech_stack[TILE_COMPACTION_STACK_TCOLS], *row_ech = row_ech_stack;
+    if (tcols > TILE_COMPACTION_STACK_TCOLS || tech > TILE_COMPACTION_STACK_TCOLS) {
+        // One allocation for both; tile_compaction_t is at least as aligned as tile_t
+        plan = malloc(2*tcols*sizeof(*plan) + tech*sizeof(*row_ech));
+        if (plan == NULL) return ENOMEM;
+        row_ech = (tile_t *)&plan[2*tcols];
+    }
+
+    /* Plan both halves of the split once, for every tile-row */
+    tile_compaction_t *plan_ech = plan, *plan_non = &plan[tcols];
+    size_t n_ech = tile_compaction_plan(plan_ech, a->cols, column_is_in_echelon, ech_offset, 1, 0);
+    size_t n_non = tile_compaction_plan(plan_non, a->cols, column_is_in_echelon, ech_offset, 0, col_out);
+    assert(n_ech == b->rows);
+    assert(col_out + n_non <= out->cols);
+    (void)n_ech; (void)n_non;
+
+    size_t trows = TILES_SPANNING(a->rows), tstride_a = a->stride, tstride_c = out->stride;
+    size_t tstride_b = b->stride, oplen = TILES_SPANNING(b->cols) + TILES_SPANNING(b->aug_cols);
+    size_t augoff_out = TILES_SPANNING(out->cols), augoff_a = TILES_SPANNING(a->cols);
+    size_t t_auglen = TILES_SPANNING(a->aug_cols);
+    int ret = 0;
+
+    for (size_t i=0; i<trows; i++) {
+        if (tile_matrix_cancelled(cancel)) { ret = ECANCELED; break; }
+        const tile_t *ra = &a->data[i*tstride_a];
+        tile_t *rc = &out->data[i*tstride_c];
+
+        // Split this tile-row's columns between out and row_ech
+        memset(row_ech, 0, tech*sizeof(*row_ech));
+        for (size_t j=0; j<tcols; j++) {
+            tile_compact_xor(row_ech, ra[j], &plan_ech[j]);
+            tile_compact_xor(rc, ra[j], &plan_non[j]);
+        }
+
+        // Multiply the echelon part by b
+        if (oplen == 1) {
+            tile_matrix_dotop(rc, row_ech, b->data, tstride_b, tech);
+        } else {
+            for (size_t j=0; j<tech; j++) {
+                tile_matrix_rowop(rc, row_ech[j], &b->data[j*tstride_b], oplen);
+            }
+        }
+        for (size_t j=0; j<t_auglen; j++) {
+            rc[augoff_out+j] ^= ra[augoff_a+j];
+        }
+    }
+
+    if (plan != plan_stack) free(plan);
+    return ret;
 }
 
 /** Swap a[r1:r1+nrows-1] with a[r2:r2+nrows-1]
@@ -263,20 +448,6 @@ static void tile_matrix_swap_rows(tile_matrix_t *a, size_t r1, size_t r2, size_t
     }
 }
 
-static void tile_matrix_copy_column(tile_matrix_t *b, const tile_matrix_t *a, size_t colb, size_t cola) {
-    /* Copy a[cola] to b[colb] */
-    size_t astride = a->stride, bstride = b->stride;
-    size_t trows = TILES_SPANNING(a->rows), tcola=cola/TILE_SIZE, tcolb=colb/TILE_SIZE;
-    assert(trows == TILES_SPANNING(b->rows));
-    for (size_t trow=0; trow<trows; trow++) {
-        b->data[bstride*trow + tcolb] = tile_copy_col(
-            b->data[bstride*trow + tcolb],
-            a->data[astride*trow + tcola],
-            colb % TILE_SIZE, cola % TILE_SIZE
-        );
-    }
-}
-
 static void tile_matrix_copy_one_rowgroup (
     tile_matrix_t *b, const tile_matrix_t *a, size_t rowb, size_t rowa, size_t nrows
 ) {
@@ -382,6 +553,67 @@ void tile_matrix_xor_row(tile_matrix_t *b, const tile_matrix_t *a, size_t rowb,
     }
 }
 
+void tile_matrix_xor_row_offset(tile_matrix_t *b, const tile_matrix_t *a, size_t rowb, size_t rowa, size_t colb) {
+    /* Xor a[rowa] into b[rowb] starting at column colb, one source tile at a time.
+     * Each source tile's row lands in at most two destination tiles.
+     */
+    assert(colb + a->cols <= b->cols);
+    assert(a->aug_cols == b->aug_cols || a->aug_cols == 0);
+    size_t tcols = TILES_SPANNING(a->cols), taug = TILES_SPANNING(a->aug_cols);
+    size_t tcolsb = TILES_SPANNING(b->cols);
+    const tile_t *ra = &a->data[a->stride*(rowa/TILE_SIZE)];
+    tile_t *rb = &b->data[b->stride*(rowb/TILE_SIZE)];
+    int suba = rowa % TILE_SIZE, subb = rowb % TILE_SIZE, shift = colb % TILE_SIZE;
+    tile_t last_col_mask = (a->cols % TILE_SIZE) ? tile_mask_of_cols_less_than(a->cols % TILE_SIZE) : tile_full();
+
+    for (size_t tcol=0; tcol<tcols; tcol++) {
+        tile_t t = ra[tcol];
+        if (tcol == tcols-1) t &= last_col_mask;
+        t = ((t >> suba) & tile_row_mask(0)) << subb; // just the one row, moved to rowb
+        size_t tcolb = colb/TILE_SIZE + tcol;
+        rb[tcolb] ^= t << (8*shift);
+        if (shift && tcolb+1 < tcolsb) rb[tcolb+1] ^= t >> (8*(TILE_SIZE-shift));
+    }
+    for (size_t i=0; i<taug; i++) {
+        rb[tcolsb+i] = tile_bulk_xor_rows(rb[tcolsb+i], ra[tcols+i], subb, suba, 1);
+    }
+}
+
+size_t tile_matrix_expand_rows (
+    tile_matrix_t *b,
+    const tile_matrix_t *a,
+    size_t rowa,
+    const bitset_t select,
+    size_t offset,
+    int set
+) {
+    /* Fill b one tile-row at a time: take the next n rows of a as a window,
+     * which straddles at most two of a's tiles, and spread them out to the
+     * selected rows.
+     */
+    size_t tcols = TILES_SPANNING(b->cols) + TILES_SPANNING(b->aug_cols);
+    assert(tcols <= a->stride);
+    for (size_t trow=0; trow<TILES_SPANNING(b->rows); trow++) {
+        uint8_t sel = bitset_get_8_bits(select, trow*TILE_SIZE+offset);
+        if (!set) sel = ~sel;
+        if (b->rows - trow*TILE_SIZE < TILE_SIZE) sel &= (1 << (b->rows - trow*TILE_SIZE)) - 1;
+        int n = popcount(sel);
+        if (n == 0) continue;
+        assert(rowa + n <= a->rows);
+
+        int sub = rowa % TILE_SIZE;
+        const tile_t *ra = &a->data[a->stride*(rowa/TILE_SIZE)];
+        tile_t *rb = &b->data[b->stride*trow];
+        tile_t lo = tile_row_bulk_mask(0, TILE_SIZE-sub);
+        for (size_t tcol=0; tcol<tcols; tcol++) {
+            tile_t window = (ra[tcol] >> sub) & lo;
+            if (sub + n > TILE_SIZE) window |= (ra[a->stride+tcol] << (TILE_SIZE-sub)) &~ lo;
+            rb[tcol] ^= tile_expand_rows(window, sel);
+        }
+        rowa += n;
+    }
+    return rowa;
+}
 
 static void tile_matrix_copy_one_colgroup (
     tile_matrix_t *b, const tile_matrix_t *a, size_t colb, size_t cola, size_t ncols
@@ -463,6 +695,36 @@ void tile_matrix_xor_augdata(tile_matrix_t *a, const tile_matrix_t *b) {
     }
 }
 
+void tile_matrix_xor_aug_identity(tile_matrix_t *a) {
+    assert(a->aug_cols == a->rows);
+    size_t tcols = TILES_SPANNING(a->cols), trows = TILES_SPANNING(a->rows);
+    for (size_t trow=0; trow<trows; trow++) {
+        tile_t id = tile_identity();
+        if (trow == trows-1 && a->rows % TILE_SIZE) id &= tile_mask_of_rows_less_than(a->rows % TILE_SIZE);
+        a->data[a->stride*trow + tcols + trow] ^= id;
+    }
+}
+
+int tile_matrix_split_aug(tile_matrix_t *aug, tile_matrix_t *a) {
+    tile_matrix_t rest;
+    int ret = tile_matrix_init(aug, a->rows, a->aug_cols, 0);
+    if (ret) return ret;
+    ret = tile_matrix_init(&rest, a->rows, a->cols, 0);
+    if (ret) {
+        tile_matrix_destroy(aug);
+        return ret;
+    }
+
+    size_t tcols = TILES_SPANNING(a->cols), taug = TILES_SPANNING(a->aug_cols);
+    for (size_t trow=0; trow<TILES_SPANNING(a->rows); trow++) {
+        if (tcols) memcpy(&rest.data[rest.stride*trow], &a->data[a->stride*trow], tcols*sizeof(tile_t));
+        if (taug) memcpy(&aug->data[aug->stride*trow], &a->data[a->stride*trow+tcols], taug*sizeof(tile_t));
+    }
+    tile_matrix_destroy(a);
+    *a = rest;
+    return 0;
+}
+
 void tile_matrix_set_row(tile_matrix_t *a, size_t row, const uint8_t *data, const uint8_t *augdata) {
     assert(TILE_SIZE%8 == 0);
     const size_t TILE_BYTES = TILE_SIZE/8;
@@ -485,11 +747,40 @@ void tile_matrix_set_row(tile_matrix_t *a, size_t row, const uint8_t *data, cons
     tile_edge_t last_aug_mask = (a->aug_cols % TILE_SIZE) ? ((tile_edge_t)1<<(a->aug_cols%TILE_SIZE)) - 1 : tile_edge_full();
     for (size_t i=0; i<taug; i++) {
         tile_edge_t thisdata = (augdata==NULL) ? tile_edge_zero() : le2ui(&augdata[i*TILE_BYTES], TILE_BYTES);
-        if (i==tcols-1) thisdata &= last_aug_mask;
+        if (i==taug-1) thisdata &= last_aug_mask;
         r[i+tcols] = tile_set_row(r[i+tcols], subrow, thisdata);
     }
 }
 
+void tile_matrix_stage_row(tile_matrix_t *a, size_t row, const uint8_t *data, const uint8_t *augdata) {
+    /* A staged tile holds row r of its block as byte r, which is the
+     * transpose of its final layout.  So each row is stored by oring one byte
+     * into each tile, and the whole tile-row is transposed once it's full.
+     */
+    assert(TILE_SIZE == 8);
+    tile_t *r = &a->data[a->stride*(row/TILE_SIZE)];
+    size_t tcols = TILES_SPANNING(a->cols), taug = TILES_SPANNING(a->aug_cols);
+    int subrow = row % TILE_SIZE;
+
+    tile_edge_t last_col_mask = (a->cols % TILE_SIZE) ? ((tile_edge_t)1<<(a->cols%TILE_SIZE)) - 1 : tile_edge_full();
+    for (size_t i=0; i<tcols; i++) {
+        tile_edge_t thisdata = (data==NULL) ? tile_edge_zero() : data[i];
+        if (i==tcols-1) thisdata &= last_col_mask;
+        r[i] |= (tile_t)thisdata << (8*subrow);
+    }
+
+    tile_edge_t last_aug_mask = (a->aug_cols % TILE_SIZE) ? ((tile_edge_t)1<<(a->aug_cols%TILE_SIZE)) - 1 : tile_edge_full();
+    for (size_t i=0; i<taug; i++) {
+        tile_edge_t thisdata = (augdata==NULL) ? tile_edge_zero() : augdata[i];
+        if (i==taug-1) thisdata &= last_aug_mask;
+        r[i+tcols] |= (tile_t)thisdata << (8*subrow);
+    }
+
+    if (subrow == TILE_SIZE-1 || row == a->rows-1) {
+        for (size_t i=0; i<tcols+taug; i++) r[i] = tile_transpose(r[i]);
+    }
+}
+
 /*****************************************************
  * High-level matrix operations
  *****************************************************/
@@ -527,6 +818,10 @@ void tile_matrix_print(const char *name, const tile_matrix_t *matrix, int for_sa
 }
 
 size_t tile_matrix_rref(tile_matrix_t *a, bitset_t column_is_in_echelon) {
+    return tile_matrix_rref_cancellable(a, column_is_in_echelon, NULL);
+}
+
+size_t tile_matrix_rref_cancellable(tile_matrix_t *a, bitset_t column_is_in_echelon, const int *cancel) {
     size_t rows = a->rows, cols = a->cols;
     size_t trows = TILES_SPANNING(rows), tcols = TILES_SPANNING(cols), tstride = a->stride;
     size_t ttotal = tcols + TILES_SPANNING(a->aug_cols);
@@ -538,6 +833,8 @@ size_t tile_matrix_rref(tile_matrix_t *a, bitset_t column_is_in_echelon) {
 
     /* Put the tile-columns into echelon form, one after another */
     for (size_t tcol=0; tcol<tcols; tcol++) {
+        if (tile_matrix_cancelled(cancel)) break;
+
         /* Which columns have we echelonized in this loop? */
         tile_edge_t ech = tile_edge_zero();
         tile_t perm_matrix_cumulative = tile_zero();
@@ -571,6 +868,7 @@ size_t tile_matrix_rref(tile_matrix_t *a, bitset_t column_is_in_echelon) {
             tile_t *working = &a->data[trow*tstride+tcol];
 
             /* If it's not the first, apply our progress so far */
+            if (tile_matrix_cancelled(cancel)) return rank;
             if (trow != trow_begin) {
                 tile_t factor = tile_mul(*working, perm_matrix_cumulative);
                 tile_matrix_rowop(working, factor, active, active_length);
@@ -611,6 +909,7 @@ size_t tile_matrix_rref(tile_matrix_t *a, bitset_t column_is_in_echelon) {
         /* OK, we now have a tile which echelonizes all the selected columns.  Eliminate them. */
         for (ssize_t trow=0; trow<(ssize_t)trows; trow++) {
             if (trow==trow_begin) continue;
+            if (tile_matrix_cancelled(cancel)) return rank;
             tile_t factor = tile_mul(a->data[trow*tstride+tcol], perm_matrix_cumulative);
             tile_matrix_rowop(&a->data[trow*tstride+tcol], factor, active, active_length);
         }
@@ -642,6 +941,10 @@ size_t tile_matrix_rref(tile_matrix_t *a, bitset_t column_is_in_echelon) {
 }
 
 int tile_matrix_systematic_form(tile_matrix_systematic_t *sys, tile_matrix_t *a) {
+    return tile_matrix_systematic_form_cancellable(sys, a, NULL);
+}
+
+int tile_matrix_systematic_form_cancellable(tile_matrix_systematic_t *sys, tile_matrix_t *a, const int *cancel) {
     /* Allocate the column bitset */
     sys->column_is_in_echelon = bitset_init(a->cols);
     if (!sys->column_is_in_echelon) {
@@ -649,7 +952,12 @@ int tile_matrix_systematic_form(tile_matrix_systematic_t *sys, tile_matrix_t *a)
         return ENOMEM;
     }
 
-    size_t rank = tile_matrix_rref(a, sys->column_is_in_echelon);
+    size_t rank = tile_matrix_rref_cancellable(a, sys->column_is_in_echelon, cancel);
+    if (tile_matrix_cancelled(cancel)) {
+        bitset_destroy(sys->column_is_in_echelon);
+        memset(sys,0,sizeof(*sys));
+        return ECANCELED;
+    }
     if (rank < a->rows) {
         /* Not enough rank */
         bitset_destroy(sys->column_is_in_echelon);
@@ -665,12 +973,10 @@ int tile_matrix_systematic_form(tile_matrix_systematic_t *sys, tile_matrix_t *a)
     }
 
     /* Copy the non-echelon part of the columns */
-    for (size_t csrc=0,cdst=0; csrc<a->cols; csrc++) {
-        if (!bitset_test_bit(sys->column_is_in_echelon, csrc)) {
-            assert(cdst <= sys->rhs.cols);
-            tile_matrix_copy_column(&sys->rhs, a, cdst, csrc);
-            cdst++;
-        }
+    if (tile_matrix_compact_cols(&sys->rhs, a, sys->column_is_in_echelon, 0, 0, 0)) {
+        tile_matrix_systematic_destroy(sys);
+        memset(sys,0,sizeof(*sys));
+        return ENOMEM;
     }
 
     /* Copy the augmented component */
@@ -685,6 +991,57 @@ int tile_matrix_systematic_form(tile_matrix_systematic_t *sys, tile_matrix_t *a)
     return 0;
 }
 
+int tile_matrix_dependent_rows(
+    bitset_t dependent,
+    size_t *ndependent,
+    const tile_matrix_t *a,
+    const int *cancel
+) {
+    /* Echelonize ( a | I ).  The rows which don't get a pivot in a's columns
+     * are zero there, and their identity part is a basis for the dependencies
+     * among a's rows, itself in echelon form.  The pivot columns of that basis
+     * are rows that can each be written in terms of the others, so removing
+     * them leaves a's rows independent.
+     */
+    size_t rows = a->rows, tid = TILES_SPANNING(a->cols), trows = TILES_SPANNING(rows);
+    tile_matrix_t m[1];
+    *ndependent = 0;
+    int ret = tile_matrix_init(m, rows, tid*TILE_SIZE + rows, 0);
+    if (ret) return ret;
+    bitset_t ech = bitset_init(m->cols);
+    if (ech == NULL) {
+        tile_matrix_destroy(m);
+        return ENOMEM;
+    }
+
+    tile_matrix_copy_cols(m, a, 0, 0, a->cols);
+    for (size_t trow=0; trow<trows; trow++) {
+        tile_t id = tile_identity();
+        size_t left = rows - trow*TILE_SIZE;
+        if (left < TILE_SIZE) id &= (1ull << ((TILE_SIZE+1)*(left-1)+1)) - 1;
+        m->data[trow*m->stride + tid + trow] = id;
+    }
+
+    tile_matrix_rref_cancellable(m, ech, cancel);
+    if (tile_matrix_cancelled(cancel)) {
+        ret = ECANCELED;
+        goto done;
+    }
+
+    bitset_clear_all(dependent, rows);
+    for (size_t row=0; row<rows; row++) {
+        if (bitset_test_bit(ech, tid*TILE_SIZE + row)) {
+            bitset_set_bit(dependent, row);
+            (*ndependent)++;
+        }
+    }
+
+done:
+    bitset_destroy(ech);
+    tile_matrix_destroy(m);
+    return ret;
+}
+
 void tile_matrix_systematic_destroy(tile_matrix_systematic_t *sys) {
     bitset_destroy(sys->column_is_in_echelon);
     sys->column_is_in_echelon = NULL;
@@ -66,18 +66,102 @@ void tile_matrix_multiply_accumulate(
     const tile_matrix_t *b
 );
 
+/**
+ * As tile_matrix_multiply_accumulate, but give up partway through if another
+ * thread sets *cancel to nonzero.  Cancel may be NULL.
+ * @return 0 on success, or ECANCELED if cancelled, in which case out is garbage.
+ */
+int tile_matrix_multiply_accumulate_cancellable(
+    tile_matrix_t *out,
+    const tile_matrix_t *a,
+    const tile_matrix_t *b,
+    const int *cancel
+);
+
+/**
+ * Split a's columns and project them, in one pass over a.  The columns
+ * col with column_is_in_echelon[col+ech_offset] clear are xored, in order,
+ * into out[:, col_out +: ...].  The ones with it set are gathered, in order,
+ * into a row of b->rows columns, which is multiplied by b and accumulated
+ * into out.  The augmented columns of a are xored into out's.
+ *
+ * This is the same as copying the columns out with tile_matrix_copy_cols and
+ * then calling tile_matrix_multiply_accumulate, but doesn't store the
+ * echelon columns as a matrix.  Cancel may be NULL.
+ *
+ * @return 0 on success.
+ * @return ENOMEM if out of memory.
+ * @return ECANCELED if cancelled, in which case out is garbage.
+ */
+int tile_matrix_project_columns_cancellable(
+    tile_matrix_t *out,
+    const tile_matrix_t *a,
+    const bitset_t column_is_in_echelon,
+    size_t ech_offset,
+    size_t col_out,
+    const tile_matrix_t *b,
+    const int *cancel
+);
+
 /** Set a row of the matrix.  Data and/or augdata can be NULL to indicate zero. */
 void tile_matrix_set_row(tile_matrix_t *a, size_t row, const uint8_t *data, const uint8_t *augdata);
 
+/**
+ * As tile_matrix_set_row, but faster when filling a matrix in row order.
+ * The rows of each tile-row are held in a staging layout until its last row
+ * (row%TILE_SIZE == TILE_SIZE-1, or the last row of the matrix) is staged,
+ * and then are moved into place all at once.  So the tile-row must start
+ * out zero, every row of it must be staged exactly once, with its last row
+ * last, and it must not be otherwise used until it's finished.
+ */
+void tile_matrix_stage_row(tile_matrix_t *a, size_t row, const uint8_t *data, const uint8_t *augdata);
+
 /** Copy rows a[rowa +: nrows] to b[rowb +: nrows] */
 void tile_matrix_copy_rows(tile_matrix_t *a, const tile_matrix_t *b, size_t rowa, size_t rowb, size_t nrows);
 
 /** Xor row a[rowa] to b[rowb] */
 void tile_matrix_xor_row(tile_matrix_t *a, const tile_matrix_t *b, size_t rowa, size_t rowb);
 
+/**
+ * Xor a[rowa] into b[rowb], with a's columns going to b[colb +: a->cols].
+ * The augmented columns are xored into b's augmented columns, of which
+ * there must be the same number, unless a has none.
+ */
+void tile_matrix_xor_row_offset(tile_matrix_t *b, const tile_matrix_t *a, size_t rowb, size_t rowa, size_t colb);
+
+/**
+ * Xor the rows of a, in order starting at a[rowa], into the rows row of b
+ * which have select[row+offset] == set.  Eight rows of b are filled at a
+ * time.  The matrices must have the same shape of columns.
+ * @return the row of a after the last one used.
+ */
+size_t tile_matrix_expand_rows(
+    tile_matrix_t *b,
+    const tile_matrix_t *a,
+    size_t rowa,
+    const bitset_t select,
+    size_t offset,
+    int set
+);
+
 /** Copy cols a[cola +: ncols] to b[colb +: ncols] */
 void tile_matrix_copy_cols(tile_matrix_t *a, const tile_matrix_t *b, size_t cola, size_t colb, size_t ncols);
 
+/**
+ * Xor the columns col of a which have select[col+offset] == set, in order,
+ * into b[:, colb +: ...].  Each tile of a is compacted at once, rather than
+ * column by column.  The augmented columns are ignored.
+ * @return 0 on success, or ENOMEM if out of memory.
+ */
+int tile_matrix_compact_cols(
+    tile_matrix_t *b,
+    const tile_matrix_t *a,
+    const bitset_t select,
+    size_t offset,
+    int set,
+    size_t colb
+);
+
 /** Zeroize rows a[rowa +: nrows] */
 void tile_matrix_zeroize_rows(tile_matrix_t *a, size_t rowa, size_t nrows);
 
@@ -87,6 +171,16 @@ void tile_matrix_zeroize_cols(tile_matrix_t *a, size_t cola, size_t ncols);
 /** Xor in the augdata from b into a.  They must have the same sized augdata. */
 void tile_matrix_xor_augdata(tile_matrix_t *a, const tile_matrix_t *b);
 
+/** Xor the identity into a's augmented columns, of which there must be a->rows. */
+void tile_matrix_xor_aug_identity(tile_matrix_t *a);
+
+/**
+ * Move a's augmented columns into a new matrix aug, as its ordinary columns,
+ * and shrink a to its ordinary columns.
+ * @return 0 on success, or ENOMEM if out of memory, in which case a is unchanged.
+ */
+int tile_matrix_split_aug(tile_matrix_t *aug, tile_matrix_t *a);
+
 /** Resize the matrix by changing its number of rows (using realloc).
  * @return 0 on success, or ENOMEM if out of memory.
  */
@@ -113,12 +207,39 @@ void _tile_aligned_submatrix(tile_matrix_t *sub, const tile_matrix_t *a, size_t
  */
 size_t tile_matrix_rref(tile_matrix_t *a, bitset_t column_is_in_echelon);
 
+/**
+ * As tile_matrix_rref, but give up partway through if another thread sets
+ * *cancel to nonzero.  Cancel may be NULL.  If cancelled, then a is garbage
+ * and the return value is meaningless.
+ */
+size_t tile_matrix_rref_cancellable(tile_matrix_t *a, bitset_t column_is_in_echelon, const int *cancel);
+
 /**
  * Echelonize the matrix a, then initialize sys to be its systematic form.
  * @return 0 on success; -1 or ENOMEM on error.
  */
 int tile_matrix_systematic_form(tile_matrix_systematic_t *sys, tile_matrix_t *a);
 
+/**
+ * As tile_matrix_systematic_form, but cancellable as in tile_matrix_rref_cancellable.
+ * @return 0 on success; -1, ENOMEM or ECANCELED on error.
+ */
+int tile_matrix_systematic_form_cancellable(tile_matrix_systematic_t *sys, tile_matrix_t *a, const int *cancel);
+
+/**
+ * Find a set of rows of a whose removal leaves the rest linearly independent,
+ * considering only the non-augmented columns.  Mark them in dependent, which
+ * must have room for a->rows bits.  This is slow, so it's meant for recovering
+ * from a rank-deficient tile_matrix_systematic_form, not for testing rank.
+ * @return 0 on success; ENOMEM or ECANCELED on error.
+ */
+int tile_matrix_dependent_rows(
+    bitset_t dependent,
+    size_t *ndependent,
+    const tile_matrix_t *a,
+    const int *cancel
+);
+
 /** Destroy a systematic-form structure.  Frees the bitset and matrix but not sys itself. */
 void tile_matrix_systematic_destroy(tile_matrix_systematic_t *sys);
 
@@ -13,6 +13,9 @@
 
 #include <stdint.h>
 #include "util.h"
+#if __BMI2__ && !defined(TILE_NO_VECTOR)
+#include <immintrin.h>
+#endif
 
 #define TILE_SIZE 8
 typedef uint64_t tile_t; /** 8x8 matrix tile */
@@ -171,6 +174,42 @@ static inline tile_t tile_bulk_copy_cols(tile_t a, tile_t b, int cola, int colb,
     return (a &~ mask) | (((b >> (8*colb)) << (8*cola)) & mask);
 }
 
+/** Return the columns of a that are set in `select`, packed in order into
+ * the low columns of the result.  The other columns of the result are zero.
+ */
+static inline tile_t tile_compact_cols(tile_t a, tile_edge_t select) {
+#if __BMI2__ && !defined(TILE_NO_VECTOR)
+    return _pext_u64(a, _pdep_u64(select, 0x0101010101010101ull) * 0xFF);
+#else
+    tile_t ret = tile_zero();
+    for (int col=0; select; select &= select-1, col++) {
+        ret |= ((a >> (8*ctz(select))) & 0xFF) << (8*col);
+    }
+    return ret;
+#endif
+}
+
+/** The inverse of tile_compact_cols: return the low popcount(select) columns
+ * of a, spread out in order to the columns that are set in `select`.  The
+ * other columns of the result are zero.
+ */
+static inline tile_t tile_expand_cols(tile_t a, tile_edge_t select) {
+#if __BMI2__ && !defined(TILE_NO_VECTOR)
+    return _pdep_u64(a, _pdep_u64(select, 0x0101010101010101ull) * 0xFF);
+#else
+    tile_t ret = tile_zero();
+    for (int col=0; select; select &= select-1, col++) {
+        ret |= ((a >> (8*col)) & 0xFF) << (8*ctz(select));
+    }
+    return ret;
+#endif
+}
+
+/** As tile_expand_cols, but for rows */
+static inline tile_t tile_expand_rows(tile_t a, tile_edge_t select) {
+    return tile_transpose(tile_expand_cols(tile_transpose(a), select));
+}
+
 /** Swap rows starting from a[rowa] to a[rowb] and return the new value of a.
  * The rows must not overlap.
  */
@@ -276,6 +315,28 @@ static inline int bit_index_to_col(int index) { return index / 8; }
         __m256i mask = _mm256_cmpgt_epi64(_mm256_set1_epi64x(n), _mm256_set_epi64x(3,2,1,0));
         _mm256_maskstore_epi64((long long*)pa, mask, a);
     }
+
+    /** The all-zero vector of tiles */
+    static inline tile_vector_t tile_vzero(void) { return _mm256_setzero_si256(); }
+
+    /** Multiply each tile of a by the corresponding tile of b, as tile_mul */
+    static inline tile_vector_t tile_vmul_lanes(tile_vector_t a, tile_vector_t b) {
+        /* vpshufb broadcasts column i of each tile; vpcmpeqb spreads row i */
+        const __m256i base = _mm256_set_epi64x(0x0808080808080808ull, 0, 0x0808080808080808ull, 0);
+        __m256i ret = _mm256_setzero_si256(), bit = _mm256_set1_epi8(1);
+        for (unsigned i=0; i<8; i++) {
+            __m256i col = _mm256_shuffle_epi8(a, _mm256_add_epi8(base, _mm256_set1_epi8(i)));
+            ret ^= col & _mm256_cmpeq_epi8(b & bit, bit);
+            bit = _mm256_add_epi8(bit, bit);
+        }
+        return ret;
+    }
+
+    /** Sum all the tiles in a vector */
+    static inline tile_t tile_vsum(tile_vector_t a) {
+        __m128i x = _mm256_castsi256_si128(a) ^ _mm256_extracti128_si256(a,1);
+        return _mm_cvtsi128_si64(x) ^ _mm_extract_epi64(x,1);
+    }
 #elif (__ARM_NEON__ || __ARM_NEON) && !defined(TILE_NO_VECTOR)
     #include <arm_neon.h>
     #define TILE_VECTOR_LENGTH 2
@@ -335,6 +396,27 @@ static inline int bit_index_to_col(int index) { return index / 8; }
         if (n >= 2) tile_write_v(pa,a);
         else vst1q_lane_u64(pa,vreinterpretq_u8_u64(a),0);
     }
+
+    /** The all-zero vector of tiles */
+    static inline tile_vector_t tile_vzero(void) { return vdupq_n_u8(0); }
+
+    /** Multiply each tile of a by the corresponding tile of b, as tile_mul */
+    static inline tile_vector_t tile_vmul_lanes(tile_vector_t a, tile_vector_t b) {
+        const uint8_t base[16] = {0,0,0,0,0,0,0,0,8,8,8,8,8,8,8,8};
+        uint8x16_t index = vld1q_u8(base), ret = vdupq_n_u8(0), bit = vdupq_n_u8(1);
+        for (unsigned i=0; i<8; i++) {
+            ret ^= vqtbl1q_u8(a, index) & vtstq_u8(b, bit);
+            index = vaddq_u8(index, vdupq_n_u8(1));
+            bit = vshlq_n_u8(bit, 1);
+        }
+        return ret;
+    }
+
+    /** Sum all the tiles in a vector */
+    static inline tile_t tile_vsum(tile_vector_t a) {
+        uint64x2_t a64 = vreinterpretq_u64_u8(a);
+        return vgetq_lane_u64(a64,0) ^ vgetq_lane_u64(a64,1);
+    }
 #else // !__AVX2__ && !__ARM_NEON__
     /* Scalar implementation */
     #define TILE_VECTOR_LENGTH 1
@@ -348,6 +430,9 @@ static inline int bit_index_to_col(int index) { return index / 8; }
     static inline void tile_write_v(tile_t *pa, tile_vector_t a) { *pa=a; }
     static inline tile_vector_t tile_read_vpartial(const tile_t *pa, int n) { (void)n; return *pa; }
     static inline void tile_write_vpartial(tile_t *pa, int n, tile_vector_t a) { (void)n; *pa=a; }
+    static inline tile_vector_t tile_vzero(void) { return 0; }
+    static inline tile_vector_t tile_vmul_lanes(tile_vector_t a, tile_vector_t b) { return tile_mul(a,b); }
+    static inline tile_t tile_vsum(tile_vector_t a) { return a; }
 #endif // __AVX2__
 
 #endif // __TILE_OPS_H__
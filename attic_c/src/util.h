@@ -14,6 +14,10 @@
 #include <sys/types.h> /* for ssize_t */
 #include "siphash.h"
 
+#if LFR_THREADED
+#include <sys/sysctl.h>
+#endif
+
 /* Builtin checking */
 #ifndef LFR_USE_BUILTINS
 #define LFR_USE_BUILTINS 1
@@ -125,6 +129,20 @@ static inline UNUSED void* lfr_aligned_alloc(size_t alignment, size_t size) {
     }
 }
 
+/** Return the number of threads to use, given the requested number (0 for one per CPU) */
+static inline UNUSED int lfr_nthreads(int nthreads) {
+#if LFR_THREADED
+    size_t len = sizeof(nthreads);
+    int mib[2] = { CTL_HW, HW_NCPU }, sret=0;
+    if (nthreads <= 0) sret = sysctl(mib, 2, &nthreads, &len, NULL, 0);
+    if (nthreads <= 0 || sret != 0) nthreads = 1;
+    return nthreads;
+#else
+    (void)nthreads;
+    return 1;
+#endif
+}
+
 /** Read  and return a little-endian word of `len`<8 bytes at offset `le` */
 static inline UNUSED uint64_t le2ui(const uint8_t *le, unsigned len) {
     uint64_t ret = 0;
@@ -0,0 +1,848 @@
+/** @file test_lfr_api.c
+ * @author Mike Hamburg
+ * @copyright 2020-2022 Rambus Inc.
+ * @brief Regression tests for corner cases of the map APIs.
+ *
+ * Usage: test_lfr_api [test ...].  With no arguments, runs every test.
+ * Exits nonzero if any check fails.
+ */
+#include "lfr_uniform.h"
+#include "lfr_sharded.h"
+#include "lfr_spill.h"
+#include "lfr_file.h"
+#include "util.h" // for fmix64, le2ui and ui2le
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while(0)
+
+/** Fill a builder with n relations, whose keys are 8 bytes from keys[] and whose
+ * values are value_bits wide.
+ */
+static void fill_builder(lfr_builder_t builder, uint64_t *keys, size_t n, int value_bits, uint64_t seed) {
+    lfr_response_t mask = (value_bits >= 64) ? -(lfr_response_t)1 : ((lfr_response_t)1 << value_bits) - 1;
+    for (size_t i=0; i<n; i++) {
+        keys[i] = fmix64(seed ^ fmix64(i+1));
+        lfr_builder_insert(builder, (const uint8_t*)&keys[i], sizeof(keys[i]), fmix64(keys[i]) & mask);
+    }
+}
+
+/** Return the number of the builder's relations that the map gets wrong */
+static size_t count_wrong(const lfr_uniform_map_t map, const lfr_builder_t builder) {
+    size_t wrong = 0;
+    for (size_t i=0; i<builder->used; i++) {
+        const lfr_relation_t *r = &builder->relations[i];
+        if (lfr_uniform_query(map, r->key, r->keybytes) != r->value) wrong++;
+    }
+    return wrong;
+}
+
+/** Builds with no relations, or very few, with every kind of builder option */
+static void test_tiny(void) {
+    uint64_t keys[40];
+    for (int opt=0; opt<7; opt++) {
+        for (size_t n=0; n<sizeof(keys)/sizeof(*keys); n++) {
+            for (int nthreads=1; nthreads<=3; nthreads+=2) {
+                lfr_builder_t builder;
+                CHECK(lfr_builder_init(builder, 0, 0, 0) == 0);
+                switch (opt) {
+                case 1: builder->blocksize = 8; break;
+                case 2: builder->blocksize = 1; break;
+                case 3: builder->shape = LFR_SHAPE_XOR; break;
+                case 4: builder->precondition = 1; break;
+                case 5: builder->max_stash = 4; break;
+                case 6: builder->overprovision = 16; break;
+                }
+                fill_builder(builder, keys, n, 8, opt*1000+n);
+
+                lfr_uniform_map_t map;
+                int ret = lfr_uniform_build_threaded(map, builder, 8, nthreads);
+                CHECK(ret == 0);
+                if (ret == 0) {
+                    CHECK(count_wrong(map, builder) == 0);
+                    lfr_uniform_map_destroy(map);
+                }
+                lfr_builder_destroy(builder);
+            }
+        }
+    }
+}
+
+/** Return the number of the builder's relations that the sharded map gets wrong */
+static size_t count_wrong_sharded(const lfr_sharded_map_t map, const lfr_builder_t builder) {
+    size_t wrong = 0;
+    for (size_t i=0; i<builder->used; i++) {
+        const lfr_relation_t *r = &builder->relations[i];
+        if (lfr_sharded_query(map, r->key, r->keybytes) != r->value) wrong++;
+    }
+    return wrong;
+}
+
+/** Return the number of empty shards, and check that queries landing in them return 0 */
+static unsigned check_empty_shards(const lfr_sharded_map_t map) {
+    unsigned empty = 0;
+    for (unsigned i=0; i<map->nshards; i++) empty += (map->shards[i].blocks == 0);
+    for (uint64_t i=0; i<1000 && empty; i++) {
+        uint64_t key = fmix64(~i);
+        unsigned shard = lfr_spill_partition(map->salt, (const uint8_t*)&key, sizeof(key), map->nshards);
+        if (map->shards[shard].blocks == 0) CHECK(lfr_sharded_query(map, (const uint8_t*)&key, sizeof(key)) == 0);
+    }
+    return empty;
+}
+
+/** Serialize a sharded map, deserialize it both ways, and check the copies against the builder */
+static void check_sharded_round_trip(const lfr_sharded_map_t map, const lfr_builder_t builder) {
+    size_t size = lfr_sharded_map_serial_size(map);
+    uint8_t *ser = malloc(size);
+    CHECK(ser != NULL);
+    if (ser == NULL) return;
+    CHECK(lfr_sharded_map_serialize(ser, map) == 0);
+    for (uint8_t flags=0; flags<=LFR_NO_COPY_DATA; flags+=LFR_NO_COPY_DATA) {
+        lfr_sharded_map_t copy;
+        int ret = lfr_sharded_map_deserialize(copy, ser, size, flags);
+        CHECK(ret == 0);
+        if (ret) continue;
+        CHECK(copy->nshards == map->nshards);
+        CHECK(count_wrong_sharded(copy, builder) == 0);
+        CHECK(check_empty_shards(copy) == check_empty_shards(map));
+        lfr_sharded_map_destroy(copy);
+    }
+    lfr_sharded_map_t copy;
+    CHECK(lfr_sharded_map_deserialize(copy, ser, size-1, 0) != 0);
+    free(ser);
+}
+
+/** Sharded maps from builders and spill builders, including ones with empty shards */
+static void test_sharded(void) {
+    static const struct { size_t n; unsigned nshards; } cases[] = {
+        { 0, 0 }, { 0, 3 }, { 7, 5 }, { 7, 64 }, { 3000, 4 }, { 20000, 0 }
+    };
+    for (size_t c=0; c<sizeof(cases)/sizeof(*cases); c++) {
+        size_t n = cases[c].n;
+        uint64_t *keys = malloc((n+1) * sizeof(*keys));
+        lfr_builder_t builder;
+        CHECK(lfr_builder_init(builder, n, 0, 0) == 0);
+        fill_builder(builder, keys, n, 16, c);
+
+        for (int value_bits=-1; value_bits<=16; value_bits+=17) {
+            lfr_sharded_map_t map;
+            int ret = lfr_sharded_build(map, builder, value_bits, cases[c].nshards, 2);
+            CHECK(ret == 0);
+            if (ret) continue;
+            CHECK(map->nshards == (cases[c].nshards ? cases[c].nshards : 1));
+            CHECK(count_wrong_sharded(map, builder) == 0);
+            unsigned empty = check_empty_shards(map);
+            if (n < map->nshards) CHECK(empty >= map->nshards - n);
+            check_sharded_round_trip(map, builder);
+            lfr_sharded_map_destroy(map);
+        }
+
+        for (unsigned nparts=1; nparts<=12; nparts+=11) {
+            lfr_spill_builder_t spill;
+            CHECK(lfr_spill_builder_init(spill, nparts, NULL) == 0);
+            for (size_t i=0; i<n; i++) {
+                const lfr_relation_t *r = &builder->relations[i];
+                CHECK(lfr_spill_builder_insert(spill, r->key, r->keybytes, r->value) == 0);
+            }
+            lfr_sharded_map_t map;
+            int ret = lfr_sharded_build_from_spill(map, spill, -1, 2, 0);
+            CHECK(ret == 0);
+            if (ret == 0) {
+                CHECK(map->nshards == nparts);
+                CHECK(count_wrong_sharded(map, builder) == 0);
+                check_empty_shards(map);
+                check_sharded_round_trip(map, builder);
+                lfr_sharded_map_destroy(map);
+            }
+            lfr_spill_builder_destroy(spill);
+        }
+        lfr_builder_destroy(builder);
+        free(keys);
+    }
+}
+
+/** A memory limit which only fits one thread builds on one thread.  A smaller
+ * one builds without bucketing the relations, and one smaller than that
+ * fails with ENOMEM.  The limit takes the builder's options into account.
+ */
+static void test_memory_limit(void) {
+    size_t n = 20000;
+    uint64_t *keys = malloc(n * sizeof(*keys));
+    for (int opt=0; opt<4; opt++) {
+        lfr_builder_t builder;
+        CHECK(lfr_builder_init(builder, n, 0, 0) == 0);
+        switch (opt) {
+        case 0: builder->parallel_tries = 2; break;
+        case 1: builder->blocksize = 2; break;
+        case 2: builder->max_stash = 8; break;
+        case 3: builder->overprovision = 16; builder->precondition = 1; break;
+        }
+        fill_builder(builder, keys, n, 8, opt);
+
+        size_t one = _lfr_uniform_estimate_memory(n, 8, 1, builder->blocksize,
+            builder->overprovision, builder->precondition, builder->max_stash != 0, 1);
+        size_t four = _lfr_uniform_estimate_memory(n, 8, 4, builder->blocksize,
+            builder->overprovision, builder->precondition, builder->max_stash != 0, 1);
+        size_t unbucketed = _lfr_uniform_estimate_memory(n, 8, 1, builder->blocksize,
+            builder->overprovision, builder->precondition, builder->max_stash != 0, 0);
+        CHECK(four >= one);
+        CHECK(unbucketed < one);
+        if (opt == 0) CHECK(one == lfr_build_estimate_memory(n, 8, 1));
+        else CHECK(one > lfr_build_estimate_memory(n, 8, 1));
+
+        size_t limits[] = { one, one - 1, unbucketed };
+        for (int i=0; i<3; i++) {
+            lfr_uniform_map_t map;
+            builder->memory_limit = limits[i];
+            int ret = lfr_uniform_build_threaded(map, builder, 8, 4);
+            CHECK(ret == 0);
+            if (ret == 0) {
+                CHECK(count_wrong(map, builder) == 0);
+                lfr_uniform_map_destroy(map);
+            }
+        }
+        lfr_uniform_map_t map;
+        builder->memory_limit = unbucketed - 1;
+        CHECK(lfr_uniform_build_threaded(map, builder, 8, 4) == ENOMEM);
+        lfr_builder_destroy(builder);
+    }
+    free(keys);
+}
+
+/** Resolving new values on a factorization gives maps that return them */
+static void test_factor(void) {
+    static const int value_bits[] = { 1, 8, 64, -1 };
+    size_t n = 5000;
+    uint64_t *keys = malloc(n * sizeof(*keys));
+    lfr_response_t *values = malloc(n * sizeof(*values));
+    for (int opt=0; opt<3; opt++) {
+        for (int nthreads=1; nthreads<=3; nthreads+=2) {
+            lfr_builder_t builder;
+            CHECK(lfr_builder_init(builder, n, 0, 0) == 0);
+            switch (opt) {
+            case 1: builder->precondition = 1; break;
+            case 2: builder->blocksize = 8; builder->shape = LFR_SHAPE_XOR; builder->overprovision = 64; break;
+            }
+            fill_builder(builder, keys, n, 8, opt);
+
+            lfr_uniform_factor_t factor;
+            int ret = lfr_uniform_factor(factor, builder, nthreads);
+            CHECK(ret == 0);
+            if (ret) {
+                lfr_builder_destroy(builder);
+                continue;
+            }
+            CHECK(factor->nrelns == n);
+
+            for (size_t v=0; v<sizeof(value_bits)/sizeof(*value_bits); v++) {
+                int bits = value_bits[v];
+                lfr_response_t mask = (bits < 0 || bits >= 64) ? -(lfr_response_t)1 : ((lfr_response_t)1 << bits) - 1;
+                if (bits < 0) mask >>= 3; // so that the map needs 61 bits
+                for (size_t i=0; i<n; i++) values[i] = fmix64(keys[i] ^ (v+1)) & mask;
+                values[0] = mask;
+
+                lfr_uniform_map_t map;
+                ret = lfr_uniform_resolve_values(map, factor, values, bits);
+                CHECK(ret == 0);
+                if (ret) continue;
+                CHECK(map->value_bits == ((bits < 0) ? 61 : bits));
+                size_t wrong = 0;
+                for (size_t i=0; i<n; i++) {
+                    wrong += lfr_uniform_query(map, (const uint8_t*)&keys[i], sizeof(keys[i])) != values[i];
+                }
+                CHECK(wrong == 0);
+                lfr_uniform_map_destroy(map);
+            }
+
+            lfr_uniform_map_t map;
+            CHECK(lfr_uniform_resolve_values(map, factor, values, 65) == EINVAL);
+            lfr_uniform_factor_destroy(factor);
+
+            builder->engine = LFR_ENGINE_FUSE;
+            CHECK(lfr_uniform_factor(factor, builder, nthreads) == EINVAL);
+            lfr_builder_destroy(builder);
+        }
+    }
+    free(keys);
+    free(values);
+}
+
+/** Return the number of keys for which a wide map doesn't return their value */
+static size_t count_wrong_wide(const lfr_uniform_map_t map, const uint64_t *keys, const uint8_t *values, size_t n) {
+    size_t bytes = (map->value_bits+7)/8, wrong = 0;
+    uint8_t out[(LFR_MAX_VALUE_BITS+7)/8];
+    for (size_t i=0; i<n; i++) {
+        const uint8_t *key = (const uint8_t*)&keys[i];
+        lfr_uniform_query_wide(out, map, key, sizeof(keys[i]));
+        int ok = !memcmp(out, &values[i*bytes], bytes);
+        ok &= lfr_uniform_query(map, key, sizeof(keys[i])) == le2ui(&values[i*bytes], 8);
+        wrong += !ok;
+    }
+    return wrong;
+}
+
+/** Builds which stash some relations, and their serialized copies */
+static void test_stash(void) {
+    size_t n = 3000;
+    uint64_t *keys = malloc(n * sizeof(*keys));
+    int stashed = 0;
+    for (int t=0; t<4; t++) {
+        lfr_builder_t builder;
+        CHECK(lfr_builder_init(builder, n, 0, 0) == 0);
+        builder->blocksize = 1; // short of columns at the default overprovision, so it stashes
+        builder->max_stash = 64;
+        fill_builder(builder, keys, n, 8, t);
+
+        lfr_uniform_map_t map;
+        int ret = lfr_uniform_build_threaded(map, builder, 8, 1);
+        CHECK(ret == 0);
+        if (ret) {
+            lfr_builder_destroy(builder);
+            continue;
+        }
+        stashed += map->nstash > 0;
+        CHECK(map->nstash <= builder->max_stash);
+        CHECK(count_wrong(map, builder) == 0);
+
+        size_t size = lfr_uniform_map_serial_size(map);
+        uint8_t *ser = malloc(size);
+        CHECK(lfr_uniform_map_serialize(ser, map) == 0);
+        for (uint8_t flags=0; flags<=LFR_NO_COPY_DATA; flags+=LFR_NO_COPY_DATA) {
+            lfr_uniform_map_t copy;
+            ret = lfr_uniform_map_deserialize(copy, ser, size, flags);
+            CHECK(ret == 0);
+            if (ret) continue;
+            CHECK(copy->nstash == map->nstash);
+            CHECK(count_wrong(copy, builder) == 0);
+            lfr_uniform_map_destroy(copy);
+        }
+        free(ser);
+        lfr_uniform_map_destroy(map);
+        lfr_builder_destroy(builder);
+    }
+    CHECK(stashed > 0);
+    free(keys);
+}
+
+/** Maps with more than 64 value bits, and their serialized header */
+static void test_wide(void) {
+    static const int value_bits[] = { 65, 100, 256 };
+    size_t n = 3000;
+    uint64_t *keys = malloc(n * sizeof(*keys));
+    uint8_t *values = malloc(n * (LFR_MAX_VALUE_BITS/8));
+    for (size_t v=0; v<sizeof(value_bits)/sizeof(*value_bits); v++) {
+        int bits = value_bits[v];
+        size_t bytes = (bits+7)/8;
+        for (int nthreads=1; nthreads<=3; nthreads+=2) {
+            lfr_builder_t builder;
+            CHECK(lfr_builder_init(builder, n, 0, 0) == 0);
+            if (nthreads > 1) builder->blocksize = 8;
+            fill_builder(builder, keys, n, 0, v);
+            for (size_t i=0; i<n*bytes; i++) values[i] = (uint8_t)fmix64(i ^ ((uint64_t)bits << 32));
+            for (size_t i=0; i<n; i++) {
+                if (bits % 8) values[i*bytes + bytes-1] &= (1 << (bits % 8)) - 1;
+            }
+
+            lfr_uniform_map_t map;
+            int ret = lfr_uniform_build_wide(map, builder, values, bits, nthreads);
+            CHECK(ret == 0);
+            if (ret) {
+                lfr_builder_destroy(builder);
+                continue;
+            }
+            CHECK(map->value_bits == bits);
+            CHECK(count_wrong_wide(map, keys, values, n) == 0);
+
+            /* The value_bits byte is 0x7F, and the width follows the header in 2 bytes */
+            size_t size = lfr_uniform_map_serial_size(map);
+            uint8_t *ser = malloc(size);
+            CHECK(lfr_uniform_map_serialize(ser, map) == 0);
+            CHECK(size == 16 + _lfr_uniform_map_vector_size(map));
+            CHECK(ser[13] == 0x7F);
+            CHECK(le2ui(&ser[14], 2) == (uint64_t)bits);
+            for (uint8_t flags=0; flags<=LFR_NO_COPY_DATA; flags+=LFR_NO_COPY_DATA) {
+                lfr_uniform_map_t copy;
+                ret = lfr_uniform_map_deserialize(copy, ser, size, flags);
+                CHECK(ret == 0);
+                if (ret) continue;
+                CHECK(copy->value_bits == bits);
+                CHECK(count_wrong_wide(copy, keys, values, n) == 0);
+                lfr_uniform_map_destroy(copy);
+            }
+
+            /* Truncated, or with a width that's too narrow or too wide */
+            lfr_uniform_map_t copy;
+            CHECK(lfr_uniform_map_deserialize(copy, ser, size-1, 0) != 0);
+            CHECK(lfr_uniform_map_deserialize(copy, ser, 15, 0) != 0);
+            ui2le(&ser[14], 2, 64);
+            CHECK(lfr_uniform_map_deserialize(copy, ser, size, 0) != 0);
+            ui2le(&ser[14], 2, LFR_MAX_VALUE_BITS+1);
+            CHECK(lfr_uniform_map_deserialize(copy, ser, size, 0) != 0);
+            free(ser);
+            lfr_uniform_map_destroy(map);
+
+            CHECK(lfr_uniform_build_wide(map, builder, values, LFR_MAX_VALUE_BITS+1, nthreads) == EINVAL);
+            lfr_builder_destroy(builder);
+        }
+    }
+    free(keys);
+    free(values);
+}
+
+/** Several maps from one solve, with the builder's values and explicit ones */
+static void test_multi(void) {
+    static const struct { unsigned nmaps; int builder_map, value_bits[4]; } cases[] = {
+        { 1, 0, { 8 } },
+        { 2, 0, { -1, 56 } },
+        { 3, 1, { 1, 8, 55 } },
+        { 4, 3, { 16, 16, 16, 16 } },
+        { 3, 3, { 32, 31, 1 } },
+    };
+    size_t n = 3000;
+    uint64_t *keys = malloc(n * sizeof(*keys));
+    lfr_response_t *values = malloc(4 * n * sizeof(*values));
+    for (size_t c=0; c<sizeof(cases)/sizeof(*cases); c++) {
+        unsigned nmaps = cases[c].nmaps;
+        lfr_builder_t builder;
+        CHECK(lfr_builder_init(builder, n, 0, 0) == 0);
+        fill_builder(builder, keys, n, 8, c);
+
+        /* One map (unless builder_map >= nmaps) uses the builder's 8-bit values */
+        const lfr_response_t *arrays[4];
+        for (unsigned j=0; j<nmaps; j++) {
+            int bits = cases[c].value_bits[j];
+            lfr_response_t mask = (bits < 0 || bits >= 64) ? -(lfr_response_t)1 : ((lfr_response_t)1 << bits) - 1;
+            for (size_t i=0; i<n; i++) values[j*n+i] = fmix64(keys[i] + j) & mask;
+            arrays[j] = (j == (unsigned)cases[c].builder_map) ? NULL : &values[j*n];
+        }
+
+        lfr_uniform_map_s maps[4];
+        int ret = lfr_uniform_build_multi(maps, nmaps, builder, arrays, cases[c].value_bits, 2);
+        CHECK(ret == 0);
+        if (ret == 0) {
+            for (unsigned j=0; j<nmaps; j++) {
+                int bits = cases[c].value_bits[j];
+                CHECK(maps[j].value_bits == ((bits < 0) ? 8 : bits));
+                CHECK(maps[j].salt == maps[nmaps-1].salt);
+                size_t wrong = 0;
+                for (size_t i=0; i<n; i++) {
+                    lfr_response_t want = arrays[j] ? arrays[j][i] : builder->relations[i].value;
+                    wrong += lfr_uniform_query(&maps[j], (const uint8_t*)&keys[i], sizeof(keys[i])) != want;
+                }
+                CHECK(wrong == 0);
+                lfr_uniform_map_destroy(&maps[j]);
+            }
+        }
+
+        /* One more bit is too many */
+        int too_many[4];
+        memcpy(too_many, cases[c].value_bits, sizeof(too_many));
+        too_many[nmaps-1] = (too_many[nmaps-1] < 0) ? 57 : too_many[nmaps-1] + 1;
+        if (c > 0) CHECK(lfr_uniform_build_multi(maps, nmaps, builder, arrays, too_many, 2) == EINVAL);
+        lfr_builder_destroy(builder);
+    }
+    free(keys);
+    free(values);
+}
+
+/** Builds with more than one thread.  Threads race to claim groups in the
+ * forward and backward passes; if one that's late to the forward pass can
+ * reclaim a group that's already been solved, the build hangs.
+ */
+static void test_threads(void) {
+    size_t sizes[] = { 100, 3000, 20000, 100000 };
+    size_t nmax = sizes[sizeof(sizes)/sizeof(*sizes)-1];
+    uint64_t *keys = malloc(nmax * sizeof(*keys));
+    for (size_t s=0; s<sizeof(sizes)/sizeof(*sizes); s++) {
+        lfr_builder_t builder;
+        CHECK(lfr_builder_init(builder, sizes[s], 0, 0) == 0);
+        fill_builder(builder, keys, sizes[s], 8, s);
+        for (int nthreads=2; nthreads<=8; nthreads++) {
+            for (int trial=0; trial<4; trial++) {
+                lfr_uniform_map_t map;
+                builder->salt = trial;
+                int ret = lfr_uniform_build_threaded(map, builder, 8, nthreads);
+                CHECK(ret == 0);
+                if (ret == 0) {
+                    CHECK(count_wrong(map, builder) == 0);
+                    lfr_uniform_map_destroy(map);
+                }
+            }
+        }
+        lfr_builder_destroy(builder);
+    }
+    free(keys);
+}
+
+/** Fill a distinct key of 4 to 19 bytes for relation i, or an empty one for i == 0, and return its length */
+static size_t spill_key(uint8_t key[20], uint32_t i) {
+    size_t keybytes = i ? 4 + fmix64(i) % 16 : 0;
+    ui2le(key, 4, i);
+    for (size_t j=4; j<keybytes; j++) key[j] = fmix64(i + ((uint64_t)j<<32));
+    return keybytes;
+}
+
+/** Load every partition of a spill builder, and check that together they're exactly the reference */
+static void check_spill(lfr_spill_builder_t spill, const lfr_builder_t ref) {
+    lfr_builder_t out;
+    CHECK(lfr_builder_init(out, 0, 0, 0) == 0);
+    size_t total = 0, wrong = 0;
+    for (unsigned part=0; part<spill->nparts; part++) {
+        int ret = lfr_spill_builder_load_partition(out, spill, part);
+        CHECK(ret == 0);
+        if (ret) continue;
+        total += out->used;
+        for (size_t i=0; i<out->used; i++) {
+            const lfr_relation_t *r = &out->relations[i];
+            lfr_response_t *value = lfr_builder_lookup(ref, r->key, r->keybytes);
+            if (value == NULL || *value != r->value
+                || lfr_spill_partition(spill->salt, r->key, r->keybytes, spill->nparts) != part) {
+                wrong++;
+            }
+        }
+    }
+    CHECK(total == ref->used);
+    CHECK(wrong == 0);
+    lfr_builder_destroy(out);
+}
+
+/** Spill builders round trip, with duplicate and empty keys, and stay usable after a failed write */
+static void test_spill(void) {
+    size_t n = 5000;
+    uint8_t key[20];
+    for (unsigned nparts=1; nparts<=3; nparts+=2) {
+        lfr_spill_builder_t spill;
+        lfr_builder_t ref;
+        CHECK(lfr_spill_builder_init(spill, nparts, NULL) == 0);
+        CHECK(lfr_builder_init(ref, 0, 0, 0) == 0);
+        check_spill(spill, ref);
+
+        /* Every 10th insert repeats an earlier relation, which loading merges */
+        for (size_t i=0; i<n; i++) {
+            uint64_t k = (i % 10 == 9) ? i/2 : i;
+            size_t keybytes = spill_key(key, k);
+            CHECK(lfr_spill_builder_insert(spill, key, keybytes, fmix64(~k)) == 0);
+            CHECK(lfr_builder_insert(ref, key, keybytes, fmix64(~k)) == 0);
+        }
+        CHECK(spill->used == n);
+        check_spill(spill, ref);
+
+        /* ... but a repeat with a different value is an error */
+        size_t keybytes = spill_key(key, 3);
+        CHECK(lfr_spill_builder_insert(spill, key, keybytes, 0) == 0);
+        lfr_builder_t out;
+        CHECK(lfr_builder_init(out, 0, 0, 0) == 0);
+        unsigned part = lfr_spill_partition(spill->salt, key, keybytes, nparts);
+        CHECK(lfr_spill_builder_load_partition(out, spill, part) == EEXIST);
+        lfr_builder_destroy(out);
+        lfr_spill_builder_destroy(spill);
+        lfr_builder_destroy(ref);
+    }
+
+    /* Fail a write partway through a record, by inserting a key larger than
+     * the file size limit.  If that's the only record lost, the partition is
+     * cut back and the records after it line up.  If the records buffered
+     * before it are lost too, the partition is closed.
+     */
+    struct rlimit old;
+    if (getrlimit(RLIMIT_FSIZE, &old)) return;
+    signal(SIGXFSZ, SIG_IGN);
+    size_t big = 1<<20;
+    uint8_t *bigkey = calloc(1, big);
+    for (int lose_buffered=0; lose_buffered<=1; lose_buffered++) {
+        lfr_spill_builder_t spill;
+        lfr_builder_t ref;
+        CHECK(lfr_spill_builder_init(spill, 1, NULL) == 0);
+        CHECK(lfr_builder_init(ref, 0, 0, 0) == 0);
+        size_t before = lose_buffered ? 1000 : 10;
+        for (size_t i=0; i<before; i++) {
+            size_t keybytes = spill_key(key, i);
+            CHECK(lfr_spill_builder_insert(spill, key, keybytes, i) == 0);
+            CHECK(lfr_builder_insert(ref, key, keybytes, i) == 0);
+        }
+
+        struct rlimit limit = old;
+        limit.rlim_cur = 4096;
+        CHECK(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+        CHECK(lfr_spill_builder_insert(spill, bigkey, big, 0) == EIO);
+        CHECK(setrlimit(RLIMIT_FSIZE, &old) == 0);
+
+        for (size_t i=before; i<before+10; i++) {
+            size_t keybytes = spill_key(key, i);
+            int ret = lfr_spill_builder_insert(spill, key, keybytes, i);
+            CHECK(ret == (lose_buffered ? EIO : 0));
+            CHECK(lfr_builder_insert(ref, key, keybytes, i) == 0);
+        }
+        if (lose_buffered) {
+            lfr_builder_t out;
+            CHECK(lfr_builder_init(out, 0, 0, 0) == 0);
+            CHECK(lfr_spill_builder_load_partition(out, spill, 0) == EIO);
+            lfr_builder_destroy(out);
+        } else {
+            check_spill(spill, ref);
+        }
+        lfr_spill_builder_destroy(spill);
+        lfr_builder_destroy(ref);
+    }
+    signal(SIGXFSZ, SIG_DFL);
+    free(bigkey);
+}
+
+/** Write data to a new temporary file, whose name is stored in path */
+static int write_temp_file(char path[32], const void *data, size_t size) {
+    strcpy(path, "/tmp/lfr_test.XXXXXX");
+    int fd = mkstemp(path);
+    if (fd < 0) return errno;
+    int ret = (write(fd, data, size) == (ssize_t)size) ? 0 : EIO;
+    close(fd);
+    return ret;
+}
+
+/** Load data from a file into a new builder with the given flags, and check it against a reference */
+static void check_load_file(const void *data, size_t size, const lfr_record_format_t *format,
+    uint8_t flags, const lfr_builder_t ref, size_t expect_used) {
+    char path[32];
+    CHECK(write_temp_file(path, data, size) == 0);
+    for (int nthreads=1; nthreads<=3; nthreads+=2) {
+        lfr_builder_t builder;
+        CHECK(lfr_builder_init(builder, 0, 0, flags) == 0);
+        int ret = lfr_builder_load_file_threaded(builder, path, format, nthreads);
+        CHECK(ret == 0);
+        if (ret == 0) {
+            CHECK(builder->used == expect_used);
+            size_t wrong = 0;
+            for (size_t i=0; i<builder->used; i++) {
+                const lfr_relation_t *r = &builder->relations[i];
+                lfr_response_t *value = lfr_builder_lookup(ref, r->key, r->keybytes);
+                if (value == NULL || *value != r->value) wrong++;
+            }
+            CHECK(wrong == 0);
+        }
+        lfr_builder_destroy(builder);
+    }
+    unlink(path);
+}
+
+/** Load a file into a builder, and return the error */
+static int load_file_error(const void *data, size_t size, const lfr_record_format_t *format) {
+    char path[32];
+    CHECK(write_temp_file(path, data, size) == 0);
+    lfr_builder_t builder;
+    CHECK(lfr_builder_init(builder, 0, 0, 0) == 0);
+    int ret = lfr_builder_load_file_threaded(builder, path, format, 3);
+    lfr_builder_destroy(builder);
+    unlink(path);
+    return ret;
+}
+
+/** Binary and text files load into builders, with duplicate keys, empty files and unterminated lines */
+static void test_file(void) {
+    size_t n = 2000, ndistinct = n - n/10;
+    uint8_t flags[] = { 0, LFR_NO_COPY_DATA, LFR_NO_HASHTABLE };
+
+    /* Binary records, of which every 10th repeats an earlier one */
+    lfr_record_format_t binary = { 8, 2, 0, 0 };
+    uint8_t *records = malloc(10*(n+1));
+    lfr_builder_t ref;
+    CHECK(lfr_builder_init(ref, 0, 0, 0) == 0);
+    for (size_t i=0; i<n; i++) {
+        uint64_t k = (i % 10 == 9) ? i-5 : i;
+        ui2le(&records[10*i], 8, fmix64(k+1));
+        ui2le(&records[10*i+8], 2, k);
+        lfr_builder_insert(ref, &records[10*i], 8, k);
+    }
+    CHECK(ref->used == ndistinct);
+    for (int f=0; f<3; f++) {
+        check_load_file(records, 10*n, &binary, flags[f], ref, flags[f] == LFR_NO_HASHTABLE ? n : ndistinct);
+    }
+    check_load_file(records, 0, &binary, 0, ref, 0);
+    CHECK(load_file_error(records, 10*n-1, &binary) == EINVAL);
+    memcpy(&records[10*n], &records[0], 8);
+    ui2le(&records[10*n+8], 2, 1); // the first key again, with a different value
+    CHECK(load_file_error(records, 10*(n+1), &binary) == EEXIST);
+    free(records);
+    lfr_builder_destroy(ref);
+
+    /* Text records, with a blank line, a key containing the separator, and
+     * a mix of decimal and hex values.  Every 10th repeats an earlier one.
+     */
+    lfr_record_format_t text = { 0, 0, '\t', 7 };
+    char *lines = malloc(40*(n+2)), *cur = lines;
+    CHECK(lfr_builder_init(ref, 0, 0, 0) == 0);
+    for (size_t i=0; i<n; i++) {
+        uint64_t k = (i % 10 == 9) ? i-5 : i;
+        char key[24];
+        int keybytes = sprintf(key, (k == 17) ? "key\t%u" : "key%u", (unsigned)k);
+        cur += sprintf(cur, (k % 2) ? "%s\t0x%x\n" : "%s\t%u\n", key, (unsigned)(3*k));
+        if (i == n/2) cur += sprintf(cur, "\n");
+        lfr_builder_insert(ref, (const uint8_t*)key, keybytes, 3*k);
+    }
+    CHECK(ref->used == ndistinct);
+    size_t size = cur - lines;
+    for (int f=0; f<3; f++) {
+        size_t expect = flags[f] == LFR_NO_HASHTABLE ? n : ndistinct;
+        check_load_file(lines, size, &text, flags[f], ref, expect);
+        check_load_file(lines, size-1, &text, flags[f], ref, expect); // no final newline
+    }
+    check_load_file(lines, 0, &text, 0, ref, 0);
+    check_load_file("\n\r\n\n", 4, &text, 0, ref, 0);
+    char crlf[] = "key4\t12\r\nkey5\t0xf\r\n";
+    check_load_file(crlf, strlen(crlf), &text, 0, ref, 2);
+
+    /* Without a separator, the whole line is the key, with the default value */
+    lfr_builder_destroy(ref);
+    CHECK(lfr_builder_init(ref, 0, 0, 0) == 0);
+    lfr_builder_insert(ref, (const uint8_t*)"a\tb", 3, 7);
+    lfr_builder_insert(ref, (const uint8_t*)"c", 1, 7);
+    lfr_record_format_t keys_only = { 0, 0, 0, 7 };
+    check_load_file("a\tb\nc\na\tb", 9, &keys_only, 0, ref, 2);
+
+    CHECK(load_file_error("key\t12x\n", 8, &text) == EINVAL);
+    CHECK(load_file_error("key\t1\nkey\t2", 11, &text) == EEXIST);
+    lfr_builder_t builder;
+    CHECK(lfr_builder_init(builder, 0, 0, 0) == 0);
+    CHECK(lfr_builder_load_file(builder, "/nonexistent/lfr_test", &text) == ENOENT);
+    lfr_builder_destroy(builder);
+    lfr_builder_destroy(ref);
+    free(lines);
+}
+
+/** A relation source over an array of keys, which can misbehave on request */
+typedef struct {
+    const uint64_t *keys;
+    size_t n, pos;
+    int passes;
+    long grow;      // relations to add (or, if negative, drop) after the first pass
+    size_t fail_at; // if error is set, return it instead of this relation
+    int error;
+} array_source_t;
+
+static int array_source(void *ctx, lfr_relation_t *relation) {
+    array_source_t *src = ctx;
+    if (relation == NULL) {
+        src->pos = 0;
+        src->passes++;
+        return 0;
+    }
+    if (src->error && src->pos == src->fail_at) return src->error;
+    if (src->pos >= src->n + (src->passes > 1 ? src->grow : 0)) return ENOENT;
+    const uint64_t *key = &src->keys[src->pos++];
+    relation->key = (const uint8_t*)key;
+    relation->keybytes = sizeof(*key);
+    relation->value = fmix64(*key) & 0xFF;
+    return 0;
+}
+
+/** Builds from a source, including empty ones and ones that misbehave */
+static void test_source(void) {
+    size_t sizes[] = { 0, 1, 7, 3000, 20000 };
+    size_t nmax = sizes[sizeof(sizes)/sizeof(*sizes)-1];
+    uint64_t *keys = malloc((nmax+1) * sizeof(*keys));
+    for (size_t i=0; i<=nmax; i++) keys[i] = fmix64(i+1);
+
+    for (size_t s=0; s<sizeof(sizes)/sizeof(*sizes); s++) {
+        size_t n = sizes[s];
+        for (int nthreads=1; nthreads<=3; nthreads+=2) {
+            for (int value_bits=-1; value_bits<=8; value_bits+=9) {
+                array_source_t src = { keys, n, 0, 0, 0, 0, 0 };
+                lfr_uniform_map_t map;
+                int ret = lfr_uniform_build_from_source_threaded(map, array_source, &src, n, value_bits, nthreads);
+                CHECK(ret == 0);
+                if (ret) continue;
+                CHECK(src.passes >= 2);
+                if (n >= 3000) CHECK(map->value_bits == 8);
+                size_t wrong = 0;
+                for (size_t i=0; i<n; i++) {
+                    wrong += lfr_uniform_query(map, (const uint8_t*)&keys[i], sizeof(keys[i])) != (fmix64(keys[i]) & 0xFF);
+                }
+                CHECK(wrong == 0);
+                lfr_uniform_map_destroy(map);
+            }
+
+            /* nitems is only a bound: a loose one gives the same size of map */
+            lfr_uniform_map_t exact, loose;
+            array_source_t exact_src = { keys, n, 0, 0, 0, 0, 0 }, loose_src = exact_src;
+            int ret = lfr_uniform_build_from_source_threaded(exact, array_source, &exact_src, n, 8, nthreads);
+            CHECK(ret == 0);
+            if (!ret) {
+                ret = lfr_uniform_build_from_source_threaded(loose, array_source, &loose_src, 4*n+1000, 8, nthreads);
+                CHECK(ret == 0);
+                if (!ret) {
+                    CHECK(loose->blocks == exact->blocks);
+                    lfr_uniform_map_destroy(loose);
+                }
+                lfr_uniform_map_destroy(exact);
+            }
+
+            /* More relations than nitems, or a different number on each pass */
+            lfr_uniform_map_t map;
+            if (n > 0) {
+                array_source_t src = { keys, n, 0, 0, 0, 0, 0 };
+                CHECK(lfr_uniform_build_from_source_threaded(map, array_source, &src, n-1, 8, nthreads) == EINVAL);
+            }
+            for (long grow=-1; grow<=1; grow+=2) {
+                if (n == 0 && grow < 0) continue;
+                array_source_t src = { keys, n, 0, 0, grow, 0, 0 };
+                CHECK(lfr_uniform_build_from_source_threaded(map, array_source, &src, n+1, 8, nthreads) == EINVAL);
+            }
+
+            /* The source's own errors are returned, and not retried */
+            array_source_t src = { keys, n, 0, 0, 0, n/2, EIO };
+            CHECK(lfr_uniform_build_from_source_threaded(map, array_source, &src, n, 8, nthreads) == EIO);
+            CHECK(src.passes == 1);
+        }
+    }
+    free(keys);
+}
+
+typedef struct {
+    const char *name;
+    void (*run)(void);
+} test_t;
+
+static const test_t tests[] = {
+    { "tiny", test_tiny },
+    { "sharded", test_sharded },
+    { "memory_limit", test_memory_limit },
+    { "factor", test_factor },
+    { "stash", test_stash },
+    { "wide", test_wide },
+    { "multi", test_multi },
+    { "threads", test_threads },
+    { "source", test_source },
+    { "spill", test_spill },
+    { "file", test_file },
+};
+
+int main(int argc, char **argv) {
+    size_t ntests = sizeof(tests)/sizeof(*tests);
+    for (size_t t=0; t<ntests; t++) {
+        int selected = (argc <= 1);
+        for (int i=1; i<argc; i++) selected |= !strcmp(argv[i], tests[t].name);
+        if (!selected) continue;
+        int before = failures;
+        tests[t].run();
+        printf("%-12s %s\n", tests[t].name, (failures == before) ? "ok" : "FAILED");
+    }
+    for (int i=1; i<argc; i++) {
+        int known = 0;
+        for (size_t t=0; t<ntests; t++) known |= !strcmp(argv[i], tests[t].name);
+        if (!known) {
+            fprintf(stderr, "Unknown test: %s\n", argv[i]);
+            return 2;
+        }
+    }
+    return failures != 0;
+}
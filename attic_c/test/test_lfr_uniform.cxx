@@ -44,7 +44,8 @@ void usage(const char *fail, const char *me, int exitcode) {
     if (fail) fprintf(stderr, "Unknown argument: %s\n", fail);
     fprintf(stderr,"Usage: %s [--deficit 8] [--threads 0] [--augmented 8] [--blocks 2||--rows 32] [--blocks-max 0]\n", me);
     fprintf(stderr,"  [--blocks-step 10] [--exp 1.1] [--ntrials 100] [--verbose] [--seed 2] [--bail 3]\n");
-    fprintf(stderr,"  [--tries 1] [--keylen 8] [--zeroize]\n");
+    fprintf(stderr,"  [--tries 1] [--parallel-tries 1] [--stash 0] [--keylen 8] [--zeroize] [--blocksize 4]\n");
+    fprintf(stderr,"  [--overprovision 0] [--xor-shape] [--precondition] [--fuse] [--factor]\n");
     exit(exitcode);
 }
 
@@ -52,7 +53,10 @@ int main(int argc, const char **argv) {
     long long blocks_min=2, blocks_max=-1, blocks_step=10, augmented=8, ntrials=100;
     uint64_t seed = 2;
     double ratio = 1.1;
-    int is_exponential = 0, verbose=0, bail=3, nthreads=0, zeroize=0, tries=1;
+    int is_exponential = 0, verbose=0, bail=3, nthreads=0, zeroize=0, tries=1, parallel_tries=1, max_stash=0;
+    int blocksize = LFR_BLOCKSIZE, overprovision = 0, shape = LFR_SHAPE_FRAYED, precondition = 0;
+    int engine = LFR_ENGINE_FRAYED, factor = 0;
+    long long rows_arg = -1, rows_max_arg = -1, rows_step_arg = -1;
     
     size_t keylen = 8;
         
@@ -67,20 +71,35 @@ int main(int argc, const char **argv) {
         } else if (!strcmp(arg,"--blocks-max") && i<argc-1) {
             blocks_max = atoll(argv[++i]);
         } else if (!strcmp(arg,"--rows") && i<argc-1) {
-            blocks_min = _lfr_uniform_provision_columns(atoll(argv[++i])) / LFR_BLOCKSIZE / 8;
-            if (blocks_min < 2) blocks_min = 2;
+            rows_arg = atoll(argv[++i]);
         } else if (!strcmp(arg,"--rows-max") && i<argc-1) {
-            blocks_max = atoll(argv[++i]) / LFR_BLOCKSIZE / 8;
+            rows_max_arg = atoll(argv[++i]);
         } else if (!strcmp(arg,"--blocks-step") && i<argc-1) {
             blocks_step = atoll(argv[++i]);
             is_exponential = 0;
         } else if (!strcmp(arg,"--rows-step") && i<argc-1) {
-            blocks_step = atoll(argv[++i]) / LFR_BLOCKSIZE / 8;
+            rows_step_arg = atoll(argv[++i]);
             is_exponential = 0;
         } else if (!strcmp(arg,"--keylen") && i<argc-1) {
             keylen = atoll(argv[++i]);
         } else if (!strcmp(arg,"--tries") && i<argc-1) {
             tries = atoll(argv[++i]);
+        } else if (!strcmp(arg,"--parallel-tries") && i<argc-1) {
+            parallel_tries = atoll(argv[++i]);
+        } else if (!strcmp(arg,"--factor")) {
+            factor = 1;
+        } else if (!strcmp(arg,"--blocksize") && i<argc-1) {
+            blocksize = atoll(argv[++i]);
+        } else if (!strcmp(arg,"--overprovision") && i<argc-1) {
+            overprovision = atoll(argv[++i]);
+        } else if (!strcmp(arg,"--xor-shape")) {
+            shape = LFR_SHAPE_XOR;
+        } else if (!strcmp(arg,"--precondition")) {
+            precondition = 1;
+        } else if (!strcmp(arg,"--fuse")) {
+            engine = LFR_ENGINE_FUSE;
+        } else if (!strcmp(arg,"--stash") && i<argc-1) {
+            max_stash = atoll(argv[++i]);
         } else if (!strcmp(arg,"--zeroize")) {
             zeroize = 1;
         } else if (!strcmp(arg,"--exp")) {
@@ -99,6 +118,18 @@ int main(int argc, const char **argv) {
         }
     }
     (void)nthreads;
+    if (factor && engine != LFR_ENGINE_FRAYED) {
+        fprintf(stderr, "--factor doesn't support --fuse\n");
+        return 1;
+    }
+
+    /* Row counts depend on the block size, so convert them once it's known */
+    if (rows_arg >= 0) {
+        blocks_min = _lfr_uniform_provision_columns(rows_arg, blocksize, overprovision) / blocksize / 8;
+        if (blocks_min < 2) blocks_min = 2;
+    }
+    if (rows_max_arg >= 0) blocks_max = rows_max_arg / blocksize / 8;
+    if (rows_step_arg >= 0) blocks_step = rows_step_arg / blocksize / 8;
     
     if (blocks_max <= 0) blocks_max = blocks_min;
     
@@ -106,7 +137,7 @@ int main(int argc, const char **argv) {
         printf("We don't support augmented > 64\n");
         return 1;
     }
-    unsigned rows_max = _lfr_uniform_provision_max_rows(LFR_BLOCKSIZE*8*blocks_max);
+    unsigned rows_max = _lfr_uniform_provision_max_rows(blocksize*8*blocks_max, blocksize, overprovision);
 
     uint8_t  *keys   = (uint8_t*)malloc(rows_max*keylen);
     lfr_response_t *values = (lfr_response_t*)calloc(rows_max, sizeof(*values));
@@ -130,16 +161,23 @@ int main(int argc, const char **argv) {
     uint64_t mask = (augmented==64) ? -(uint64_t)1 : ((uint64_t)1 << augmented)-1;
     for (long long blocks=blocks_min; blocks <= blocks_max && (bail <= 0 || successive_fails < bail); ) {
 
-        size_t rows = _lfr_uniform_provision_max_rows(LFR_BLOCKSIZE*8*blocks);
+        size_t rows = _lfr_uniform_provision_max_rows(blocksize*8*blocks, blocksize, overprovision);
         double us_per_query = INFINITY, sps = INFINITY, us_per_build = INFINITY, ns_per_hash = INFINITY, ns_per_sample = INFINITY;
 
-        size_t row_deficit = LFR_BLOCKSIZE*8*blocks - rows;
+        size_t row_deficit = blocksize*8*blocks - rows;
         lfr_salt_t salt;
         uint8_t salt_as_bytes[sizeof(salt)];
         randomize(salt_as_bytes, seed, blocks<<32 ^ 0xFFFFFFFF, sizeof(salt_as_bytes));
         salt = le2ui(salt_as_bytes, sizeof(salt_as_bytes));
         LibFrayed::Builder builder(rows,0,LFR_NO_COPY_DATA);
         builder.builder->max_tries = tries;
+        builder.builder->parallel_tries = parallel_tries;
+        builder.builder->max_stash = max_stash;
+        builder.builder->blocksize = blocksize;
+        builder.builder->overprovision = overprovision;
+        builder.builder->shape = shape;
+        builder.builder->precondition = precondition;
+        builder.builder->engine = engine;
     
         double start, tot_construct=0, tot_query=0, tot_sample=0, tot_builder=0, ignored=0;
         size_t passes=0;
@@ -160,7 +198,15 @@ int main(int argc, const char **argv) {
             bool success = false;
             LibFrayed::UniformMap map;
             try {
-                map = LibFrayed::UniformMap(builder, zeroize ? augmented : -1, nthreads);
+                if (factor) {
+                    // Factor the keys, and then resolve the values onto them
+                    LibFrayed::UniformFactor fac(builder, nthreads);
+                    std::vector<lfr_response_t> masked(rows);
+                    for (unsigned i=0; i<rows; i++) masked[i] = values[i] & mask;
+                    map = LibFrayed::UniformMap(fac, masked, zeroize ? augmented : -1);
+                } else {
+                    map = LibFrayed::UniformMap(builder, zeroize ? augmented : -1, nthreads);
+                }
                 success = true;
             } catch (LibFrayed::BuildFailedException &e) {
                 if (verbose) printf("Solve error\n");
@@ -200,7 +246,7 @@ int main(int argc, const char **argv) {
 	    }
         if (tot_construct > 0) sps = passes / tot_construct;
         printf("Size %6d*%d*8 - %d x +%d pass rate = %4d / %4d = %5.1f%%, time/trial=%0.5f s, samp/row=%0.4f ns, ht/row=%0.4fns, build/row=%0.5f us, query/row=%0.5f us,  SPS=%0.3f\n",
-            (int)blocks, (int)LFR_BLOCKSIZE, (int)row_deficit, (int)augmented, (int)passes,
+            (int)blocks, blocksize, (int)row_deficit, (int)augmented, (int)passes,
             (int)ntrials, 100.0*passes/ntrials,
             (tot_construct+tot_builder+tot_sample)/ntrials, ns_per_sample, ns_per_hash, us_per_build, us_per_query,
             sps);
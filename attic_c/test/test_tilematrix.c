@@ -71,6 +71,51 @@ int main (int argc, char **argv) {
         }
 
         printf("full-rank = %d / %d\n", inv, ntrials);
+    } else if (!strcmp(mode,"rows")) {
+        /* Set rows of all-ones and random data, with tile_matrix_set_row and
+         * with tile_matrix_stage_row, and check that both read back and that
+         * the padding past cols and aug_cols stays clear.  The shapes have
+         * different numbers of column and aug tiles, so masking the wrong
+         * tile shows up.
+         */
+        static const int shapes[][2] = { {20,44}, {64,36}, {13,5}, {40,33}, {8,8}, {100,3}, {3,100} };
+        enum { rows=19 };
+        int bad=0;
+        uint8_t data[rows][16], augdata[rows][16];
+        srand(1);
+        for (size_t s=0; s<sizeof(shapes)/sizeof(*shapes); s++) {
+            size_t cols = shapes[s][0], aug = shapes[s][1];
+            tile_matrix_t ma[1], mb[1];
+            tile_matrix_init(ma,rows,cols,aug);
+            tile_matrix_init(mb,rows,cols,aug);
+            for (int row=0; row<rows; row++) {
+                for (size_t i=0; i<sizeof(data[row]); i++) {
+                    data[row][i] = row ? rand() : 0xff;
+                    augdata[row][i] = row ? rand() : 0xff;
+                }
+                tile_matrix_set_row(ma,row,data[row],augdata[row]);
+                tile_matrix_stage_row(mb,row,data[row],augdata[row]);
+            }
+            int wrong = 0;
+            for (int row=0; row<rows; row++) {
+                for (size_t col=0; col<TILES_SPANNING(cols)*TILE_SIZE; col++) {
+                    int expected = (col < cols) && (data[row][col/8] >> (col%8) & 1);
+                    wrong += tile_matrix_get_bit(ma,row,col) != expected;
+                    wrong += tile_matrix_get_bit(mb,row,col) != expected;
+                }
+                for (size_t col=0; col<TILES_SPANNING(aug)*TILE_SIZE; col++) {
+                    int expected = (col < aug) && (augdata[row][col/8] >> (col%8) & 1);
+                    wrong += tile_matrix_get_aug_bit(ma,row,col) != expected;
+                    wrong += tile_matrix_get_aug_bit(mb,row,col) != expected;
+                }
+            }
+            if (wrong) printf("%d x %zu + %zu: %d bits wrong\n", rows, cols, aug, wrong);
+            bad += wrong;
+            tile_matrix_destroy(ma);
+            tile_matrix_destroy(mb);
+        }
+        if (bad) return 1;
+        printf("rows ok\n");
     } else if (!strcmp(mode,"mul")) {
         int rows=10000, match=10000, cols=10000, ntrials=1;
         if (argc >= 3) rows = cols = match = atoll(argv[2]);
@@ -98,7 +143,7 @@ int main (int argc, char **argv) {
             tile_matrix_randomize(mb);
         }
     } else {
-        fprintf(stderr,"mode must be test, reduce, mul or rand\n");
+        fprintf(stderr,"mode must be test, reduce, sys, rows, mul or rand\n");
     }
 
     return 0;